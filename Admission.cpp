@@ -0,0 +1,344 @@
+/******************************************************************************
+
+  Admission.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include <sstream>
+
+#include "Admission.h"
+
+// OpenSSH's MaxStartups begins dropping unauthenticated connections at 10,
+// and its MaxSessions allows 10 sessions per connection. The handshake
+// limit leaves room for the user's own ssh.
+#define ADMISSION_HANDSHAKE_LIMIT 8
+#define ADMISSION_CHANNEL_LIMIT 10
+
+// Seconds a limit learned from a refusal is kept.
+#define ADMISSION_LEARNED_TTL 600
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::instance
+
+  *-----------------------------------------------------------------------------*/
+
+Admission& Admission::instance()
+{
+  static Admission admission;
+  return admission;
+}
+
+
+Admission::Admission()
+  : m_handshakeLimit(ADMISSION_HANDSHAKE_LIMIT),
+    m_channelLimit(ADMISSION_CHANNEL_LIMIT)
+{
+}
+
+
+std::string Admission::makeKey(const std::string& hostName, unsigned int port)
+{
+  std::stringstream key;
+  key << hostName << ":" << port;
+  return key.str();
+}
+
+
+// Sessions are keyed user@hostName:port; every account on a host shares the
+// host's channel limit.
+std::string Admission::hostOf(PooledSessionPtr session)
+{
+  const std::string& key = session->getKey();
+  return key.substr(key.rfind('@') + 1);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::admitHandshake
+
+  *-----------------------------------------------------------------------------*/
+
+void Admission::admitHandshake(const std::string& hostName, unsigned int port,
+                               ReactorLoop *loop, const Grant& grant)
+{
+  std::string key = makeKey(hostName, port);
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  admit(m_handshakes[key], limit(m_handshakeLimits, key, m_handshakeLimit), loop, grant);
+}
+
+
+void Admission::finishHandshake(const std::string& hostName, unsigned int port)
+{
+  std::string key = makeKey(hostName, port);
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, Gate>::iterator it = m_handshakes.find(key);
+  if (it == m_handshakes.end())
+    return;
+
+  release(it->second, limit(m_handshakeLimits, key, m_handshakeLimit));
+
+  if (it->second.inUse == 0 && it->second.waiters.empty())
+    m_handshakes.erase(it);
+}
+
+
+bool Admission::handshakeRefused(const std::string& hostName, unsigned int port)
+{
+  std::string key = makeKey(hostName, port);
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, Gate>::iterator it = m_handshakes.find(key);
+  if (it == m_handshakes.end())
+    return false;
+
+  bool busy = refused(m_handshakeLimits, key, m_handshakeLimit, it->second);
+
+  if (it->second.inUse == 0 && it->second.waiters.empty())
+    m_handshakes.erase(it);
+
+  return busy;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::admitChannel
+
+  *-----------------------------------------------------------------------------*/
+
+void Admission::admitChannel(PooledSessionPtr session, const Grant& grant)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  admit(channelGate(session), limit(m_channelLimits, hostOf(session), m_channelLimit),
+        session->getLoop(), grant);
+}
+
+
+void Admission::releaseChannel(PooledSessionPtr session)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<PooledSession *, ChannelGate>::iterator it = m_channels.find(session.get());
+  if (it == m_channels.end() || it->second.session.lock() != session)
+    return;
+
+  release(it->second, limit(m_channelLimits, hostOf(session), m_channelLimit));
+
+  if (it->second.inUse == 0 && it->second.waiters.empty())
+    m_channels.erase(it);
+}
+
+
+bool Admission::channelRefused(PooledSessionPtr session)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<PooledSession *, ChannelGate>::iterator it = m_channels.find(session.get());
+  if (it == m_channels.end() || it->second.session.lock() != session)
+    return false;
+
+  bool busy = refused(m_channelLimits, hostOf(session), m_channelLimit, it->second);
+
+  if (it->second.inUse == 0 && it->second.waiters.empty())
+    m_channels.erase(it);
+
+  return busy;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::channelGate
+
+  Gates are made as sessions first ask for channels. Those of sessions that
+  have gone are cleared out then too.
+
+  *-----------------------------------------------------------------------------*/
+
+Admission::ChannelGate& Admission::channelGate(PooledSessionPtr session)
+{
+  std::map<PooledSession *, ChannelGate>::iterator it = m_channels.find(session.get());
+
+  if (it != m_channels.end() && it->second.session.lock() == session)
+    return it->second;
+
+  std::map<PooledSession *, ChannelGate>::iterator next;
+  for (it = m_channels.begin(); it != m_channels.end(); it = next)
+  {
+    next = it;
+    next++;
+
+    if (it->second.session.expired())
+      m_channels.erase(it);
+  }
+
+  ChannelGate& gate = m_channels[session.get()];
+  gate.session = session;
+  return gate;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::limit
+
+  The configured limit, or the one learned for the key if that is lower and
+  has not expired.
+
+  *-----------------------------------------------------------------------------*/
+
+unsigned int Admission::limit(LearnedMap& learned, const std::string& key, unsigned int configured)
+{
+  LearnedMap::iterator it = learned.find(key);
+  if (it == learned.end())
+    return configured;
+
+  if (it->second.expires <= time(NULL))
+  {
+    learned.erase(it);
+    return configured;
+  }
+
+  return it->second.limit < configured ? it->second.limit : configured;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::refused
+
+  Ends the refused turn. If others are still under way their number is the
+  host's limit for now; the refused one asks again, behind those already
+  waiting.
+
+  *-----------------------------------------------------------------------------*/
+
+bool Admission::refused(LearnedMap& learned, const std::string& key, unsigned int configured, Gate& gate)
+{
+  if (gate.inUse)
+    gate.inUse--;
+
+  if (gate.inUse == 0)
+  {
+    wake(gate, limit(learned, key, configured));
+    return false;
+  }
+
+  Learned& entry = learned[key];
+  entry.limit = gate.inUse;
+  entry.expires = time(NULL) + ADMISSION_LEARNED_TTL;
+
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::admit
+
+  *-----------------------------------------------------------------------------*/
+
+void Admission::admit(Gate& gate, unsigned int limit, ReactorLoop *loop, const Grant& grant)
+{
+  Waiter waiter;
+  waiter.loop = loop;
+  waiter.grant = grant;
+
+  gate.waiters.push_back(waiter);
+  wake(gate, limit);
+}
+
+
+void Admission::release(Gate& gate, unsigned int limit)
+{
+  if (gate.inUse)
+    gate.inUse--;
+
+  wake(gate, limit);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Admission::wake
+
+  Gives turns to those waiting, in order, as far as the limit allows.
+
+  *-----------------------------------------------------------------------------*/
+
+void Admission::wake(Gate& gate, unsigned int limit)
+{
+  if (limit < 1)
+    limit = 1;
+
+  while (!gate.waiters.empty() && gate.inUse < limit)
+  {
+    Waiter waiter = gate.waiters.front();
+    gate.waiters.pop_front();
+
+    gate.inUse++;
+    waiter.loop->post(waiter.grant);
+  }
+}
+
+
+unsigned int Admission::getHandshakeLimit()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_handshakeLimit;
+}
+
+
+void Admission::setHandshakeLimit(unsigned int limit)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_handshakeLimit = limit ? limit : 1;
+}
+
+
+unsigned int Admission::getChannelLimit()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_channelLimit;
+}
+
+
+void Admission::setChannelLimit(unsigned int limit)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_channelLimit = limit ? limit : 1;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,161 @@
+/******************************************************************************
+
+  Admission.h
+
+  sshd limits what it will take from one client: MaxStartups caps the
+  connections that have not yet authenticated, and MaxSessions caps the
+  session channels -- SFTP subsystems and commands -- open on one
+  connection. A page that opens many connections at once, each of whose
+  services opens channels of its own, runs into these limits, and sshd
+  answers by dropping connections and refusing channels.
+
+  Admission keeps the plugin within them. A handshake waits for a turn at
+  its host, from connecting until the session is authenticated; a channel
+  waits for a turn on its session, from opening until it is closed. Turns
+  are given in the order they were asked for, on the asker's loop, so
+  nothing fails for want of one.
+
+  The limits are the scripted handshakeLimit and channelLimit, but a host
+  may be configured lower. When a host drops a handshake or refuses a
+  channel while others of ours were under way, the number under way is
+  taken as its limit, and the refused handshake or channel waits for
+  another turn instead of failing. A learned limit is forgotten after a
+  while, in case the host was only busy.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Admission
+#define H_Admission
+
+#include <ctime>
+#include <deque>
+#include <map>
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Reactor.h"
+#include "SessionPool.h"
+
+
+class Admission
+{
+ public:
+  typedef boost::function<void ()> Grant;
+
+  static Admission& instance();
+
+  // Posts grant to loop once a handshake with the host may start. The
+  // caller holds the turn until it calls finishHandshake or
+  // handshakeRefused, whether or not the handshake got anywhere.
+  void admitHandshake(const std::string& hostName, unsigned int port,
+                      ReactorLoop *loop, const Grant& grant);
+  void finishHandshake(const std::string& hostName, unsigned int port);
+
+  // Ends the turn of a handshake the host dropped before it finished.
+  // Returns true if others were under way, in which case the host is taken
+  // to be at its limit and the caller should ask for another turn.
+  bool handshakeRefused(const std::string& hostName, unsigned int port);
+
+  // Posts grant to the session's loop once a channel may be opened on it.
+  // The caller holds the turn until the channel is closed, or until it
+  // fails to open; then it calls releaseChannel or channelRefused.
+  void admitChannel(PooledSessionPtr session, const Grant& grant);
+  void releaseChannel(PooledSessionPtr session);
+
+  // As handshakeRefused, for a channel the session's host refused.
+  bool channelRefused(PooledSessionPtr session);
+
+  // The most handshakes under way with one host, and channels open on
+  // one session; at least 1.
+  unsigned int getHandshakeLimit();
+  void setHandshakeLimit(unsigned int limit);
+  unsigned int getChannelLimit();
+  void setChannelLimit(unsigned int limit);
+
+ private:
+  Admission();
+
+  struct Waiter
+  {
+    ReactorLoop *loop;
+    Grant grant;
+  };
+
+  struct Gate
+  {
+    Gate() : inUse(0) {}
+
+    unsigned int inUse;
+    std::deque<Waiter> waiters;
+  };
+
+  // A channel gate remembers its session, so that a gate left by a session
+  // that has gone is not taken for that of a new one at the same address.
+  struct ChannelGate : public Gate
+  {
+    PooledSessionWeakPtr session;
+  };
+
+  struct Learned
+  {
+    unsigned int limit;
+    time_t expires;
+  };
+
+  typedef std::map<std::string, Learned> LearnedMap;
+
+  static std::string makeKey(const std::string& hostName, unsigned int port);
+  static std::string hostOf(PooledSessionPtr session);
+
+  ChannelGate& channelGate(PooledSessionPtr session);
+  unsigned int limit(LearnedMap& learned, const std::string& key, unsigned int configured);
+  bool refused(LearnedMap& learned, const std::string& key, unsigned int configured, Gate& gate);
+  void admit(Gate& gate, unsigned int limit, ReactorLoop *loop, const Grant& grant);
+  void release(Gate& gate, unsigned int limit);
+  void wake(Gate& gate, unsigned int limit);
+
+  boost::mutex m_mutex;
+
+  std::map<std::string, Gate> m_handshakes;
+  std::map<PooledSession *, ChannelGate> m_channels;
+
+  // Limits learned from refusals, by host:port for handshakes and by host
+  // for channels.
+  LearnedMap m_handshakeLimits;
+  LearnedMap m_channelLimits;
+
+  unsigned int m_handshakeLimit;
+  unsigned int m_channelLimit;
+};
+
+#endif // H_Admission
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
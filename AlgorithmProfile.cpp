@@ -0,0 +1,289 @@
+/******************************************************************************
+
+  AlgorithmProfile.cpp
+
+  AlgorithmProfile sets a new session's preferences for key exchange,
+  ciphers and MACs before the handshake.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <time.h>
+
+#include <gcrypt.h>
+
+#include "AlgorithmProfile.h"
+
+// Bytes pushed through each candidate by the speed probe.
+#define PROBE_SIZE 1048576
+
+#define BULK_CIPHERS "aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com," \
+                     "aes128-ctr,aes192-ctr,aes256-ctr"
+#define BULK_MACS "hmac-sha2-256,hmac-sha1,hmac-sha2-512"
+
+#define INTERACTIVE_KEX "curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256," \
+                        "diffie-hellman-group14-sha256,diffie-hellman-group-exchange-sha256," \
+                        "diffie-hellman-group14-sha1"
+#define INTERACTIVE_CIPHERS "chacha20-poly1305@openssh.com,aes128-ctr,aes128-gcm@openssh.com,aes256-ctr"
+#define INTERACTIVE_MACS "hmac-sha2-256,hmac-sha1"
+
+// Appended to the probed orders, so that servers supporting none of the
+// probed algorithms can still be reached.
+#define FALLBACK_CIPHERS "aes192-ctr,aes256-cbc,aes192-cbc,aes128-cbc,3des-cbc"
+#define FALLBACK_MACS "hmac-sha1-96,hmac-md5"
+
+
+struct CipherCandidate
+{
+  const char *name;
+  int algorithm;
+  int mode;
+};
+
+static const CipherCandidate cipherCandidates[] = {
+  { "aes128-ctr", GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CTR },
+  { "aes256-ctr", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CTR },
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+  { "aes128-gcm@openssh.com", GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_GCM },
+  { "aes256-gcm@openssh.com", GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM },
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700
+  { "chacha20-poly1305@openssh.com", GCRY_CIPHER_CHACHA20, GCRY_CIPHER_MODE_STREAM },
+#endif
+};
+
+struct MacCandidate
+{
+  const char *name;
+  int algorithm;
+};
+
+static const MacCandidate macCandidates[] = {
+  { "hmac-sha2-256", GCRY_MD_SHA256 },
+  { "hmac-sha2-512", GCRY_MD_SHA512 },
+  { "hmac-sha1",     GCRY_MD_SHA1 },
+};
+
+
+static double elapsed(const struct timespec& start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1000000.0 + (end.tv_nsec - start.tv_nsec) / 1000.0;
+}
+
+
+// Microseconds to encrypt buffer, or a negative number if the cipher is
+// not available.
+static double timeCipher(const CipherCandidate& candidate, std::vector<unsigned char>& buffer)
+{
+  gcry_cipher_hd_t handle;
+  if (gcry_cipher_open(&handle, candidate.algorithm, candidate.mode, 0))
+    return -1;
+
+  unsigned char key[32] = { 0 };
+  unsigned char iv[16] = { 0 };
+
+  gcry_cipher_setkey(handle, key, gcry_cipher_get_algo_keylen(candidate.algorithm));
+  if (candidate.mode == GCRY_CIPHER_MODE_CTR)
+    gcry_cipher_setctr(handle, iv, sizeof(iv));
+  else
+    gcry_cipher_setiv(handle, iv, 12);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  gcry_error_t error = gcry_cipher_encrypt(handle, &buffer[0], buffer.size(), NULL, 0);
+  double time = elapsed(start);
+
+  gcry_cipher_close(handle);
+  return error ? -1 : time;
+}
+
+
+static double timeMac(const MacCandidate& candidate, std::vector<unsigned char>& buffer)
+{
+  gcry_md_hd_t handle;
+  if (gcry_md_open(&handle, candidate.algorithm, GCRY_MD_FLAG_HMAC))
+    return -1;
+
+  unsigned char key[32] = { 0 };
+  gcry_md_setkey(handle, key, sizeof(key));
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  gcry_md_write(handle, &buffer[0], buffer.size());
+  gcry_md_read(handle, 0);
+  double time = elapsed(start);
+
+  gcry_md_close(handle);
+  return time;
+}
+
+
+static std::string join(std::vector<std::pair<double, std::string> >& timed, const char *fallback)
+{
+  std::sort(timed.begin(), timed.end());
+
+  std::string names;
+  for (size_t i = 0; i < timed.size(); i++)
+  {
+    names.append(timed[i].second);
+    names.append(",");
+  }
+
+  names.append(fallback);
+  return names;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  AlgorithmProfile::instance
+
+  *-----------------------------------------------------------------------------*/
+
+AlgorithmProfile& AlgorithmProfile::instance()
+{
+  static AlgorithmProfile profile;
+  return profile;
+}
+
+
+AlgorithmProfile::AlgorithmProfile()
+  : m_probed(false)
+{
+}
+
+
+bool AlgorithmProfile::isProfile(const std::string& name)
+{
+  return name == "auto" || name == "bulk" || name == "interactive" || name == "compat";
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  AlgorithmProfile::apply
+
+  *-----------------------------------------------------------------------------*/
+
+int AlgorithmProfile::apply(const std::string& name, LIBSSH2_SESSION *session)
+{
+  int rc = 0;
+
+  if (name == "bulk")
+  {
+    if ((rc = prefer(session, LIBSSH2_METHOD_CRYPT_CS, BULK_CIPHERS)) == 0)
+      rc = prefer(session, LIBSSH2_METHOD_MAC_CS, BULK_MACS);
+  }
+  else if (name == "interactive")
+  {
+    if ((rc = libssh2_session_method_pref(session, LIBSSH2_METHOD_KEX, INTERACTIVE_KEX)) == 0
+        && (rc = prefer(session, LIBSSH2_METHOD_CRYPT_CS, INTERACTIVE_CIPHERS)) == 0)
+      rc = prefer(session, LIBSSH2_METHOD_MAC_CS, INTERACTIVE_MACS);
+  }
+  else if (name == "auto")
+  {
+    std::string ciphers;
+    std::string macs;
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+
+      if (!m_probed)
+        probe();
+
+      ciphers = m_ciphers;
+      macs = m_macs;
+    }
+
+    if ((rc = prefer(session, LIBSSH2_METHOD_CRYPT_CS, ciphers.c_str())) == 0)
+      rc = prefer(session, LIBSSH2_METHOD_MAC_CS, macs.c_str());
+  }
+
+  return rc;
+}
+
+
+// Sets a preference for both directions; method is the client to server
+// one, which libssh2 numbers just before server to client.
+int AlgorithmProfile::prefer(LIBSSH2_SESSION *session, int method, const char *names)
+{
+  int rc;
+  if ((rc = libssh2_session_method_pref(session, method, names)) != 0)
+    return rc;
+
+  return libssh2_session_method_pref(session, method + 1, names);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  AlgorithmProfile::probe
+
+  Times each candidate over the same buffer. The AEAD ciphers are timed
+  without their authentication, which only narrows their lead over a
+  separate MAC. Called with the mutex held.
+
+  *-----------------------------------------------------------------------------*/
+
+void AlgorithmProfile::probe()
+{
+  gcry_check_version(NULL);
+
+  std::vector<unsigned char> buffer(PROBE_SIZE, 0x5a);
+  std::vector<std::pair<double, std::string> > timed;
+
+  for (size_t i = 0; i < sizeof(cipherCandidates) / sizeof(cipherCandidates[0]); i++)
+  {
+    double time = timeCipher(cipherCandidates[i], buffer);
+    if (time >= 0)
+      timed.push_back(std::make_pair(time, std::string(cipherCandidates[i].name)));
+  }
+
+  m_ciphers = join(timed, FALLBACK_CIPHERS);
+
+  timed.clear();
+  for (size_t i = 0; i < sizeof(macCandidates) / sizeof(macCandidates[0]); i++)
+  {
+    double time = timeMac(macCandidates[i], buffer);
+    if (time >= 0)
+      timed.push_back(std::make_pair(time, std::string(macCandidates[i].name)));
+  }
+
+  m_macs = join(timed, FALLBACK_MACS);
+  m_probed = true;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
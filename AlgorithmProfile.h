@@ -0,0 +1,83 @@
+/******************************************************************************
+
+  AlgorithmProfile.h
+
+  AlgorithmProfile sets a new session's preferences for key exchange,
+  ciphers and MACs before the handshake, by name:
+
+    bulk         fastest ciphers for large SFTP transfers
+    interactive  quickest key exchange, for short-lived connections
+    compat       libssh2's defaults, for old servers
+    auto         ciphers and MACs in order of their speed on this machine
+
+  The auto order comes from timing each candidate once per process. The
+  server picks the first of our preferences it also supports, so putting
+  the fastest first gets the fastest algorithm the two have in common.
+  Names libssh2 does not support are dropped by libssh2 itself.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_AlgorithmProfile
+#define H_AlgorithmProfile
+
+#include <string>
+
+#include <libssh2.h>
+
+#include <boost/thread/mutex.hpp>
+
+
+class AlgorithmProfile
+{
+ public:
+  static AlgorithmProfile& instance();
+
+  static bool isProfile(const std::string& name);
+
+  // Sets the preferences of the named profile on a session that has not
+  // started yet. Returns 0, or the error from libssh2_session_method_pref.
+  int apply(const std::string& name, LIBSSH2_SESSION *session);
+
+ private:
+  AlgorithmProfile();
+
+  static int prefer(LIBSSH2_SESSION *session, int method, const char *names);
+  void probe();
+
+  boost::mutex m_mutex;
+  bool m_probed;
+
+  // Comma-separated, fastest first.
+  std::string m_ciphers;
+  std::string m_macs;
+};
+
+#endif // H_AlgorithmProfile
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,250 @@
+/******************************************************************************
+
+  CompressionPolicy.cpp
+
+  CompressionPolicy decides whether a new session should ask for zlib
+  transport compression.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <zlib.h>
+
+#include "CompressionPolicy.h"
+
+// Links with a smoothed round-trip time below this many microseconds are
+// taken to be local networks.
+#define LAN_RTT 2000
+
+// Transfers shorter than this say more about latency than bandwidth.
+#define MIN_MEASURED_TRANSFER 65536
+
+// Size of the text compressed by the zlib probe.
+#define PROBE_SIZE 262144
+
+
+/*-----------------------------------------------------------------------------*
+
+  CompressionPolicy::instance
+
+  *-----------------------------------------------------------------------------*/
+
+CompressionPolicy& CompressionPolicy::instance()
+{
+  static CompressionPolicy policy;
+  return policy;
+}
+
+
+CompressionPolicy::CompressionPolicy()
+  : m_compressionRate(0)
+{
+}
+
+
+std::string CompressionPolicy::modeName(Mode mode)
+{
+  switch (mode)
+  {
+  case COMPRESSION_ON:
+    return "on";
+
+  case COMPRESSION_OFF:
+    return "off";
+
+  default:
+    return "auto";
+  }
+}
+
+
+bool CompressionPolicy::parseMode(const std::string& name, Mode& mode)
+{
+  if (name == "auto")
+    mode = COMPRESSION_AUTO;
+
+  else if (name == "on")
+    mode = COMPRESSION_ON;
+
+  else if (name == "off")
+    mode = COMPRESSION_OFF;
+
+  else
+    return false;
+
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  CompressionPolicy::choose
+
+  A link whose bandwidth is known is compressed if zlib can keep ahead of
+  it. Otherwise the round-trip time of the handshake stands in for it.
+
+  *-----------------------------------------------------------------------------*/
+
+bool CompressionPolicy::choose(Mode mode, const std::string& address, int sock)
+{
+  if (mode != COMPRESSION_AUTO)
+    return mode == COMPRESSION_ON;
+
+  if (isLoopback(sock))
+    return false;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::map<std::string, double>::iterator it = m_bandwidth.find(address);
+    if (it != m_bandwidth.end())
+    {
+      if (m_compressionRate == 0)
+        m_compressionRate = probe();
+
+      return it->second < m_compressionRate;
+    }
+  }
+
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+    return info.tcpi_rtt >= LAN_RTT;
+#endif
+
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  CompressionPolicy::recordTransfer
+
+  Keeps a moving average, so one transfer slowed by the far end does not
+  decide every later session.
+
+  *-----------------------------------------------------------------------------*/
+
+void CompressionPolicy::recordTransfer(const std::string& address, size_t bytes, unsigned int milliseconds)
+{
+  if (bytes < MIN_MEASURED_TRANSFER || address.empty())
+    return;
+
+  double bandwidth = (double) bytes / (milliseconds ? milliseconds : 1);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, double>::iterator it = m_bandwidth.find(address);
+  if (it == m_bandwidth.end())
+    m_bandwidth[address] = bandwidth;
+  else
+    it->second = 0.75 * it->second + 0.25 * bandwidth;
+}
+
+
+bool CompressionPolicy::isLoopback(int sock)
+{
+  struct sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+
+  if (getpeername(sock, (struct sockaddr *) &addr, &length) != 0)
+    return false;
+
+  if (addr.ss_family == AF_INET)
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) &addr;
+    return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+  }
+
+  if (addr.ss_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &addr;
+    if (IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr))
+      return true;
+
+    return IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr) && in6->sin6_addr.s6_addr[12] == 127;
+  }
+
+  return false;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  CompressionPolicy::probe
+
+  Times zlib at libssh2's compression level on text much like what the
+  file service moves: configuration files and logs. Returns bytes of input
+  per millisecond.
+
+  *-----------------------------------------------------------------------------*/
+
+unsigned int CompressionPolicy::probe()
+{
+  std::string text;
+  for (int line = 0; text.size() < PROBE_SIZE; line++)
+  {
+    std::stringstream s;
+    s << "Oct 17 12:" << (line / 60) % 60 << ":" << line % 60
+      << " host sshd[" << 1000 + line % 97 << "]: session opened for user"
+      << " u" << line % 13 << " path=/home/u" << line % 13 << "/src/file" << line % 31 << ".c\n";
+    text.append(s.str());
+  }
+
+  uLongf length = compressBound(text.size());
+  std::vector<Bytef> buffer(length);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (compress2(&buffer[0], &length, (const Bytef *) text.data(), text.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+    return 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double milliseconds = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  if (milliseconds <= 0)
+    milliseconds = 0.001;
+
+  unsigned int rate = (unsigned int) (text.size() / milliseconds);
+  return rate ? rate : 1;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
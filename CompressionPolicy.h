@@ -0,0 +1,88 @@
+/******************************************************************************
+
+  CompressionPolicy.h
+
+  CompressionPolicy decides whether a new session should ask for zlib
+  transport compression. Compression pays when the link is slower than zlib
+  on this machine and costs when it is faster, so the policy compares the
+  two: zlib's speed is probed once per process, and the link's bandwidth is
+  learned from uncompressed transfers to the same address. Until a link has
+  been measured, loopback and low-latency links are taken to be fast and
+  anything else slow.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_CompressionPolicy
+#define H_CompressionPolicy
+
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+
+class CompressionPolicy
+{
+ public:
+  enum Mode {
+    COMPRESSION_AUTO,
+    COMPRESSION_ON,
+    COMPRESSION_OFF
+  };
+
+  static CompressionPolicy& instance();
+
+  // The names used for modes in script: "auto", "on" and "off".
+  static std::string modeName(Mode mode);
+  static bool parseMode(const std::string& name, Mode& mode);
+
+  // Whether to compress a session about to start on sock, which is
+  // connected to address.
+  bool choose(Mode mode, const std::string& address, int sock);
+
+  // Records that bytes arrived from address in milliseconds over an
+  // uncompressed session.
+  void recordTransfer(const std::string& address, size_t bytes, unsigned int milliseconds);
+
+ private:
+  CompressionPolicy();
+
+  static bool isLoopback(int sock);
+  static unsigned int probe();
+
+  boost::mutex m_mutex;
+
+  // Bytes per millisecond: zlib's, 0 until probed, and each link's.
+  unsigned int m_compressionRate;
+  std::map<std::string, double> m_bandwidth;
+};
+
+#endif // H_CompressionPolicy
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
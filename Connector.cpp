@@ -0,0 +1,329 @@
+/******************************************************************************
+
+  Connector.cpp
+
+  Connector opens a TCP connection to one of a host's addresses, racing the
+  addresses in the manner of RFC 8305 ("Happy Eyeballs").
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <libssh2.h>
+
+#include <boost/bind.hpp>
+
+#include "Connector.h"
+
+
+/*-----------------------------------------------------------------------------*
+
+  Connector::Connector
+
+  Orders the addresses for the race: the resolver's order is kept within
+  each family, and the families alternate, starting with the family of the
+  resolver's first choice.
+
+  *-----------------------------------------------------------------------------*/
+
+Connector::Connector(ReactorLoop *loop,
+                     const struct addrinfo *addresses,
+                     unsigned int attemptTimeout,
+                     unsigned int overallTimeout,
+                     unsigned int attemptDelay)
+  : m_loop(loop),
+    m_attemptTimeout(attemptTimeout),
+    m_overallTimeout(overallTimeout),
+    m_attemptDelay(attemptDelay),
+    m_finished(false),
+    m_next(0),
+    m_sock(-1)
+{
+  std::vector<Address> first;
+  std::vector<Address> second;
+
+  for (const struct addrinfo *p = addresses; p != NULL; p = p->ai_next)
+  {
+    Address address;
+    address.family = p->ai_family;
+    address.socktype = p->ai_socktype;
+    address.protocol = p->ai_protocol;
+    address.addrlen = p->ai_addrlen;
+    memcpy(&address.addr, p->ai_addr, p->ai_addrlen);
+
+    if (p->ai_family == addresses->ai_family)
+      first.push_back(address);
+    else
+      second.push_back(address);
+  }
+
+  for (size_t i = 0; i < first.size() || i < second.size(); i++)
+  {
+    if (i < first.size())
+      m_addresses.push_back(first[i]);
+
+    if (i < second.size())
+      m_addresses.push_back(second[i]);
+  }
+}
+
+
+Connector::~Connector()
+{
+}
+
+
+void Connector::start(const ReactorLoop::Completion& done)
+{
+  m_done = done;
+  m_loop->post(boost::bind(&Connector::begin, shared_from_this()));
+}
+
+
+void Connector::cancel()
+{
+  if (!m_loop->isLoopThread())
+  {
+    m_loop->post(boost::bind(&Connector::cancel, shared_from_this()));
+    return;
+  }
+
+  if (!m_finished)
+    finish(CONNECT_CANCELED);
+}
+
+
+int Connector::getSocket() const
+{
+  return m_sock;
+}
+
+
+const std::string& Connector::getAddress() const
+{
+  return m_address;
+}
+
+
+std::string Connector::formatAddress(const Address& address)
+{
+  char host[NI_MAXHOST];
+
+  if (getnameinfo((const struct sockaddr *) &address.addr, address.addrlen,
+                  host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+    return "";
+
+  return host;
+}
+
+
+void Connector::begin()
+{
+  if (m_finished)
+    return;
+
+  m_loop->schedule(m_overallTimeout, boost::bind(&Connector::deadlineReached, shared_from_this()));
+  startNext();
+}
+
+
+static int connectDirections()
+{
+  return LIBSSH2_SESSION_BLOCK_OUTBOUND;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Connector::startNext
+
+  Starts an attempt on the next address that a socket can be created for.
+  Gives up if there are no addresses left and no attempts in progress.
+
+  *-----------------------------------------------------------------------------*/
+
+void Connector::startNext()
+{
+  while (m_next < m_addresses.size())
+  {
+    size_t index = m_next++;
+    const Address& address = m_addresses[index];
+
+    int sock;
+    if ((sock = socket(address.family, address.socktype, address.protocol)) == -1)
+      continue;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(sock, (const struct sockaddr *) &address.addr, address.addrlen) != 0
+        && errno != EINPROGRESS)
+    {
+      close(sock);
+      continue;
+    }
+
+    m_attempts[sock] = index;
+
+    m_loop->attach(sock, connectDirections);
+    m_loop->submit(sock,
+                   boost::bind(&Connector::stepAttempt, shared_from_this(), sock),
+                   boost::bind(&Connector::attemptFinished, shared_from_this(), sock, _1));
+
+    m_loop->schedule(m_attemptTimeout,
+                     boost::bind(&Connector::attemptTimedOut, shared_from_this(), index));
+
+    if (m_next < m_addresses.size())
+      m_loop->schedule(m_attemptDelay,
+                       boost::bind(&Connector::attemptDelayPassed, shared_from_this(), index));
+    return;
+  }
+
+  if (m_attempts.empty())
+    finish(CONNECT_FAILED);
+}
+
+
+int Connector::stepAttempt(int sock)
+{
+  struct pollfd fd;
+  fd.fd = sock;
+  fd.events = POLLOUT;
+  fd.revents = 0;
+
+  if (poll(&fd, 1, 0) == 0)
+    return LIBSSH2_ERROR_EAGAIN;
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+    return CONNECT_FAILED;
+
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Connector::attemptFinished
+
+  Called when an attempt connects or fails, and for the attempts that are
+  detached when they time out or lose the race.
+
+  *-----------------------------------------------------------------------------*/
+
+void Connector::attemptFinished(int sock, int rc)
+{
+  m_loop->detach(sock);
+
+  std::map<int, size_t>::iterator it = m_attempts.find(sock);
+  size_t index = it != m_attempts.end() ? it->second : 0;
+  if (it != m_attempts.end())
+    m_attempts.erase(it);
+
+  if (m_finished)
+    close(sock);
+
+  else if (rc == 0)
+  {
+    m_sock = sock;
+    m_address = formatAddress(m_addresses[index]);
+    finish(0);
+  }
+  else
+  {
+    close(sock);
+    startNext();
+  }
+}
+
+
+void Connector::attemptTimedOut(size_t index)
+{
+  if (m_finished)
+    return;
+
+  for (std::map<int, size_t>::iterator it = m_attempts.begin(); it != m_attempts.end(); it++)
+    if (it->second == index)
+    {
+      m_loop->detach(it->first);
+      break;
+    }
+}
+
+
+// Starts the next attempt, unless a failure has already started it.
+void Connector::attemptDelayPassed(size_t index)
+{
+  if (!m_finished && m_next == index + 1)
+    startNext();
+}
+
+
+void Connector::deadlineReached()
+{
+  if (!m_finished)
+    finish(CONNECT_TIMED_OUT);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Connector::finish
+
+  Abandons the attempts still in progress and reports the result.
+
+  *-----------------------------------------------------------------------------*/
+
+void Connector::finish(int rc)
+{
+  ConnectorPtr self = shared_from_this();
+
+  m_finished = true;
+
+  std::vector<int> abandoned;
+  for (std::map<int, size_t>::iterator it = m_attempts.begin(); it != m_attempts.end(); it++)
+    abandoned.push_back(it->first);
+
+  for (size_t i = 0; i < abandoned.size(); i++)
+    m_loop->detach(abandoned[i]);
+
+  ReactorLoop::Completion done = m_done;
+  m_done.clear();
+
+  if (done)
+    done(rc);
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,138 @@
+/******************************************************************************
+
+  Connector.h
+
+  Connector opens a TCP connection to one of a host's addresses, racing the
+  addresses in the manner of RFC 8305 ("Happy Eyeballs"). The addresses are
+  interleaved by family, starting with the family of the first address the
+  resolver returned. A new attempt is started each time the attempt delay
+  passes without a connection, or as soon as an attempt fails, so a dead
+  address costs at most the attempt delay rather than the kernel's TCP
+  timeout. Each attempt has its own deadline, and the connector as a whole
+  has another. The first attempt to connect wins and the rest are closed.
+
+  Connector runs entirely on one ReactorLoop.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Connector
+#define H_Connector
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+
+
+FB_FORWARD_PTR(Connector)
+
+class Connector : public boost::enable_shared_from_this<Connector>
+{
+ public:
+  // Results passed to the completion besides 0.
+  enum Failure {
+    CONNECT_FAILED = -1,
+    CONNECT_TIMED_OUT = -2,
+    CONNECT_CANCELED = -3
+  };
+
+  // The delay between starting attempts recommended by RFC 8305.
+  static const unsigned int DEFAULT_ATTEMPT_DELAY = 250;
+
+  // Copies addresses; the caller may free them once this returns.
+  Connector(ReactorLoop *loop,
+            const struct addrinfo *addresses,
+            unsigned int attemptTimeout,
+            unsigned int overallTimeout,
+            unsigned int attemptDelay = DEFAULT_ATTEMPT_DELAY);
+
+  ~Connector();
+
+  // Starts connecting. done is called exactly once, on the loop thread.
+  void start(const ReactorLoop::Completion& done);
+
+  // Abandons the connection; done is called with CONNECT_CANCELED unless it
+  // has been called already.
+  void cancel();
+
+  // After success, the connected socket, which is then the caller's to
+  // close; and the numeric address it is connected to.
+  int getSocket() const;
+  const std::string& getAddress() const;
+
+ private:
+  struct Address
+  {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+  };
+
+  static std::string formatAddress(const Address& address);
+
+  void begin();
+  void startNext();
+  int stepAttempt(int sock);
+  void attemptFinished(int sock, int rc);
+  void attemptTimedOut(size_t index);
+  void attemptDelayPassed(size_t index);
+  void deadlineReached();
+  void finish(int rc);
+
+  ReactorLoop *m_loop;
+  std::vector<Address> m_addresses;
+  unsigned int m_attemptTimeout;
+  unsigned int m_overallTimeout;
+  unsigned int m_attemptDelay;
+
+  ReactorLoop::Completion m_done;
+  bool m_finished;
+  size_t m_next;
+
+  // Sockets of attempts in progress, and the index of their address.
+  std::map<int, size_t> m_attempts;
+
+  int m_sock;
+  std::string m_address;
+};
+
+#endif // H_Connector
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,657 @@
+/******************************************************************************
+
+  ControlMaster.cpp
+
+  ControlMaster finds OpenSSH control sockets; MuxRequest opens sessions
+  through them.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <libssh2.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "ControlMaster.h"
+#include "WireFormat.h"
+
+
+extern char **environ;
+
+// Seconds a control path found with "ssh -G" is trusted before asking again,
+// in case ssh_config has changed.
+#define CONTROL_PATH_TTL 300
+
+// From PROTOCOL.mux.
+#define SSHMUX_VER 4
+#define MUX_MSG_HELLO 0x00000001
+#define MUX_C_NEW_SESSION 0x10000002
+#define MUX_S_PERMISSION_DENIED 0x80000002
+#define MUX_S_FAILURE 0x80000003
+#define MUX_S_SESSION_OPENED 0x80000006
+
+// ssh's SSH_ESCAPECHAR_NONE; no escape character is wanted without a tty.
+#define ESCAPE_CHAR_NONE 0xfffffffe
+
+// Longest control message accepted from the master.
+#define MAX_MESSAGE_SIZE 262144
+
+#define REQUEST_ID 1
+
+#define BROKER_PATH ".jshs/broker.sock"
+#define BROKER_ACCOUNT_VARIABLE "JSHS_ACCOUNT="
+
+
+/*-----------------------------------------------------------------------------*
+
+  ControlMaster::instance
+
+  *-----------------------------------------------------------------------------*/
+
+ControlMaster& ControlMaster::instance()
+{
+  static ControlMaster master;
+  return master;
+}
+
+
+ControlMaster::ControlMaster()
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ControlMaster::find
+
+  *-----------------------------------------------------------------------------*/
+
+void ControlMaster::find(const std::string& user,
+                         const std::string& hostName,
+                         unsigned int port,
+                         ReactorLoop *loop,
+                         const Callback& done)
+{
+  std::stringstream key;
+  key << user << "@" << hostName << ":" << port;
+
+  Waiter waiter;
+  waiter.loop = loop;
+  waiter.done = done;
+
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, Entry>::iterator it = m_entries.find(key.str());
+  if (it != m_entries.end())
+  {
+    Entry& entry = it->second;
+    if (entry.finding)
+    {
+      entry.waiters.push_back(waiter);
+      return;
+    }
+
+    if (entry.expires > time(NULL))
+    {
+      loop->post(boost::bind(done, entry.path));
+      return;
+    }
+  }
+
+  Entry& entry = m_entries[key.str()];
+  entry.finding = true;
+  entry.path = "";
+  entry.waiters.push_back(waiter);
+
+  boost::thread(boost::bind(&ControlMaster::lookup, this, key.str(), user, hostName, port)).detach();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ControlMaster::lookup
+
+  Runs on a thread of its own, since it waits for ssh.
+
+  *-----------------------------------------------------------------------------*/
+
+void ControlMaster::lookup(const std::string& key,
+                           const std::string& user,
+                           const std::string& hostName,
+                           unsigned int port)
+{
+  std::string path = runSsh(user, hostName, port);
+  std::vector<Waiter> waiters;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    Entry& entry = m_entries[key];
+    entry.finding = false;
+    entry.path = path;
+    entry.expires = time(NULL) + CONTROL_PATH_TTL;
+    waiters.swap(entry.waiters);
+  }
+
+  for (size_t i = 0; i < waiters.size(); i++)
+    waiters[i].loop->post(boost::bind(waiters[i].done, path));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ControlMaster::runSsh
+
+  Runs "ssh -G", which prints the configuration ssh would use for the
+  account, and returns its controlpath. ssh is spawned rather than forked,
+  as the plugin shares its process with the browser's threads.
+
+  *-----------------------------------------------------------------------------*/
+
+std::string ControlMaster::runSsh(const std::string& user, const std::string& hostName, unsigned int port)
+{
+  int out[2];
+  if (pipe2(out, O_CLOEXEC))
+    return "";
+
+  std::stringstream portText;
+  portText << port;
+
+  std::string args[] = { "ssh", "-G", "-l", user, "-p", portText.str(), "--", hostName };
+  char *argv[sizeof(args) / sizeof(args[0]) + 1];
+  for (size_t i = 0; i < sizeof(args) / sizeof(args[0]); i++)
+    argv[i] = const_cast<char *>(args[i].c_str());
+  argv[sizeof(args) / sizeof(args[0])] = NULL;
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+  pid_t pid;
+  int rc = posix_spawnp(&pid, "ssh", &actions, NULL, argv, environ);
+
+  posix_spawn_file_actions_destroy(&actions);
+  close(out[1]);
+
+  std::string output;
+  if (rc == 0)
+  {
+    char buffer[4096];
+    ssize_t n;
+
+    while ((n = read(out[0], buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR))
+      if (n > 0)
+        output.append(buffer, n);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      ;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      output = "";
+  }
+
+  close(out[0]);
+
+  std::istringstream lines(output);
+  std::string line;
+
+  while (std::getline(lines, line))
+    if (line.compare(0, 12, "controlpath ") == 0)
+    {
+      std::string path = line.substr(12);
+      return path == "none" ? "" : path;
+    }
+
+  return "";
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ControlMaster::getBrokerPath
+
+  *-----------------------------------------------------------------------------*/
+
+std::string ControlMaster::getBrokerPath()
+{
+  const char *home = getenv("HOME");
+  if (!home)
+    return "";
+
+  std::string path(home);
+  path.append("/");
+  path.append(BROKER_PATH);
+  return path;
+}
+
+
+std::string ControlMaster::makeBrokerAccount(const std::string& key)
+{
+  return BROKER_ACCOUNT_VARIABLE + key;
+}
+
+
+bool ControlMaster::parseBrokerAccount(const std::string& variable, std::string& key)
+{
+  size_t length = strlen(BROKER_ACCOUNT_VARIABLE);
+
+  if (variable.compare(0, length, BROKER_ACCOUNT_VARIABLE) != 0)
+    return false;
+
+  key = variable.substr(length);
+  return !key.empty();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxRequest::MuxRequest
+
+  *-----------------------------------------------------------------------------*/
+
+MuxRequest::MuxRequest(const std::string& path,
+                       const std::string& command,
+                       bool subsystem,
+                       ReactorLoop *loop,
+                       const std::vector<std::string>& environment)
+  : m_path(path),
+    m_command(command),
+    m_subsystem(subsystem),
+    m_environment(environment),
+    m_loop(loop),
+    m_control(-1),
+    m_stream(-1),
+    m_remote(-1),
+    m_null(-1),
+    m_state(SEND_HELLO),
+    m_result(0),
+    m_descriptorsSent(0)
+{
+}
+
+
+MuxRequest::~MuxRequest()
+{
+  int fds[] = { m_control, m_stream, m_remote, m_null };
+
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    if (fds[i] != -1)
+      close(fds[i]);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxRequest::start
+
+  A master that is not running leaves its socket behind, so failing to
+  connect is the usual way of finding there is none; it is reported like
+  any other failure.
+
+  *-----------------------------------------------------------------------------*/
+
+void MuxRequest::start(const ReactorLoop::Completion& done)
+{
+  int rc = connectControl();
+  if (rc)
+  {
+    m_loop->post(boost::bind(done, rc));
+    return;
+  }
+
+  MuxRequestPtr self = shared_from_this();
+
+  m_loop->attach(m_control, boost::bind(&MuxRequest::directions, self));
+  m_loop->submit(m_control,
+                 boost::bind(&MuxRequest::step, self),
+                 boost::bind(&MuxRequest::finished, self, done, _1));
+}
+
+
+int MuxRequest::releaseControl()
+{
+  int fd = m_control;
+  m_control = -1;
+  return fd;
+}
+
+
+int MuxRequest::releaseStream()
+{
+  int fd = m_stream;
+  m_stream = -1;
+  return fd;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxRequest::connectControl
+
+  Connecting to a local socket completes or fails at once. The socket pair
+  is made here too, so that step has only the protocol to deal with.
+
+  *-----------------------------------------------------------------------------*/
+
+int MuxRequest::connectControl()
+{
+  struct sockaddr_un address;
+
+  if (m_path.length() >= sizeof(address.sun_path))
+    return LIBSSH2_ERROR_SOCKET_NONE;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, m_path.c_str());
+
+  if ((m_control = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return LIBSSH2_ERROR_SOCKET_NONE;
+
+  if (connect(m_control, (struct sockaddr *) &address, sizeof(address)))
+    return LIBSSH2_ERROR_SOCKET_NONE;
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair))
+    return LIBSSH2_ERROR_SOCKET_NONE;
+
+  m_stream = pair[0];
+  m_remote = pair[1];
+  fcntl(m_stream, F_SETFL, fcntl(m_stream, F_GETFL) | O_NONBLOCK);
+
+  if ((m_null = open("/dev/null", O_RDWR | O_CLOEXEC)) == -1)
+    return LIBSSH2_ERROR_SOCKET_NONE;
+
+  putUint32(m_out, 8);
+  putUint32(m_out, MUX_MSG_HELLO);
+  putUint32(m_out, SSHMUX_VER);
+
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxRequest::step
+
+  Exchanges hellos, then sends the new session request followed by the
+  session's descriptors: the one socket for both input and output, and
+  /dev/null for its error output, which would otherwise be mixed into the
+  output. The master sends back the session's number, or why it refused.
+
+  *-----------------------------------------------------------------------------*/
+
+int MuxRequest::step()
+{
+  int rc;
+  uint32_t type;
+
+  for (;;)
+    switch (m_state)
+    {
+    case SEND_HELLO:
+      if ((rc = flush()) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc)
+      {
+        m_result = rc;
+        m_state = DONE;
+        break;
+      }
+
+      m_state = READ_HELLO;
+      break;
+
+    case READ_HELLO:
+      if ((rc = readMessage(type)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc || type != MUX_MSG_HELLO)
+      {
+        m_result = rc ? rc : LIBSSH2_ERROR_PROTO;
+        m_state = DONE;
+        break;
+      }
+
+      {
+        std::string request;
+        putUint32(request, MUX_C_NEW_SESSION);
+        putUint32(request, REQUEST_ID);
+        putString(request, "");
+        putUint32(request, 0);              // tty
+        putUint32(request, 0);              // X11 forwarding
+        putUint32(request, 0);              // agent forwarding
+        putUint32(request, m_subsystem ? 1 : 0);
+        putUint32(request, ESCAPE_CHAR_NONE);
+        putString(request, "");             // terminal type
+        putString(request, m_command);
+
+        for (size_t i = 0; i < m_environment.size(); i++)
+          putString(request, m_environment[i]);
+
+        putUint32(m_out, request.length());
+        m_out.append(request);
+      }
+
+      m_state = SEND_REQUEST;
+      break;
+
+    case SEND_REQUEST:
+      if ((rc = flush()) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc)
+      {
+        m_result = rc;
+        m_state = DONE;
+        break;
+      }
+
+      m_state = SEND_DESCRIPTORS;
+      break;
+
+    case SEND_DESCRIPTORS:
+      while (m_descriptorsSent < 3)
+      {
+        if ((rc = sendDescriptor(m_descriptorsSent < 2 ? m_remote : m_null)) == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+
+        if (rc)
+        {
+          m_result = rc;
+          m_state = DONE;
+          break;
+        }
+
+        m_descriptorsSent++;
+      }
+
+      if (m_state == DONE)
+        break;
+
+      // The master has its own copies now.
+      close(m_remote);
+      close(m_null);
+      m_remote = -1;
+      m_null = -1;
+
+      m_state = READ_REPLY;
+      break;
+
+    case READ_REPLY:
+      if ((rc = readMessage(type)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc)
+        m_result = rc;
+
+      else if (type == MUX_S_PERMISSION_DENIED || type == MUX_S_FAILURE)
+        m_result = LIBSSH2_ERROR_CHANNEL_REQUEST_DENIED;
+
+      else if (type != MUX_S_SESSION_OPENED)
+        m_result = LIBSSH2_ERROR_PROTO;
+
+      m_state = DONE;
+      break;
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+int MuxRequest::directions()
+{
+  return !m_out.empty() || m_state == SEND_DESCRIPTORS
+         ? LIBSSH2_SESSION_BLOCK_OUTBOUND
+         : LIBSSH2_SESSION_BLOCK_INBOUND;
+}
+
+
+// The control socket is left open but no longer watched; the session lasts
+// as long as it stays open.
+void MuxRequest::finished(const ReactorLoop::Completion& done, int rc)
+{
+  m_loop->detach(m_control);
+  done(rc);
+}
+
+
+int MuxRequest::flush()
+{
+  while (!m_out.empty())
+  {
+    ssize_t n = send(m_control, m_out.data(), m_out.length(), MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_SEND;
+    }
+
+    m_out.erase(0, n);
+  }
+
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxRequest::readMessage
+
+  Reads one length-prefixed message and returns its type; the rest of it is
+  not needed.
+
+  *-----------------------------------------------------------------------------*/
+
+int MuxRequest::readMessage(uint32_t& type)
+{
+  char buffer[4096];
+  size_t offset = 0;
+  uint32_t length;
+
+  while (!getUint32(m_in, offset, length) || m_in.length() - offset < length)
+  {
+    ssize_t n = recv(m_control, buffer, sizeof(buffer), 0);
+
+    if (n == 0)
+      return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_RECV;
+    }
+
+    m_in.append(buffer, n);
+    offset = 0;
+  }
+
+  if (length > MAX_MESSAGE_SIZE || !getUint32(m_in, offset, type))
+    return LIBSSH2_ERROR_PROTO;
+
+  m_in.erase(0, 4 + length);
+  return 0;
+}
+
+
+int MuxRequest::sendDescriptor(int fd)
+{
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  for (;;)
+  {
+    if (sendmsg(m_control, &msg, MSG_NOSIGNAL) == 1)
+      return 0;
+
+    if (errno != EINTR)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_SEND;
+  }
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,190 @@
+/******************************************************************************
+
+  ControlMaster.h
+
+  Many users keep an OpenSSH ControlMaster connection open to the hosts they
+  work on. A session opened through its control socket needs no connect, no
+  key exchange and no authentication -- the master has done all three -- so
+  it is ready in a round trip, and the user is never asked for a password.
+
+  ControlMaster finds the control socket ssh would use for an account, by
+  asking "ssh -G", which applies the user's ssh_config and expands the
+  ControlPath tokens exactly as ssh does. The answer is cached for the
+  process, and a lookup in progress is shared, as in Resolver.
+
+  MuxRequest asks the master, over its control socket, to open a session
+  running a command or subsystem, with OpenSSH's multiplexing protocol (see
+  PROTOCOL.mux in the OpenSSH sources). The session's input and output are
+  one end of a socket pair, whose other end is handed to the master; the
+  control connection must stay open for as long as the session is used.
+
+  The session broker (see broker/Broker.h) speaks the same protocol on a
+  control socket of its own, for every account; a request to it names the
+  account in the session's environment.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_ControlMaster
+#define H_ControlMaster
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+
+
+class ControlMaster
+{
+ public:
+  // Called with the path of the control socket, or "" if ssh is not
+  // configured to use one for the account.
+  typedef boost::function<void (const std::string&)> Callback;
+
+  static ControlMaster& instance();
+
+  // Calls done on loop with the control socket path for the account. Only
+  // the configuration is consulted; whether a master is listening on the
+  // socket is found out by connecting to it.
+  void find(const std::string& user,
+            const std::string& hostName,
+            unsigned int port,
+            ReactorLoop *loop,
+            const Callback& done);
+
+  // The broker's control socket, ~/.jshs/broker.sock.
+  static std::string getBrokerPath();
+
+  // The environment variable naming the account, keyed as in SessionPool,
+  // that a request to the broker carries; and the account from one.
+  static std::string makeBrokerAccount(const std::string& key);
+  static bool parseBrokerAccount(const std::string& variable, std::string& key);
+
+ private:
+  ControlMaster();
+
+  struct Waiter
+  {
+    ReactorLoop *loop;
+    Callback done;
+  };
+
+  struct Entry
+  {
+    bool finding;
+    std::string path;
+    time_t expires;
+    std::vector<Waiter> waiters;
+  };
+
+  void lookup(const std::string& key,
+              const std::string& user,
+              const std::string& hostName,
+              unsigned int port);
+
+  static std::string runSsh(const std::string& user, const std::string& hostName, unsigned int port);
+
+  boost::mutex m_mutex;
+  std::map<std::string, Entry> m_entries;
+};
+
+
+FB_FORWARD_PTR(MuxRequest)
+
+class MuxRequest : public boost::enable_shared_from_this<MuxRequest>
+{
+ public:
+  // Opens a session running command, or the subsystem of that name if
+  // subsystem is true, through the master listening on path, with the
+  // NAME=value strings in environment set for it.
+  MuxRequest(const std::string& path,
+             const std::string& command,
+             bool subsystem,
+             ReactorLoop *loop,
+             const std::vector<std::string>& environment = std::vector<std::string>());
+
+  // Closes whichever of the sockets have not been released.
+  ~MuxRequest();
+
+  // Runs the request on the loop and calls done with 0 once the session is
+  // open, or with a negative libssh2 error code if there is no master or it
+  // refused.
+  void start(const ReactorLoop::Completion& done);
+
+  // The control connection and the session's end of the socket pair, which
+  // the caller takes over after a successful start.
+  int releaseControl();
+  int releaseStream();
+
+ private:
+  enum State { SEND_HELLO, READ_HELLO, SEND_REQUEST, SEND_DESCRIPTORS, READ_REPLY, DONE };
+
+  int connectControl();
+  int step();
+  int directions();
+  void finished(const ReactorLoop::Completion& done, int rc);
+
+  int flush();
+  int readMessage(uint32_t& type);
+  int sendDescriptor(int fd);
+
+  std::string m_path;
+  std::string m_command;
+  bool m_subsystem;
+  std::vector<std::string> m_environment;
+  ReactorLoop *m_loop;
+
+  int m_control;
+  int m_stream;
+
+  // The master's end of the socket pair, and where the session's error
+  // output goes.
+  int m_remote;
+  int m_null;
+
+  State m_state;
+  int m_result;
+  int m_descriptorsSent;
+  std::string m_out;
+  std::string m_in;
+};
+
+#endif // H_ControlMaster
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,163 @@
+/******************************************************************************
+
+  CredentialCache.cpp
+
+  CredentialCache remembers recently typed passwords for a limited time.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
+#include "CredentialCache.h"
+#include "Reactor.h"
+
+
+#define DEFAULT_TIMEOUT 300
+
+
+/*-----------------------------------------------------------------------------*
+
+  CredentialCache::instance
+
+  *-----------------------------------------------------------------------------*/
+
+CredentialCache& CredentialCache::instance()
+{
+  static CredentialCache cache;
+  return cache;
+}
+
+
+CredentialCache::CredentialCache()
+  : m_timeout(DEFAULT_TIMEOUT)
+{
+}
+
+
+bool CredentialCache::lookup(const std::string& key, std::string& password)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  EntryMap::iterator it = m_entries.find(key);
+  if (it == m_entries.end())
+    return false;
+
+  if (it->second.expires <= time(NULL))
+  {
+    erase(it);
+    return false;
+  }
+
+  password = it->second.password;
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  CredentialCache::store
+
+  A timer forgets the password when it expires, so that it does not stay in
+  memory until the account is next looked up. It is set a second late, as
+  expiry is counted in whole seconds.
+
+  *-----------------------------------------------------------------------------*/
+
+void CredentialCache::store(const std::string& key, const std::string& password)
+{
+  unsigned int timeout;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    if ((timeout = m_timeout) == 0)
+      return;
+
+    Entry& entry = m_entries[key];
+    entry.password = password;
+    entry.expires = time(NULL) + timeout;
+  }
+
+  Reactor::instance().any()->schedule((timeout + 1) * 1000, boost::bind(&CredentialCache::expire, this, key));
+}
+
+
+void CredentialCache::forget(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  EntryMap::iterator it = m_entries.find(key);
+  if (it != m_entries.end())
+    erase(it);
+}
+
+
+// A password stored again since this timer was set carries a later expiry,
+// and is left alone.
+void CredentialCache::expire(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  EntryMap::iterator it = m_entries.find(key);
+  if (it != m_entries.end() && it->second.expires <= time(NULL))
+    erase(it);
+}
+
+
+// Overwrites the password before letting go of it. Called with the mutex
+// held.
+void CredentialCache::erase(EntryMap::iterator it)
+{
+  std::fill(it->second.password.begin(), it->second.password.end(), '\0');
+  m_entries.erase(it);
+}
+
+
+unsigned int CredentialCache::getTimeout()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_timeout;
+}
+
+
+// Shortening the timeout does not extend to passwords already stored; they
+// keep the expiry they were given. Turning the cache off forgets them all.
+void CredentialCache::setTimeout(unsigned int seconds)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_timeout = seconds;
+
+  if (seconds == 0)
+    while (!m_entries.empty())
+      erase(m_entries.begin());
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
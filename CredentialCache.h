@@ -0,0 +1,85 @@
+/******************************************************************************
+
+  CredentialCache.h
+
+  CredentialCache remembers, for a limited time, the passwords the user has
+  typed, keyed by user@hostName:port as in SessionPool. A connection to an
+  account the user has just unlocked is given the password without a second
+  prompt. Passwords are held in memory only, and are forgotten when they
+  expire or are found to be wrong.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_CredentialCache
+#define H_CredentialCache
+
+#include <ctime>
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+
+class CredentialCache
+{
+ public:
+  static CredentialCache& instance();
+
+  // Sets password to the one remembered for key, if it has not expired.
+  bool lookup(const std::string& key, std::string& password);
+
+  void store(const std::string& key, const std::string& password);
+  void forget(const std::string& key);
+
+  // Seconds a password is remembered; 0 turns the cache off.
+  unsigned int getTimeout();
+  void setTimeout(unsigned int seconds);
+
+ private:
+  CredentialCache();
+
+  struct Entry
+  {
+    std::string password;
+    time_t expires;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  void expire(const std::string& key);
+  void erase(EntryMap::iterator it);
+
+  boost::mutex m_mutex;
+  EntryMap m_entries;
+  unsigned int m_timeout;
+};
+
+#endif // H_CredentialCache
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -136,15 +136,13 @@
 
 #include <boost/assign.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 
 #include "variant_list.h"
 
 #include "FileService.h"
 
-// Used by get, command execution
-#define BUFFER_SIZE 4096
-
-
 
 /*-----------------------------------------------------------------------------*
 
@@ -156,10 +154,16 @@ FileService::FileService(SecureConnectionPtr connection,
 			 const std::string& scheme,
 			 const std::string& configText)
   : Service(connection, scheme, configText),
-    m_sftp(NULL),
-    m_home("")
+    m_session(connection->getPooledSession()),
+    m_channels(connection->getSftpChannels()),
+    m_mux(connection->getMuxSftp()),
+    m_home(""),
+    m_enabled(false),
+    m_generation(0)
 {
   registerMethod("get", make_method(this, &FileService::get));
+  registerProperty("permissionCacheHits", make_property(this, &FileService::get_permissionCacheHits));
+  registerProperty("permissionCacheMisses", make_property(this, &FileService::get_permissionCacheMisses));
   registerEvent("onresult");
   registerEvent("onerror");
 }
@@ -181,56 +185,105 @@ FileService::~FileService()
 
   FileService::start
 
-  TODO -- refactor command execution out to its own method.
+  The service keeps no subsystem of its own: its commands borrow from the
+  session's pool (see SftpChannelPool.h), so it starts at once if the
+  connection has resolved the home directory, as it usually has. Failing
+  that, "." is resolved on a borrowed subsystem. The policy, which needs
+  the home directory to expand ~, is parsed when the service is built; see
+  build.
 
   *-----------------------------------------------------------------------------*/
 
 void FileService::start()
 {
-  LIBSSH2_SESSION *session = m_connection.lock()->getSession();
+  FileServicePtr self = FB::ptr_cast<FileService>(shared_from_this());
+
+  SecureConnectionPtr connection = m_connection.lock();
+  if (connection)
+    m_home = connection->getHomeDirectory();
+
+  if (!m_home.empty())
+  {
+    started(0);
+    return;
+  }
+
+  PooledSessionPtr session;
+  SftpChannelPoolPtr channels;
+  MuxSftpPtr mux;
+  getLink(session, channels, mux);
 
-  if (!m_sftp && !(m_sftp = libssh2_sftp_init(session)))
-    throw FB::script_error("Unable to initialize SFTP channel.");
+  if (mux)
+    homeBorrowed(SftpChannelPtr(), 0);
 
-  LIBSSH2_CHANNEL *channel; // channel for command execution
+  else if (channels)
+    channels->borrow(boost::bind(&FileService::homeBorrowed, self, _1, _2));
+}
 
-  if (!(channel = libssh2_channel_open_session(session)))
-    throw FB::script_error("Unable to open command channel to remote host.");
 
-  try
+void FileService::homeBorrowed(SftpChannelPtr sftp, int rc)
+{
+  if (rc)
   {
-    int rc;
-    if ((rc = libssh2_channel_exec(channel, "echo $HOME")) != 0)
-      throw FB::script_error("Unable to execute command on remote host.");
+    m_startError = "Unable to initialize SFTP channel.";
+    started(rc);
+    return;
+  }
 
-    char buffer[BUFFER_SIZE];
-    std::stringstream result_text;
-    while ((rc = libssh2_channel_read(channel, buffer, sizeof(buffer)-1)) > 0)
-    {
-      buffer[rc] = 0;
-      result_text << buffer;
-    }
+  FileServicePtr self = FB::ptr_cast<FileService>(shared_from_this());
 
-    if (rc < 0)
-      throw FB::script_error("Error while receiving command output.");
-  
-    m_home = result_text.str();
-    size_t end = m_home.find("\n");
-    if (end > 0)
-      m_home.erase(end, m_home.length() - end);
+  PooledSessionPtr session;
+  SftpChannelPoolPtr channels;
+  MuxSftpPtr mux;
+  getLink(session, channels, mux);
 
-    parseConfig();
+  if (!sftp && !mux)
+  {
+    m_startError = "Connection to remote host lost.";
+    started(LIBSSH2_ERROR_SOCKET_DISCONNECT);
+    return;
   }
-  catch (FB::script_error e) 
+
+  SftpRealPathPtr home = sftp
+                         ? boost::make_shared<SftpRealPath>(session->getSession(), sftp->get(), ".")
+                         : boost::make_shared<SftpRealPath>(mux, ".");
+
+  ReactorLoop::Completion done = boost::bind(&FileService::homeFound, self, sftp, home, _1);
+
+  if (sftp)
+    session->submit(boost::bind(&SftpRealPath::step, home), done);
+  else
+    mux->submit(boost::bind(&SftpRealPath::step, home), done);
+}
+
+
+void FileService::homeFound(SftpChannelPtr sftp, SftpRealPathPtr home, int rc)
+{
+  if (sftp && PooledSession::isLinkFailure(rc))
+    sftp->setBroken();
+
+  if (rc)
+    m_startError = "Unable to find home directory.";
+  else
+    m_home = home->getRealPath();
+
+  started(rc);
+}
+
+
+void FileService::started(int rc)
+{
+  SecureConnectionPtr connection = m_connection.lock();
+  if (!connection)
+    return;
+
+  if (rc)
   {
-    if (channel)
-    {
-      libssh2_channel_close(channel);
-      libssh2_channel_free(channel);
-      channel = NULL;
-    }
+    connection->reportError(FB::script_error(m_startError));
+    return;
   }
 
+  connection->grantService(FB::ptr_cast<FileService>(shared_from_this()));
 }
 
 
@@ -238,19 +291,120 @@ void FileService::start()
 
   FileService::revoke
 
-  Shut down the service.
+  Shut down the service. Commands still running give back what they
+  borrowed as they finish.
 
  *-----------------------------------------------------------------------------*/
 
 void FileService::revoke()
 {
+  Service::revoke();
+
   m_enabled = false;
 
-  if (m_sftp)
+  std::vector<FileServiceGetCommandPtr> pending;
+  {
+    boost::mutex::scoped_lock lock(m_linkMutex);
+
+    m_channels.reset();
+    m_mux.reset();
+    pending.swap(m_pending);
+  }
+
+  for (size_t i = 0; i < pending.size(); i++)
+    pending[i]->reportError(FB::script_error("Connection to remote host lost."));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  FileService::retry
+
+  Called on the loop for a command that failed because the connection was
+  lost. If the service has already moved to a new session the command is
+  reissued at once; otherwise it waits for the connection to come back.
+  A service revoked meanwhile has neither pool nor mux, and the command
+  fails.
+
+  *-----------------------------------------------------------------------------*/
+
+void FileService::getLink(PooledSessionPtr& session, SftpChannelPoolPtr& channels, MuxSftpPtr& mux)
+{
+  boost::mutex::scoped_lock lock(m_linkMutex);
+
+  session = m_session;
+  channels = m_channels;
+  mux = m_mux;
+}
+
+
+void FileService::retry(FileServiceGetCommandPtr command)
+{
+  bool revoked = false;
+  bool moved = false;
   {
-    libssh2_sftp_shutdown(m_sftp);
-    m_sftp = NULL;
+    boost::mutex::scoped_lock lock(m_linkMutex);
+
+    if (!m_channels && !m_mux)
+      revoked = true;
+
+    else if (command->m_session != m_session || command->m_mux != m_mux)
+      moved = true;
+
+    else
+      m_pending.push_back(command);
   }
+
+  if (revoked)
+  {
+    command->reportError(FB::script_error("Connection to remote host lost."));
+    return;
+  }
+
+  if (moved)
+  {
+    command->submit();
+    return;
+  }
+
+  SecureConnectionPtr connection = m_connection.lock();
+  if (connection)
+    connection->reconnect();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  FileService::reconnected
+
+  Moves the service to the connection's new session and its pool. The home
+  directory and the policy are unchanged, so the commands waiting for the
+  connection are simply reissued.
+
+  *-----------------------------------------------------------------------------*/
+
+void FileService::reconnected()
+{
+  SecureConnectionPtr connection = m_connection.lock();
+  if (!connection)
+    return;
+
+  std::vector<FileServiceGetCommandPtr> pending;
+  {
+    boost::mutex::scoped_lock lock(m_linkMutex);
+
+    // Revoked while the connection was coming back.
+    if (!m_channels && !m_mux)
+      return;
+
+    m_session = connection->getPooledSession();
+    m_channels = connection->getSftpChannels();
+    m_mux = connection->getMuxSftp();
+    pending.swap(m_pending);
+  }
+
+  for (size_t i = 0; i < pending.size(); i++)
+    pending[i]->submit();
 }
 
 
@@ -260,9 +414,9 @@ void FileService::revoke()
 
   *-----------------------------------------------------------------------------*/
 
-FileServicePtr FileService::create(SecureConnectionPtr connection,
-				   const std::string& scheme,
-				   const std::string& configText)
+ServicePtr FileService::create(SecureConnectionPtr connection,
+			       const std::string& scheme,
+			       const std::string& configText)
 {
   FileServicePtr fs = boost::make_shared<FileService>(connection, scheme, configText);
   fs->start();
@@ -272,53 +426,31 @@ FileServicePtr FileService::create(SecureConnectionPtr connection,
 
 /*-----------------------------------------------------------------------------*
 
-  FileService::reportError
+  FileService::build
+
+  Parses the policy on the service's first use, and again whenever the
+  policy file changes. A policy with errors is reported, and leaves the
+  service as it was: disabled if it had no policy yet, otherwise still
+  enforcing the last good one.
 
   *-----------------------------------------------------------------------------*/
 
-void FileService::reportError(const FB::script_error& e) 
+void FileService::build()
 {
-  FireEvent("onerror", FB::variant_list_of(shared_from_this())(e.what()));
+  parseConfig();
 }
 
 
 /*-----------------------------------------------------------------------------*
-  
-  FileService::re_glob_transform
-
-  This is used to translate the full path indicated by a config specifier into
-  a regular expression that matches what it globs to. Sequentially, perform
-  the following conversion:
-
-  escape special characters .[{}()\+|^$, but not *?{} ...
-  ? --> .
-  * --> (\\\\.|[^\\/])*
-  {a,b,...} --> (a|b|...)
-  ... --> .*
-  remove trailing /
- 
-  Processing braced alternatives is easier if the three syntactic parts --
-  '{', ',', and '}'. Hence we iteratively apply a regular expression to select
-  the next piece by required transformation:
-
-  ... --> .* ==> (\.{3})
-  one of .[{}()\+|^$ --> \_ ==> ([][{}()\+|^$])
-  ? --> . ==> (\?)
-  * --> (\.|[^\/])* ==> (\*)
-  { --> ( ==> (\{)
-  , --> | ==> (,)
-  } --> ) ==> (\})
+
+  FileService::reportError
 
   *-----------------------------------------------------------------------------*/
 
-boost::regex FileService::re_glob_transform("(\\.{3})"
-					    "|([].[{}()\\+|^$])"
-					    "|(\\?)"
-					    "|(\\*)"
-					    "|(\\{)"
-					    "|(,)"
-					    "|(\\})"
-					    "|(.)");
+void FileService::reportError(const FB::script_error& e) 
+{
+  FireEvent("onerror", FB::variant_list_of(shared_from_this())(e.what()));
+}
 
 
 /*-----------------------------------------------------------------------------*
@@ -326,8 +458,8 @@ boost::regex FileService::re_glob_transform("(\\.{3})"
   FileService::parseConfig
 
   SecureConnection supplies a service its configuration file contents at
-  construction.  This function parses that text and sets options appropriately
-  in the FileService instance.
+  construction, and again whenever the file changes.  This function parses
+  that text and sets options appropriately in the FileService instance.
 
   It is written from the perspective that the remote host is POSIX-based. For
   Windows-based hosts, the syntax of the configuration file's path specifiers
@@ -369,8 +501,8 @@ void FileService::parseConfig()
   std::vector<boost::filesystem::path> parent_paths;
 
   // Used to hold the ConfigLine instances during processing.  Later they will
-  // be moved to final_config and overrides, and ultimately into the m_config
-  // member.
+  // be moved to final_config and overrides, and ultimately compiled into the
+  // m_policy member.
   std::vector<ConfigLine> raw_config;
 
   for(int i = 0; i < count; i++)
@@ -508,50 +640,11 @@ void FileService::parseConfig()
 
 	cl.setPath(prefixes.back());
 
-	// Transform (possibly globbed) path into a regular expression that
-	// matches the path (or what the path globs to).
+	// The glob is compiled with the rest of the policy below; only its
+	// braces need checking here.
 	std::string glob_path = cl.getPath().string();
-	boost::sregex_iterator it(glob_path.begin(), glob_path.end(), re_glob_transform);
-	boost::sregex_iterator end;
-	bool within_brace = false;
-	std::stringstream re_text;
-	for(; it != end; it++)
-	{
-	  boost::match_results<std::string::const_iterator> what(*it);
-	  const char* t = re_text.str().c_str();
-	  const char* u = what.str().c_str();
-	  if (what[1].matched) // ... --> .*
-	    re_text << ".*";
-
-	  else if (what[2].matched) // one of [].{}()\+|^$ --> \_
-	    re_text << "\\" << what[2].str();
-
-	  else if (what[3].matched) // ? --> .
-	    re_text << ".";
-
-	  else if (what[4].matched) // * --> (\\.|[^\/])*
-	    re_text << "(\\\\.|[^\\/])*";
-
-	  else if (what[5].matched) // { --> (
-	  {
-	    re_text << "(";
-	    within_brace = true;
-	  }
-	  else if (what[6].matched) // , --> , or | -- depending on ?within brace?
-	    re_text << (within_brace ? "|" : ",");
-
-	  else if (what[7].matched) // } --> )
-	  {
-	    re_text << ")";
-	    within_brace = false;
-	  }
-	  else if (what[8].matched) // ordinary character --> itself
-	    re_text << what[8].str();
-	}
-      
-	if (within_brace)
+	if (!PathPolicy::isValidGlob(glob_path))
 	{
-	  // There is an unclosed brace in the path.
 	  msg << i << ": unterminated {, or nested {}s, in glob: \n";
 	  msg << line;
 	  connection->FireEvent("onerror", FB::variant_list_of(connection)(this)(msg.str()));
@@ -560,20 +653,13 @@ void FileService::parseConfig()
 
 	// The processing above to remove . and .. should also ensure that the
 	// path does not end in a trailing /.
-	std::string regex_str = re_text.str();
-	if (regex_str[regex_str.length()-1] == '/')
+	if (glob_path[glob_path.length()-1] == '/')
 	{
 	  msg << i << ": internal error, no terminal slash assumption failed: \n";
 	  msg << line;
 	  connection->FireEvent("onerror", FB::variant_list_of(connection)(this)(msg.str()));
 	  return;
 	}
-
-	// Append (/.*)?$ so that directories will match.  This also prevents
-	// ~/foo from matching ~/foobar.
-	const char *s = re_text.str().c_str();
-	s = re_text.str().append("(/.*)?$").c_str();
-	cl.setGlobRegex(boost::regex(re_text.str().append("(/.*)?$")));
 	break;
       }
     case ConfigLine::SECTION_ERROR:
@@ -639,7 +725,51 @@ void FileService::parseConfig()
 
   final_config.insert(final_config.end(), overrides.begin(), overrides.end());
 
-  m_config = final_config;
+  // The whole policy becomes one automaton, so that checking a path no
+  // longer goes through the specifiers one by one; see PathPolicy.h.
+  boost::shared_ptr<PathPolicy> policy = boost::make_shared<PathPolicy>();
+
+  for (o_it = final_config.begin(); o_it != final_config.end(); o_it++)
+  {
+    if (o_it->getType() == ConfigLine::SPECIFIER)
+    {
+      policy->addSpecifier(o_it->getPath().string(), o_it->getSign() == 1);
+      continue;
+    }
+
+    switch (o_it->getSection())
+    {
+    case ConfigLine::READONLY:
+      policy->addSection(PathPolicy::ACCESS_READ);
+      break;
+
+    case ConfigLine::WRITEONLY:
+      policy->addSection(PathPolicy::ACCESS_WRITE);
+      break;
+
+    case ConfigLine::READWRITE:
+      policy->addSection(PathPolicy::ACCESS_READ | PathPolicy::ACCESS_WRITE);
+      break;
+
+    default:
+      policy->addSection(PathPolicy::ACCESS_NONE);
+      break;
+    }
+  }
+
+  if (!policy->compile())
+  {
+    connection->FireEvent("onerror", FB::variant_list_of(connection)(this)
+                          ("FileService configuration error: policy too complex"));
+    return;
+  }
+
+  // Commands checking a path meanwhile finish with the policy they took.
+  boost::shared_ptr<const PathPolicy> compiled(policy);
+
+  boost::mutex::scoped_lock lock(m_configMutex);
+  m_policy.swap(compiled);
+  m_generation++;
   m_enabled = true;
 }
 
@@ -771,12 +901,11 @@ bool FileService::isWriteable(const std::string& path)
 
   Checks the given path against the config permissions.
 
-  parseConfig set up m_config so that all this function need do is evaluate
-  each ConfigLine in turn, testing whether or not the contained regex matches
-  the given path. If it does, then the appropriate permissions for that
-  section are recorded; if not no action is taken. The last result wins. By
-  default, all permissions are assumed to be refused, so only positive action
-  on the part of the user who edited the config file can allow a file to be
+  parseConfig compiled the policy so that all this function need do is run
+  the path through it, one step per byte, and a path checked recently is
+  answered from m_permissions without even that. By default, all
+  permissions are assumed to be refused, so only positive action on the
+  part of the user who edited the config file can allow a file to be
   accessed.
 
   The pair returned has read permission first, write second.
@@ -785,55 +914,38 @@ bool FileService::isWriteable(const std::string& path)
 
 std::pair<bool, bool> FileService::getPermissions(const std::string& path)
 {
-  std::vector<ConfigLine>::iterator it;
-  boost::smatch match; 
-
-  // parseConfig requires that a section be prior to all specifiers, so that
-  // this is guaranteed to be initialized before a specifier is processed
-  // below.
-  FileService::ConfigLine::ConfigSection section;
+  boost::shared_ptr<const PathPolicy> policy;
+  unsigned int generation;
+  {
+    boost::mutex::scoped_lock lock(m_configMutex);
+    policy = m_policy;
+    generation = m_generation;
+  }
 
-  bool canRead = false;
-  bool canWrite = false;
+  if (!policy)
+    return std::pair<bool, bool>(false, false);
 
-  for (it = m_config.begin(); it != m_config.end(); it++)
+  int access;
+  if (!m_permissions.lookup(generation, path, access))
   {
-    const char *s = (it->getType() == ConfigLine::SPECIFIER) ? it->getGlobRegex().str().c_str() : "";
-    if (it->getType() == ConfigLine::SECTION)
-      section = it->getSection();
+    access = policy->check(path);
+    m_permissions.store(generation, path, access);
+  }
 
-    else if (boost::regex_match(path, match, it->getGlobRegex()))
-    {
-      switch (section)
-      {
-      case ConfigLine::NOACCESS:
-	canRead = false;
-	canWrite = false;
-	break;
+  return std::pair<bool, bool>((access & PathPolicy::ACCESS_READ) != 0,
+                               (access & PathPolicy::ACCESS_WRITE) != 0);
+}
 
-      case ConfigLine::READWRITE:
-	canRead = true;
-	canWrite = true;
-	break;
 
-      case ConfigLine::READONLY:
-	canRead = true;
-	canWrite = false;
-	break;
+unsigned int FileService::get_permissionCacheHits()
+{
+  return m_permissions.getHits();
+}
 
-      case ConfigLine::WRITEONLY:
-	canRead = false;
-	canWrite = true;
-	break;
 
-      default:
-	// This shouldn't happen; errors and overrides should have been
-	// filtered out by now.
-	break;
-      } 
-    }
-  }
-  return std::pair<bool, bool>(canRead, canWrite);
+unsigned int FileService::get_permissionCacheMisses()
+{
+  return m_permissions.getMisses();
 }
 
 
@@ -847,6 +959,8 @@ std::pair<bool, bool> FileService::getPermissions(const std::string& path)
 
 FB::JSAPIPtr FileService::get(const std::string& path)
 {
+  activate();
+
   bool enabled = true;
 
   if (!m_enabled)
@@ -878,7 +992,9 @@ FileServiceGetCommand::FileServiceGetCommand(const FileServicePtr& service,
 					     bool enabled)
   : m_service(service),
     m_path(path),
-    m_enabled(enabled)
+    m_enabled(enabled),
+    m_retried(false),
+    m_submitted(0)
 {
   registerMethod("exec", make_method(this, &FileServiceGetCommand::exec));
   registerEvent("onresult");
@@ -929,7 +1045,8 @@ void FileServiceGetCommand::reportError(const FB::script_error& e)
 
   FileServiceGetCommand::exec
 
-  This is the meat of the get command, boilerplate sftp file fetch.
+  This is the meat of the get command, boilerplate sftp file fetch. The read
+  runs on the session's reactor loop; finished is called when it is done.
 
   *-----------------------------------------------------------------------------*/
 
@@ -938,41 +1055,144 @@ void FileServiceGetCommand::exec(const FB::JSObjectPtr& callback)
   if (!m_enabled)
     return;
 
-  LIBSSH2_SFTP_HANDLE *file = NULL;
-  
-  try
+  m_callback = callback;
+  m_retried = false;
+  submit();
+}
+
+
+void FileServiceGetCommand::submit()
+{
+  SftpChannelPoolPtr channels;
+  m_service->getLink(m_session, channels, m_mux);
+  m_read.reset();
+
+  if (m_mux)
   {
-    if (!(file = libssh2_sftp_open(m_service->m_sftp,
-				   m_path.c_str(), LIBSSH2_FXF_READ, 0)))
-      throw FB::script_error("File not found.");
+    m_submitted = ReactorLoop::now();
+    m_read = boost::make_shared<SftpReadFile>(m_mux, m_path);
+    m_mux->submit(boost::bind(&SftpReadFile::step, m_read),
+                  boost::bind(&FileServiceGetCommand::finished,
+                              FB::ptr_cast<FileServiceGetCommand>(shared_from_this()), _1));
+    return;
+  }
 
-    // For now, presume contents are ascii.
-    // TODO -- encoding
-    std::stringstream contents;
+  if (!channels)
+  {
+    reportError(FB::script_error("Connection to remote host lost."));
+    return;
+  }
 
-    int rc;
-    char buffer[BUFFER_SIZE];
-    while ((rc = libssh2_sftp_read(file, buffer, sizeof(buffer)-1)) > 0)
-    {
-      buffer[rc] = 0;
-      contents << buffer;
-    }
+  channels->borrow(boost::bind(&FileServiceGetCommand::borrowed,
+                               FB::ptr_cast<FileServiceGetCommand>(shared_from_this()), _1, _2));
+}
 
-    if (rc < 0) 
-      throw FB::script_error(std::string("Error while reading file: ").append(strerror(errno)));
 
-    libssh2_sftp_close(file);
-    file = NULL;
-      
-    reportResult(FB::variant_list_of(callback->Invoke("", FB::variant_list_of(contents.str()))));
+// Each read has a subsystem to itself for as long as it runs, so reads in
+// flight together are not queued behind one another.
+void FileServiceGetCommand::borrowed(SftpChannelPtr sftp, int rc)
+{
+  if (rc)
+  {
+    finished(rc);
+    return;
   }
-  catch (FB::script_error e) 
+
+  m_sftp = sftp;
+  m_submitted = ReactorLoop::now();
+  m_read = boost::make_shared<SftpReadFile>(m_session->getSession(), m_sftp->get(), m_path);
+  m_session->submit(boost::bind(&SftpReadFile::step, m_read),
+                    boost::bind(&FileServiceGetCommand::finished,
+                                FB::ptr_cast<FileServiceGetCommand>(shared_from_this()), _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  FileServiceGetCommand::finished
+
+  Called on the reactor loop. The script's callback is run on the main
+  thread so that the loop never waits on the page.
+
+  *-----------------------------------------------------------------------------*/
+
+void FileServiceGetCommand::finished(int rc)
+{
+  if (m_sftp)
   {
-    if (file)
-      libssh2_sftp_close(file);
+    if (PooledSession::isLinkFailure(rc))
+      m_sftp->setBroken();
 
-    reportError(e);
+    m_sftp.reset();
   }
+
+  // A read is safe to repeat, so one lost to a dropped connection is
+  // reissued once the connection is back, and the script never sees it.
+  if (PooledSession::isLinkFailure(rc) && !m_retried)
+  {
+    m_retried = true;
+    m_service->retry(FB::ptr_cast<FileServiceGetCommand>(shared_from_this()));
+  }
+
+  // Lost again after the retry.
+  else if (PooledSession::isLinkFailure(rc))
+    reportError(FB::script_error("Connection to remote host lost."));
+
+  else if (rc && !m_read)
+    reportError(FB::script_error("Unable to initialize SFTP channel."));
+
+  else if (rc && m_read->getOpenStatus() == LIBSSH2_FX_NO_SUCH_FILE)
+    reportError(FB::script_error("File not found."));
+
+  else if (rc && !m_read->wasOpened())
+  {
+    std::stringstream msg;
+    if (m_read->getOpenStatus())
+      msg << "Unable to open file: SFTP status: " << m_read->getOpenStatus();
+    else
+      msg << "Unable to open file: return code: " << rc;
+
+    reportError(FB::script_error(msg.str()));
+  }
+
+  else if (rc)
+  {
+    std::stringstream msg;
+    msg << "Error while reading file: return code: " << rc;
+
+    reportError(FB::script_error(msg.str()));
+  }
+
+  else
+  {
+    // Uncompressed reads measure the link for CompressionPolicy. The link a
+    // ControlMaster uses is its own business.
+    if (m_session && !m_session->isCompressed())
+      CompressionPolicy::instance().recordTransfer(m_session->getRemoteAddress(),
+                                                   m_read->getContents().size(),
+                                                   ReactorLoop::now() - m_submitted);
+
+    m_callback->getHost()->ScheduleOnMainThread(shared_from_this(),
+                                                boost::bind(&FileServiceGetCommand::deliver,
+                                                            FB::ptr_cast<FileServiceGetCommand>(shared_from_this())));
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  FileServiceGetCommand::deliver
+
+  *-----------------------------------------------------------------------------*/
+
+void FileServiceGetCommand::deliver()
+{
+  // For now, presume contents are ascii.
+  // TODO -- encoding
+  reportResult(FB::variant_list_of(m_callback->Invoke("", FB::variant_list_of(m_read->getContents()))));
+  m_read.reset();
+  m_session.reset();
+  m_mux.reset();
 }
 
 
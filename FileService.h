@@ -49,6 +49,10 @@
 interface FileService : Service {
   readonly attribute SecureConnection connection;
 
+  // Path checks answered from, and missing, the cache of recent decisions.
+  readonly attribute unsigned long permissionCacheHits;
+  readonly attribute unsigned long permissionCacheMisses;
+
   FileServiceCreateCommand create(in FileSystemPath path);
   FileServiceDeleteCommand delete(in FileSystemPath path);
   FileServiceCopyCommand copy(in FileSystemPath source, in FileSystemPath destination);
@@ -144,10 +148,9 @@ Parsing:
   backslash quotes
 
   expand ~
-    get $HOME environment variable
-      open channel
-      command "echo $HOME"
-      read result
+    the home directory, as the SFTP server resolves "."
+      resolved by the connection while it opens, and remembered
+      for the account
 
 5 store as a sequence of trees, tagged by section
   boost or stl should have a tree struct
@@ -177,17 +180,24 @@ A line matches a section if the last matching specifier starts with a '+'.
 
 #include "JSAPIAuto.h"
 
+#include "PathPolicy.h"
+#include "PermissionCache.h"
 #include "SecureConnection.h"
 #include "Service.h"
+#include "SftpChannelPool.h"
+#include "SftpOperations.h"
 
 
 #ifndef H_FileService
 #define H_FileService
 
 FB_FORWARD_PTR(FileService)
+FB_FORWARD_PTR(FileServiceGetCommand)
 
   class FileServiceGetCommand : public FB::JSAPIAuto
   {
+    friend class FileService;
+
   public:
     FileServiceGetCommand(const FileServicePtr& service,
 			  const std::string& path,
@@ -195,6 +205,11 @@ FB_FORWARD_PTR(FileService)
     void exec(const FB::JSObjectPtr& callback);
 
   protected:
+    void submit();
+    void borrowed(SftpChannelPtr sftp, int rc);
+    void finished(int rc);
+    void deliver();
+
     void report(const std::string& event, FB::VariantList args);
     void reportResult(FB::VariantList args);
     void reportError(const FB::script_error& e) ;
@@ -203,6 +218,19 @@ FB_FORWARD_PTR(FileService)
     FileServicePtr m_service;
     std::string m_path;
     bool m_enabled;
+
+    FB::JSObjectPtr m_callback;
+    SftpReadFilePtr m_read;
+
+    // The session the read was submitted on, the subsystem it borrowed,
+    // and whether it has already been reissued after losing the connection.
+    PooledSessionPtr m_session;
+    SftpChannelPtr m_sftp;
+    MuxSftpPtr m_mux;
+    bool m_retried;
+
+    // When the read was submitted, on the reactor's clock.
+    uint64_t m_submitted;
   };
 
 
@@ -217,17 +245,31 @@ public:
 
   virtual ~FileService();
 
+  // Starts the service on the connection's reactor loop; once it is up,
+  // the service is granted to the connection.
   virtual void start();
   virtual void revoke();
+  virtual void reconnected();
 
-  static boost::shared_ptr<FileService> create(SecureConnectionPtr connection,
-                                               const std::string& scheme,
-                                               const std::string& config);
+  static ServicePtr create(SecureConnectionPtr connection,
+                           const std::string& scheme,
+                           const std::string& config);
 
   FB::JSAPIPtr get(const std::string &path);
 
+  unsigned int get_permissionCacheHits();
+  unsigned int get_permissionCacheMisses();
+
 
 protected:
+  virtual void build();
+
+  void homeBorrowed(SftpChannelPtr sftp, int rc);
+  void homeFound(SftpChannelPtr sftp, SftpRealPathPtr home, int rc);
+  void started(int rc);
+
+  void retry(FileServiceGetCommandPtr command);
+
   void parseConfig();
 
   bool isReadable(const std::string& path);
@@ -248,7 +290,6 @@ protected:
       int sign;
       int indent;
       boost::filesystem::path path;
-      boost::regex re_glob;
     } Specifier;
 
     typedef boost::shared_ptr<ConfigLine> Ptr;
@@ -263,8 +304,6 @@ protected:
     inline boost::filesystem::path getPath() { return m_specifier.path; };
     inline void setPath(const std::string &path) { m_specifier.path = path; };
     inline void setPath(const boost::filesystem::path &path) { m_specifier.path = path; };
-    inline boost::regex getGlobRegex() { return m_specifier.re_glob; };
-    inline void setGlobRegex(const boost::regex& re_glob) { m_specifier.re_glob = re_glob; };
 
   protected:
     static boost::regex re_blank;
@@ -279,17 +318,39 @@ protected:
     ConfigSection m_section;
     Specifier m_specifier;
   };
-    
-  static boost::regex re_glob_transform;
 
   void reportError(const FB::script_error& e);
 
+  // Copies of the three below, for use outside m_linkMutex.
+  void getLink(PooledSessionPtr& session, SftpChannelPoolPtr& channels, MuxSftpPtr& mux);
+
 private:
-  LIBSSH2_SFTP *m_sftp; // channel for file transfer
+  // Guards the link members and m_pending: commands are submitted from the
+  // page, the service is revoked from it, and the loop moves the service to
+  // a new session when the connection reconnects.
+  boost::mutex m_linkMutex;
+
+  PooledSessionPtr m_session;
+  SftpChannelPoolPtr m_channels; // the session's, which commands borrow from
+
+  // Set instead of the two above when the connection is multiplexed through
+  // a ControlMaster; the subsystem is the connection's own.
+  MuxSftpPtr m_mux;
   std::string m_home; // connection's user's home directory on remote host.
 
+  std::string m_startError;
+
+  // Commands waiting for the connection to be re-established.
+  std::vector<FileServiceGetCommandPtr> m_pending;
+
   bool m_enabled;
-  std::vector<ConfigLine> m_config;
+
+  // Replaced whole when the policy is reloaded; see parseConfig.
+  boost::mutex m_configMutex;
+  boost::shared_ptr<const PathPolicy> m_policy;
+  unsigned int m_generation; // of m_policy, for m_permissions
+
+  PermissionCache m_permissions;
 };
 
 #endif // H_FileService
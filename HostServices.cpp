@@ -35,8 +35,13 @@
 #include "variant_list.h"
 #include "DOM/Document.h"
 
+#include "Admission.h"
+#include "CredentialCache.h"
 #include "HostServices.h"
 #include "SecureConnection.h"
+#include "SessionPool.h"
+#include "SftpChannelPool.h"
+#include "WarmUp.h"
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -55,7 +60,26 @@ HostServices::HostServices(boost::shared_ptr<HostServicesPlugin> plugin,
     m_host(host)
 {
     registerMethod("SecureConnection", make_method(this, &HostServices::createSecureConnection));
+    registerMethod("warmUp", make_method(this, &HostServices::warmUp));
     registerProperty("version", make_property(this, &HostServices::get_version));
+    registerProperty("sessionIdleTimeout", make_property(this,
+                                                         &HostServices::get_sessionIdleTimeout,
+                                                         &HostServices::set_sessionIdleTimeout));
+    registerProperty("sessionKeepaliveInterval", make_property(this,
+                                                               &HostServices::get_sessionKeepaliveInterval,
+                                                               &HostServices::set_sessionKeepaliveInterval));
+    registerProperty("credentialCacheTimeout", make_property(this,
+                                                             &HostServices::get_credentialCacheTimeout,
+                                                             &HostServices::set_credentialCacheTimeout));
+    registerProperty("handshakeLimit", make_property(this,
+                                                     &HostServices::get_handshakeLimit,
+                                                     &HostServices::set_handshakeLimit));
+    registerProperty("channelLimit", make_property(this,
+                                                   &HostServices::get_channelLimit,
+                                                   &HostServices::set_channelLimit));
+    registerProperty("sftpPoolSize", make_property(this,
+                                                   &HostServices::get_sftpPoolSize,
+                                                   &HostServices::set_sftpPoolSize));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -95,6 +119,83 @@ std::string HostServices::get_version()
 }
 
 
+// Read/write property sessionIdleTimeout: seconds an unused pooled session
+// is kept open. The pool is shared by every plugin instance in the process.
+unsigned int HostServices::get_sessionIdleTimeout()
+{
+    return SessionPool::instance().getIdleTimeout();
+}
+
+void HostServices::set_sessionIdleTimeout(unsigned int seconds)
+{
+    SessionPool::instance().setIdleTimeout(seconds);
+}
+
+// Read/write property sessionKeepaliveInterval: seconds a pooled session may
+// be quiet before a keepalive is sent on it; 0 disables keepalives.
+unsigned int HostServices::get_sessionKeepaliveInterval()
+{
+    return SessionPool::instance().getKeepaliveInterval();
+}
+
+void HostServices::set_sessionKeepaliveInterval(unsigned int seconds)
+{
+    SessionPool::instance().setKeepaliveInterval(seconds);
+}
+
+// Read/write property credentialCacheTimeout: seconds a password the user
+// has typed is reused for other connections to the same account; 0 asks
+// every time.
+unsigned int HostServices::get_credentialCacheTimeout()
+{
+    return CredentialCache::instance().getTimeout();
+}
+
+void HostServices::set_credentialCacheTimeout(unsigned int seconds)
+{
+    CredentialCache::instance().setTimeout(seconds);
+}
+
+// Read/write property handshakeLimit: the most connections to one host that
+// may be handshaking or authenticating at once; others wait their turn. A
+// host that drops connections sooner is given fewer for a while.
+unsigned int HostServices::get_handshakeLimit()
+{
+    return Admission::instance().getHandshakeLimit();
+}
+
+void HostServices::set_handshakeLimit(unsigned int limit)
+{
+    Admission::instance().setHandshakeLimit(limit);
+}
+
+// Read/write property channelLimit: the most channels open on one session at
+// once, as sshd's MaxSessions; others wait their turn. A host that refuses
+// channels sooner is given fewer for a while.
+unsigned int HostServices::get_channelLimit()
+{
+    return Admission::instance().getChannelLimit();
+}
+
+void HostServices::set_channelLimit(unsigned int limit)
+{
+    Admission::instance().setChannelLimit(limit);
+}
+
+// Read/write property sftpPoolSize: the most SFTP subsystems a session opens
+// for its connections and services to share. More are opened only while
+// that many operations are running at once, and closed again when idle.
+unsigned int HostServices::get_sftpPoolSize()
+{
+    return SftpChannelPool::getSize();
+}
+
+void HostServices::set_sftpPoolSize(unsigned int size)
+{
+    SftpChannelPool::setSize(size);
+}
+
+
 
 // SecureConnection (JS)constructor 
 
@@ -107,6 +208,17 @@ HostServices::createSecureConnection(const std::string& user,
 					      user, hostName, port.get_value_or(22));
 }
 
+// Method warmUp: resolves, connects to and handshakes with each host in a
+// list of host[:port] entries in the background, so that the first
+// connection to each finds a session ready; see WarmUp.h. Entries that
+// parse are warmed even if others do not.
+
+void HostServices::warmUp(const std::string& hosts)
+{
+  if (WarmUp::instance().start(hosts))
+    throw FB::script_error("Invalid host in warm-up list.");
+}
+
 // Local Variables:
 // mode: c++
 // c-basic-offset: 2
@@ -63,9 +63,29 @@ public:
 
   std::string get_version();
 
+  unsigned int get_sessionIdleTimeout();
+  void set_sessionIdleTimeout(unsigned int seconds);
+
+  unsigned int get_sessionKeepaliveInterval();
+  void set_sessionKeepaliveInterval(unsigned int seconds);
+
+  unsigned int get_credentialCacheTimeout();
+  void set_credentialCacheTimeout(unsigned int seconds);
+
+  unsigned int get_handshakeLimit();
+  void set_handshakeLimit(unsigned int limit);
+
+  unsigned int get_channelLimit();
+  void set_channelLimit(unsigned int limit);
+
+  unsigned int get_sftpPoolSize();
+  void set_sftpPoolSize(unsigned int size);
+
   FB::JSAPIPtr createSecureConnection(const std::string& user,
                                       const std::string& hostName,
                                       boost::optional<unsigned int> port);
+
+  void warmUp(const std::string& hosts);
 private:
   HostServicesPluginWeakPtr m_plugin;
   FB::BrowserHostPtr m_host;
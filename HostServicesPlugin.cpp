@@ -39,8 +39,14 @@
 #endif
 
 
+#include <algorithm>
+
+#include "CredentialCache.h"
 #include "HostServices.h"
 #include "HostServicesPlugin.h"
+#include "SecureConnection.h"
+#include "SessionPool.h"
+#include "WarmUp.h"
 
 
 /*----------------------------------------------------------------------------*
@@ -119,6 +125,13 @@ void HostServicesPlugin::onPluginReady()
   m_view = boost::make_shared<RequestPasswordView>(this, GetWindow());
   m_view->ok_signal.connect(boost::bind(&HostServicesPlugin::passwordRequestFilled, this));
   m_view->cancel_signal.connect(boost::bind(&HostServicesPlugin::passwordRequestDenied, this));
+
+  // <param name="warmup" value="host1, host2:2222"> starts the handshakes
+  // with the page's hosts before the page asks for a connection. A bad
+  // entry in a param has no one to be reported to, so it is skipped.
+  boost::optional<std::string> warmUp = getParam("warmup");
+  if (warmUp)
+    WarmUp::instance().start(*warmUp);
 }
 
 
@@ -184,26 +197,17 @@ bool HostServicesPlugin::onWindowDetached(FB::DetachedEvent *evt, FB::PluginWind
 
   HostServicesPlugin::requestCredentials
 
-  userName: name of the user account on the remote host for which credentials
-    are being requested.
-
-  hostName: name of the remote host.
-
-  The first three parameters are not interpreted in any way, but are used to
-  build a descriptive string for the user explaining which credentials are
-  requested an on behalf of whom (what?).
+  Asks the user for the password of the connection's account, and answers
+  with its credentialsRequestFilled or credentialsRequestDenied, at most
+  once per request.
 
-  The callback is a function of two parameters that returns void.  The first
-  parameter is a boolean, indicating whether or not the second parameter is
-  valid.  In the case that the user cancels the request for credentials, or
-  that the request is otherwise aborted, this function will be called with
-  false in the first parameter, and an empty string in the second. If the
-  first parameter is true, then the second parameter contains the requested
-  password.  Unless something very bad happens, this function will always be
-  called; it will be called at most once per invocation of requestCredentials.
+  The view asks for one account at a time. A connection to an account whose
+  password is still in the CredentialCache is answered straight away; one
+  to an account already being asked for, or waiting to be, joins that
+  request, and is answered along with every other connection in it.
 
   requestCredentials is non-blocking and will return almost immediately. The
-  callback will be called after an arbitrarily long time.
+  answer may come after an arbitrarily long time.
 
  *-----------------------------------------------------------------------------*/
 
@@ -211,27 +215,96 @@ void HostServicesPlugin::requestCredentials(SecureConnectionPtr connection)
 {
   if (!m_host->isMainThread())
   {
-    m_host->ScheduleOnMainThread(shared_ptr(), boost::bind(&HostServicesPlugin::requestCredentials,
-                                                           connection));
+    m_host->ScheduleOnMainThread(shared_from_this(),
+                                 boost::bind(&HostServicesPlugin::requestCredentials,
+                                             this, connection));
     return;
   }
 
   m_host->assertMainThread();
-  
-  if (connection == m_viewOwner)
+
+  std::string account = accountOf(connection);
+  std::string password;
+
+  if (CredentialCache::instance().lookup(account, password))
+  {
+    connection->credentialsRequestFilled(password);
+    return;
+  }
+
+  std::vector<SecureConnectionPtr>& waiting = m_requests[account];
+  if (std::find(waiting.begin(), waiting.end(), connection) != waiting.end())
     return;
 
-  if (m_viewWaitList.find(connection) != m_viewWaitlist.end())
+  waiting.push_back(connection);
+  if (waiting.size() > 1)
     return;
 
-  if (m_viewOwner == NULL)
+  if (m_viewAccount.empty())
   {
-    m_viewOwner = connection;
+    m_viewAccount = account;
     m_view->setLabel(connection->description());
     m_view->enable();
   }
   else
-    m_viewWaitlist.push_back(connection);
+    m_viewWaitlist.push_back(account);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  HostServicesPlugin::cancelCredentialsRequest
+
+  Withdraws a request made with requestCredentials, for a connection that no
+  longer needs the credentials -- for instance because it could not reach
+  the remote host while the user was being asked. The account is still
+  asked for while other connections wait on it; otherwise, if the view is
+  showing it, the view moves on to the next. The connection is not
+  notified.
+
+ *-----------------------------------------------------------------------------*/
+
+void HostServicesPlugin::cancelCredentialsRequest(SecureConnectionPtr connection)
+{
+  if (!m_host->isMainThread())
+  {
+    m_host->ScheduleOnMainThread(shared_from_this(),
+                                 boost::bind(&HostServicesPlugin::cancelCredentialsRequest,
+                                             this, connection));
+    return;
+  }
+
+  m_host->assertMainThread();
+
+  std::string account = accountOf(connection);
+
+  std::map<std::string, std::vector<SecureConnectionPtr> >::iterator request = m_requests.find(account);
+  if (request == m_requests.end())
+    return;
+
+  std::vector<SecureConnectionPtr>& waiting = request->second;
+  std::vector<SecureConnectionPtr>::iterator it = std::find(waiting.begin(), waiting.end(), connection);
+  if (it == waiting.end())
+    return;
+
+  waiting.erase(it);
+  if (!waiting.empty())
+    return;
+
+  m_requests.erase(request);
+
+  std::deque<std::string>::iterator queued = std::find(m_viewWaitlist.begin(),
+                                                       m_viewWaitlist.end(),
+                                                       account);
+  if (queued != m_viewWaitlist.end())
+    m_viewWaitlist.erase(queued);
+
+  else if (account == m_viewAccount)
+  {
+    m_view->clearEntry();
+    m_view->disable();
+    handleNextCredentialsRequest();
+  }
 }
 
 
@@ -239,26 +312,34 @@ void HostServicesPlugin::requestCredentials(SecureConnectionPtr connection)
 
   HostServicesPlugin::passwordRequestFilled
 
+  The password is cached before the waiting connections are released, so
+  that any connection to the account that asks meanwhile gets it too.
+
  *-----------------------------------------------------------------------------*/
 
 void HostServicesPlugin::passwordRequestFilled()
 {
-  m_view.disable();
-
   if (!m_host->isMainThread())
   {
-    m_host->ScheduleOnMainThread(shared_ptr(), boost::bind(&HostServicesPlugin::passwordRequestFilled));
+    m_host->ScheduleOnMainThread(shared_from_this(),
+                                 boost::bind(&HostServicesPlugin::passwordRequestFilled, this));
     return;
   }
 
   m_host->assertMainThread();
-  
-  SecureConnectionPtr connection = m_viewOwner;
+
+  m_view->disable();
+
   std::string password = m_view->getPassword();
-  
+  std::vector<SecureConnectionPtr> waiting;
+  waiting.swap(m_requests[m_viewAccount]);
+  m_requests.erase(m_viewAccount);
+
+  CredentialCache::instance().store(m_viewAccount, password);
   handleNextCredentialsRequest();
 
-  connection->credentialsRequestFilled(password);
+  for (size_t i = 0; i < waiting.size(); i++)
+    waiting[i]->credentialsRequestFilled(password);
 }
 
 
@@ -270,19 +351,25 @@ void HostServicesPlugin::passwordRequestFilled()
 
 void HostServicesPlugin::passwordRequestDenied()
 {
-  m_view.disable();
-
   if (!m_host->isMainThread())
   {
-    m_host->ScheduleOnMainThread(shared_ptr(), boost::bind(&HostServicesPlugin::passwordRequestDenied));
+    m_host->ScheduleOnMainThread(shared_from_this(),
+                                 boost::bind(&HostServicesPlugin::passwordRequestDenied, this));
     return;
   }
 
   m_host->assertMainThread();
 
-  SecureConnectionPtr connection = m_viewOwner;
+  m_view->disable();
+
+  std::vector<SecureConnectionPtr> waiting;
+  waiting.swap(m_requests[m_viewAccount]);
+  m_requests.erase(m_viewAccount);
+
   handleNextCredentialsRequest();
-  connection->credentialsRequestDenied();
+
+  for (size_t i = 0; i < waiting.size(); i++)
+    waiting[i]->credentialsRequestDenied();
 }
 
 /*-----------------------------------------------------------------------------*
@@ -293,17 +380,24 @@ void HostServicesPlugin::passwordRequestDenied()
 
 void HostServicesPlugin::handleNextCredentialsRequest()
 {
-  m_viewOwner = NULL;
+  m_viewAccount = "";
 
   if (m_viewWaitlist.size() > 0)
   {
-    m_viewOwner = m_viewWaitlist.front();
-    viewWaitlist.pop_front();
-    m_view->setLabel(m_viewOwner->description());
+    m_viewAccount = m_viewWaitlist.front();
+    m_viewWaitlist.pop_front();
+    m_view->setLabel(m_requests[m_viewAccount].front()->description());
     m_view->enable();
   }
 }
 
+
+// Requests are grouped by account, keyed as in SessionPool.
+std::string HostServicesPlugin::accountOf(SecureConnectionPtr connection)
+{
+  return SessionPool::makeKey(connection->get_user(), connection->get_hostName(), connection->get_port());
+}
+
 // Local Variables:
 // mode: c++
 // c-basic-offset: 2
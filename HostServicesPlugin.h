@@ -27,6 +27,11 @@
 #ifndef H_HOSTSERVICESPLUGIN
 #define H_HOSTSERVICESPLUGIN
 
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
 #include <gtkmm.h>
 
 #include "PluginWindow.h"
@@ -75,14 +80,20 @@ public:
   /** END EVENTDEF -- DON'T CHANGE THIS LINE **/
 
   void requestCredentials(SecureConnectionPtr connection);
+  void cancelCredentialsRequest(SecureConnectionPtr connection);
   void passwordRequestFilled();
   void passwordRequestDenied();
   void handleNextCredentialsRequest();
 
 private:
-  SecureConnectionPtr m_viewOwner;
+  static std::string accountOf(SecureConnectionPtr connection);
+
+  // The account the view is asking for, or "" if none. Every connection
+  // waiting on an account is answered by the one prompt for it.
+  std::string m_viewAccount;
   RequestPasswordViewPtr m_view;
-  std::deque<SecureConnectionPtr> m_viewWaitlist;
+  std::deque<std::string> m_viewWaitlist;
+  std::map<std::string, std::vector<SecureConnectionPtr> > m_requests;
 };
 
 
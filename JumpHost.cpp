@@ -0,0 +1,271 @@
+/******************************************************************************
+
+  JumpHost.cpp
+
+  Opens sessions to hosts behind a bastion, through channels on a pooled
+  session with the bastion.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstdlib>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "JumpHost.h"
+#include "SecureConnection.h"
+
+
+#define DEFAULT_SSH_PORT 22
+
+
+/*-----------------------------------------------------------------------------*
+
+  JumpHost::instance
+
+  *-----------------------------------------------------------------------------*/
+
+JumpHost& JumpHost::instance()
+{
+  static JumpHost jumpHost;
+  return jumpHost;
+}
+
+
+JumpHost::JumpHost()
+{
+}
+
+
+bool JumpHost::parse(const std::string& spec,
+                     const std::string& defaultUser,
+                     std::string& user,
+                     std::string& hostName,
+                     unsigned int& port)
+{
+  std::string rest(spec);
+
+  size_t at = rest.rfind('@');
+  if (at != std::string::npos)
+  {
+    user = rest.substr(0, at);
+    rest.erase(0, at + 1);
+  }
+  else
+    user = defaultUser;
+
+  return !user.empty() && parseHost(rest, hostName, port);
+}
+
+
+bool JumpHost::parseHost(const std::string& spec,
+                         std::string& hostName,
+                         unsigned int& port)
+{
+  std::string rest(spec);
+
+  std::string portText;
+  if (!rest.empty() && rest[0] == '[')
+  {
+    size_t close = rest.find(']');
+    if (close == std::string::npos)
+      return false;
+
+    hostName = rest.substr(1, close - 1);
+    rest.erase(0, close + 1);
+
+    if (!rest.empty())
+    {
+      if (rest[0] != ':')
+        return false;
+
+      portText = rest.substr(1);
+    }
+  }
+  else
+  {
+    // A bare IPv6 address has more than one colon, and no port.
+    size_t colon = rest.find(':');
+    if (colon != std::string::npos && rest.find(':', colon + 1) == std::string::npos)
+    {
+      hostName = rest.substr(0, colon);
+      portText = rest.substr(colon + 1);
+    }
+    else
+      hostName = rest;
+  }
+
+  port = DEFAULT_SSH_PORT;
+  if (!portText.empty())
+  {
+    if (portText.find_first_not_of("0123456789") != std::string::npos || portText.length() > 5)
+      return false;
+
+    port = atoi(portText.c_str());
+  }
+
+  return !hostName.empty() && port > 0 && port <= 65535;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  JumpHost::acquire
+
+  A bastion already in use is shared. Otherwise the caller waits on the
+  bastion being opened for the account, and if there is none, one is opened:
+  from a session in the pool if there is one, else by a SecureConnection of
+  its own, which reports back through opened or failed.
+
+  *-----------------------------------------------------------------------------*/
+
+void JumpHost::acquire(SecureConnectionPtr inner,
+                       const std::string& user,
+                       const std::string& hostName,
+                       unsigned int port,
+                       ReactorLoop *loop,
+                       const Callback& done)
+{
+  std::string key = SessionPool::makeKey(user, hostName, port);
+
+  Waiter waiter;
+  waiter.loop = loop;
+  waiter.done = done;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::map<std::string, BastionWeakPtr>::iterator it = m_bastions.find(key);
+    if (it != m_bastions.end())
+    {
+      BastionPtr bastion = it->second.lock();
+      if (bastion)
+      {
+        loop->post(boost::bind(done, bastion, std::string()));
+        return;
+      }
+
+      m_bastions.erase(it);
+    }
+
+    std::map<std::string, Pending>::iterator pending = m_pending.find(key);
+    if (pending != m_pending.end())
+    {
+      pending->second.waiters.push_back(waiter);
+      return;
+    }
+
+    m_pending[key].waiters.push_back(waiter);
+  }
+
+  PooledSessionPtr session = SessionPool::instance().acquire(key);
+  if (session)
+  {
+    opened(session);
+    return;
+  }
+
+  HostServicesPtr hs = inner->m_hs.lock();
+  if (!hs)
+  {
+    failed(key, "Unable to open jump host session.");
+    return;
+  }
+
+  SecureConnectionPtr connection = boost::make_shared<SecureConnection>(hs, user, hostName, port);
+  connection->m_bastion = true;
+  connection->m_connectTimeout = inner->m_connectTimeout;
+  connection->m_attemptTimeout = inner->m_attemptTimeout;
+  connection->m_compression = inner->m_compression;
+  connection->m_algorithmProfile = inner->m_algorithmProfile;
+  connection->m_unknownHostPolicy = inner->m_unknownHostPolicy;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_pending[key].connection = connection;
+  }
+
+  connection->startOpen();
+}
+
+
+void JumpHost::opened(PooledSessionPtr session)
+{
+  finish(session->getKey(),
+         boost::make_shared<Bastion>(session, boost::bind(&JumpHost::forget, this, session->getKey(), _1)),
+         "");
+}
+
+
+void JumpHost::failed(const std::string& key, const std::string& error)
+{
+  finish(key, BastionPtr(), error);
+}
+
+
+// The connection that opened the bastion is let go of outside the lock;
+// closing it may report back here.
+void JumpHost::finish(const std::string& key, BastionPtr bastion, const std::string& error)
+{
+  Pending pending;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::map<std::string, Pending>::iterator it = m_pending.find(key);
+    if (it == m_pending.end())
+      return;
+
+    pending = it->second;
+    m_pending.erase(it);
+
+    if (bastion)
+      m_bastions[key] = bastion;
+  }
+
+  for (size_t i = 0; i < pending.waiters.size(); i++)
+    pending.waiters[i].loop->post(boost::bind(pending.waiters[i].done, bastion, error));
+}
+
+
+void JumpHost::forget(const std::string& key, Bastion *bastion)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, BastionWeakPtr>::iterator it = m_bastions.find(key);
+  if (it == m_bastions.end())
+    return;
+
+  BastionPtr current = it->second.lock();
+  if (!current || current.get() == bastion)
+    m_bastions.erase(it);
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,135 @@
+/******************************************************************************
+
+  JumpHost.h
+
+  Hosts that can only be reached through a bastion are reached as OpenSSH's
+  ProxyJump does: a direct-tcpip channel is opened through an authenticated
+  session to the bastion, and the session to the host is run over it.
+
+  JumpHost hands out Bastions, one per bastion account; see Tunnel.h. All
+  the hosts reached through one bastion cost one handshake with it. A
+  bastion's session is opened by a SecureConnection of its own, which
+  prompts for a password if it needs one, and bastions being opened are
+  shared, as lookups are in Resolver.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_JumpHost
+#define H_JumpHost
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libssh2.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+#include "SessionPool.h"
+#include "Tunnel.h"
+
+
+FB_FORWARD_PTR(SecureConnection)
+
+class JumpHost
+{
+ public:
+  // Called with the bastion, or with an empty pointer and the reason it
+  // could not be opened.
+  typedef boost::function<void (BastionPtr, const std::string&)> Callback;
+
+  static JumpHost& instance();
+
+  // Splits a jump host given as [user@]host[:port]; an IPv6 address with a
+  // port is written in brackets. The user defaults to defaultUser and the
+  // port to 22.
+  static bool parse(const std::string& spec,
+                    const std::string& defaultUser,
+                    std::string& user,
+                    std::string& hostName,
+                    unsigned int& port);
+
+  // Splits the host[:port] part of a spec alone.
+  static bool parseHost(const std::string& spec,
+                        std::string& hostName,
+                        unsigned int& port);
+
+  // Calls done on loop with the bastion for the account. A bastion's
+  // session that has to be opened is opened with the connection settings
+  // -- timeouts, host key policy and so on -- of inner, the connection that
+  // wants it.
+  void acquire(SecureConnectionPtr inner,
+               const std::string& user,
+               const std::string& hostName,
+               unsigned int port,
+               ReactorLoop *loop,
+               const Callback& done);
+
+ private:
+  friend class SecureConnection;
+
+  JumpHost();
+
+  // From the SecureConnection opening a bastion: its session, now pooled,
+  // with the reference add gave it; or why it failed. failed is ignored
+  // once the outcome is known.
+  void opened(PooledSessionPtr session);
+  void failed(const std::string& key, const std::string& error);
+
+  // From a bastion whose session has failed, so it is not handed out again.
+  void forget(const std::string& key, Bastion *bastion);
+
+  struct Waiter
+  {
+    ReactorLoop *loop;
+    Callback done;
+  };
+
+  struct Pending
+  {
+    SecureConnectionPtr connection;
+    std::vector<Waiter> waiters;
+  };
+
+  void finish(const std::string& key, BastionPtr bastion, const std::string& error);
+
+  boost::mutex m_mutex;
+  std::map<std::string, BastionWeakPtr> m_bastions;
+  std::map<std::string, Pending> m_pending;
+};
+
+#endif // H_JumpHost
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
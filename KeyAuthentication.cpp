@@ -0,0 +1,209 @@
+/******************************************************************************
+
+  KeyAuthentication.cpp
+
+  KeyAuthentication authenticates a session with ssh-agent or the private
+  keys in ~/.ssh, without asking the user.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "KeyAuthentication.h"
+
+
+// Tried in this order, as ssh does.
+static const char *keyFileNames[] = { "id_ed25519", "id_ecdsa", "id_rsa", "id_dsa" };
+
+
+boost::mutex KeyAuthentication::s_mutex;
+std::map<std::string, KeyAuthentication::Method> KeyAuthentication::s_methods;
+
+
+KeyAuthentication::Method KeyAuthentication::rememberedMethod(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(s_mutex);
+
+  std::map<std::string, Method>::iterator it = s_methods.find(key);
+  return it != s_methods.end() ? it->second : METHOD_UNKNOWN;
+}
+
+
+void KeyAuthentication::rememberMethod(const std::string& key, Method method)
+{
+  boost::mutex::scoped_lock lock(s_mutex);
+  s_methods[key] = method;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KeyAuthentication::KeyAuthentication
+
+  Only key files that exist are tried, so a missing one costs nothing.
+
+  *-----------------------------------------------------------------------------*/
+
+KeyAuthentication::KeyAuthentication(LIBSSH2_SESSION *session, const std::string& user)
+  : m_session(session),
+    m_user(user),
+    m_state(LIST),
+    m_result(LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED),
+    m_agent(NULL),
+    m_identity(NULL),
+    m_nextKeyFile(0)
+{
+  const char *home = getenv("HOME");
+  if (!home)
+    return;
+
+  for (size_t i = 0; i < sizeof(keyFileNames) / sizeof(keyFileNames[0]); i++)
+  {
+    std::string path(home);
+    path.append("/.ssh/");
+    path.append(keyFileNames[i]);
+
+    if (access(path.c_str(), R_OK) == 0)
+      m_keyFiles.push_back(path);
+  }
+}
+
+
+KeyAuthentication::~KeyAuthentication()
+{
+  if (m_agent)
+  {
+    libssh2_agent_disconnect(m_agent);
+    libssh2_agent_free(m_agent);
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KeyAuthentication::step
+
+  The agent is a local socket and is talked to synchronously; only the
+  exchanges with the host can return LIBSSH2_ERROR_EAGAIN. Key files with a
+  passphrase are refused by libssh2 and simply skipped.
+
+  *-----------------------------------------------------------------------------*/
+
+int KeyAuthentication::step()
+{
+  int rc;
+
+  for (;;)
+    switch (m_state)
+    {
+    case LIST:
+    {
+      const char *methods = libssh2_userauth_list(m_session, m_user.c_str(), m_user.length());
+
+      if (!methods)
+      {
+        if (libssh2_userauth_authenticated(m_session))
+          m_result = 0;
+
+        else if (libssh2_session_last_errno(m_session) == LIBSSH2_ERROR_EAGAIN)
+          return LIBSSH2_ERROR_EAGAIN;
+
+        m_state = DONE;
+      }
+      else
+        m_state = strstr(methods, "publickey") ? AGENT_CONNECT : DONE;
+
+      break;
+    }
+
+    case AGENT_CONNECT:
+      m_state = FILE_NEXT;
+
+      if (!(m_agent = libssh2_agent_init(m_session)))
+        break;
+
+      if (libssh2_agent_connect(m_agent) == 0 && libssh2_agent_list_identities(m_agent) == 0)
+        m_state = AGENT_NEXT;
+      break;
+
+    case AGENT_NEXT:
+      m_state = libssh2_agent_get_identity(m_agent, &m_identity, m_identity) == 0 ? AGENT_AUTH : FILE_NEXT;
+      break;
+
+    case AGENT_AUTH:
+      if ((rc = libssh2_agent_userauth(m_agent, m_user.c_str(), m_identity)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc == 0)
+      {
+        m_result = 0;
+        m_state = DONE;
+      }
+      else
+        m_state = AGENT_NEXT;
+      break;
+
+    case FILE_NEXT:
+      m_state = m_nextKeyFile < m_keyFiles.size() ? FILE_AUTH : DONE;
+      break;
+
+    case FILE_AUTH:
+    {
+      const std::string& privateKey = m_keyFiles[m_nextKeyFile];
+      std::string publicKey(privateKey + ".pub");
+
+      if ((rc = libssh2_userauth_publickey_fromfile_ex(m_session, m_user.c_str(), m_user.length(),
+                                                       access(publicKey.c_str(), R_OK) == 0
+                                                         ? publicKey.c_str() : NULL,
+                                                       privateKey.c_str(), "")) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      if (rc == 0)
+      {
+        m_result = 0;
+        m_state = DONE;
+      }
+      else
+      {
+        m_nextKeyFile++;
+        m_state = FILE_NEXT;
+      }
+      break;
+    }
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
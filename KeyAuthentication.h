@@ -0,0 +1,98 @@
+/******************************************************************************
+
+  KeyAuthentication.h
+
+  KeyAuthentication authenticates a session without asking the user: first
+  with each identity held by ssh-agent, then with the unencrypted private
+  keys in ~/.ssh. It runs as a reactor step, like the SFTP operations.
+
+  Which way each account was last authenticated is remembered for the life
+  of the process, so that SecureConnection can ask for a password up front,
+  while it connects, for accounts that need one, and not bother the user at
+  all for accounts that do not.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_KeyAuthentication
+#define H_KeyAuthentication
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libssh2.h>
+
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+
+FB_FORWARD_PTR(KeyAuthentication)
+
+class KeyAuthentication
+{
+ public:
+  enum Method {
+    METHOD_UNKNOWN,
+    METHOD_PUBLICKEY,
+    METHOD_PASSWORD
+  };
+
+  // The method that last worked for an account, keyed as in SessionPool.
+  static Method rememberedMethod(const std::string& key);
+  static void rememberMethod(const std::string& key, Method method);
+
+  KeyAuthentication(LIBSSH2_SESSION *session, const std::string& user);
+  ~KeyAuthentication();
+
+  // Returns 0 once authenticated, LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED if
+  // every key was refused or the host does not take keys.
+  int step();
+
+ private:
+  enum State { LIST, AGENT_CONNECT, AGENT_NEXT, AGENT_AUTH, FILE_NEXT, FILE_AUTH, DONE };
+
+  static boost::mutex s_mutex;
+  static std::map<std::string, Method> s_methods;
+
+  LIBSSH2_SESSION *m_session;
+  std::string m_user;
+  State m_state;
+  int m_result;
+
+  LIBSSH2_AGENT *m_agent;
+  struct libssh2_agent_publickey *m_identity;
+
+  std::vector<std::string> m_keyFiles;
+  size_t m_nextKeyFile;
+};
+
+#endif // H_KeyAuthentication
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,471 @@
+/******************************************************************************
+
+  KnownHosts.cpp
+
+  KnownHosts checks host keys against ~/.ssh/known_hosts, parsed once per
+  process into an index.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <gcrypt.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include "KnownHosts.h"
+
+#define HASH_MAGIC "|1|"
+#define SALT_SIZE 20
+
+
+static const char base64Alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static std::string base64Encode(const std::string& data)
+{
+  std::string text;
+  size_t i = 0;
+
+  for (; i + 2 < data.size(); i += 3)
+  {
+    unsigned int n = ((unsigned char) data[i] << 16) | ((unsigned char) data[i + 1] << 8)
+                     | (unsigned char) data[i + 2];
+    text += base64Alphabet[(n >> 18) & 63];
+    text += base64Alphabet[(n >> 12) & 63];
+    text += base64Alphabet[(n >> 6) & 63];
+    text += base64Alphabet[n & 63];
+  }
+
+  if (i + 1 == data.size())
+  {
+    unsigned int n = (unsigned char) data[i] << 16;
+    text += base64Alphabet[(n >> 18) & 63];
+    text += base64Alphabet[(n >> 12) & 63];
+    text += "==";
+  }
+  else if (i + 2 == data.size())
+  {
+    unsigned int n = ((unsigned char) data[i] << 16) | ((unsigned char) data[i + 1] << 8);
+    text += base64Alphabet[(n >> 18) & 63];
+    text += base64Alphabet[(n >> 12) & 63];
+    text += base64Alphabet[(n >> 6) & 63];
+    text += '=';
+  }
+
+  return text;
+}
+
+
+static std::string base64Decode(const std::string& text)
+{
+  std::string data;
+  unsigned int n = 0;
+  int bits = 0;
+
+  for (size_t i = 0; i < text.size() && text[i] != '='; i++)
+  {
+    const char *p = strchr(base64Alphabet, text[i]);
+    if (!p || !*p)
+      return "";
+
+    n = (n << 6) | (p - base64Alphabet);
+    if ((bits += 6) >= 8)
+    {
+      bits -= 8;
+      data += (char) ((n >> bits) & 0xff);
+    }
+  }
+
+  return data;
+}
+
+
+static std::string hmacSha1(const std::string& salt, const std::string& name)
+{
+  gcry_md_hd_t handle;
+  if (gcry_md_open(&handle, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC))
+    return "";
+
+  gcry_md_setkey(handle, salt.data(), salt.size());
+  gcry_md_write(handle, name.data(), name.size());
+
+  std::string hash((const char *) gcry_md_read(handle, GCRY_MD_SHA1), gcry_md_get_algo_dlen(GCRY_MD_SHA1));
+  gcry_md_close(handle);
+
+  return hash;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KnownHosts::instance
+
+  *-----------------------------------------------------------------------------*/
+
+KnownHosts& KnownHosts::instance()
+{
+  static KnownHosts hosts;
+  return hosts;
+}
+
+
+KnownHosts::KnownHosts()
+  : m_mtime(0),
+    m_size(-1)
+{
+  const char *home = getenv("HOME");
+
+  m_path = home ? home : "";
+  m_path.append("/.ssh/known_hosts");
+}
+
+
+// The name a host is recorded under: OpenSSH brackets it and appends the
+// port unless the port is the standard one.
+std::string KnownHosts::makeName(const std::string& hostName, unsigned int port)
+{
+  std::string host = boost::algorithm::to_lower_copy(hostName);
+  if (port == 22)
+    return host;
+
+  std::stringstream name;
+  name << "[" << host << "]:" << port;
+  return name.str();
+}
+
+
+// A key blob starts with its type, as a length-prefixed string.
+std::string KnownHosts::keyTypeOf(const std::string& key)
+{
+  if (key.size() < 4)
+    return "";
+
+  size_t length = ((unsigned char) key[0] << 24) | ((unsigned char) key[1] << 16)
+                  | ((unsigned char) key[2] << 8) | (unsigned char) key[3];
+
+  return length <= key.size() - 4 ? key.substr(4, length) : "";
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KnownHosts::check
+
+  A key matching any line for the host is accepted, unless it is revoked.
+  A line for the host with a different key of the same type is a mismatch;
+  keys of other types say nothing about this one.
+
+  *-----------------------------------------------------------------------------*/
+
+KnownHosts::Result KnownHosts::check(const std::string& hostName, unsigned int port,
+                                     const char *key, size_t length)
+{
+  std::string blob(key, length);
+  std::string type = keyTypeOf(blob);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  refresh();
+
+  if (m_revoked.count(blob))
+    return HOST_KEY_REVOKED;
+
+  std::vector<size_t> entries = lookup(makeName(hostName, port));
+
+  Result result = HOST_KEY_NOT_FOUND;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const Entry& entry = m_entries[entries[i]];
+    if (entry.marker != MARKER_NONE)
+      continue;
+
+    if (entry.key == blob)
+      return HOST_KEY_MATCH;
+
+    if (entry.keyType == type)
+      result = HOST_KEY_MISMATCH;
+  }
+
+  return result;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KnownHosts::add
+
+  *-----------------------------------------------------------------------------*/
+
+bool KnownHosts::add(const std::string& hostName, unsigned int port, const char *key, size_t length)
+{
+  std::string blob(key, length);
+  std::string name = makeName(hostName, port);
+
+  char salt[SALT_SIZE];
+  gcry_create_nonce(salt, sizeof(salt));
+
+  std::string hashed(HASH_MAGIC);
+  hashed.append(base64Encode(std::string(salt, sizeof(salt))));
+  hashed.append("|");
+  hashed.append(base64Encode(hmacSha1(std::string(salt, sizeof(salt)), name)));
+
+  std::string line(hashed);
+  line.append(" ");
+  line.append(keyTypeOf(blob));
+  line.append(" ");
+  line.append(base64Encode(blob));
+  line.append("\n");
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  refresh();
+
+  int fd;
+  if ((fd = open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+    return false;
+
+  bool written = write(fd, line.data(), line.size()) == (ssize_t) line.size();
+
+  struct stat st;
+  if (written && fstat(fd, &st) == 0)
+  {
+    m_mtime = st.st_mtime;
+    m_size = st.st_size;
+  }
+  close(fd);
+
+  if (!written)
+    return false;
+
+  Entry entry;
+  entry.marker = MARKER_NONE;
+  entry.keyType = keyTypeOf(blob);
+  entry.key = blob;
+  m_entries.push_back(entry);
+
+  index(hashed, m_entries.size() - 1);
+
+  // The name is known to match the new line; no need to hash it again.
+  std::map<std::string, std::vector<size_t> >::iterator it = m_matched.find(name);
+  if (it != m_matched.end())
+    it->second.push_back(m_entries.size() - 1);
+
+  return true;
+}
+
+
+// Re-parses the file if it has changed since it was last read.
+void KnownHosts::refresh()
+{
+  struct stat st;
+  if (stat(m_path.c_str(), &st) != 0)
+  {
+    st.st_mtime = 0;
+    st.st_size = 0;
+  }
+
+  if (st.st_mtime == m_mtime && st.st_size == m_size)
+    return;
+
+  m_mtime = st.st_mtime;
+  m_size = st.st_size;
+  parse();
+}
+
+
+void KnownHosts::parse()
+{
+  m_entries.clear();
+  m_plain.clear();
+  m_hashed.clear();
+  m_patterns.clear();
+  m_revoked.clear();
+  m_matched.clear();
+
+  std::ifstream file(m_path.c_str());
+  std::string line;
+
+  while (std::getline(file, line))
+    parseLine(line);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KnownHosts::parseLine
+
+  [@marker] hosts keytype key [comment]
+
+  *-----------------------------------------------------------------------------*/
+
+void KnownHosts::parseLine(const std::string& line)
+{
+  std::istringstream fields(line);
+
+  std::string hosts;
+  if (!(fields >> hosts) || hosts[0] == '#')
+    return;
+
+  Entry entry;
+  entry.marker = MARKER_NONE;
+
+  if (hosts[0] == '@')
+  {
+    if (hosts == "@revoked")
+      entry.marker = MARKER_REVOKED;
+
+    else if (hosts == "@cert-authority")
+      entry.marker = MARKER_CERT_AUTHORITY;
+
+    else
+      return;
+
+    if (!(fields >> hosts))
+      return;
+  }
+
+  std::string key;
+  if (!(fields >> entry.keyType >> key))
+    return;
+
+  if ((entry.key = base64Decode(key)).empty())
+    return;
+
+  if (entry.marker == MARKER_REVOKED)
+    m_revoked.insert(entry.key);
+
+  m_entries.push_back(entry);
+  index(hosts, m_entries.size() - 1);
+}
+
+
+void KnownHosts::index(const std::string& hosts, size_t entry)
+{
+  if (hosts.compare(0, strlen(HASH_MAGIC), HASH_MAGIC) == 0)
+  {
+    size_t bar = hosts.find('|', strlen(HASH_MAGIC));
+    if (bar == std::string::npos)
+      return;
+
+    HashedName hashed;
+    hashed.salt = base64Decode(hosts.substr(strlen(HASH_MAGIC), bar - strlen(HASH_MAGIC)));
+    hashed.hash = base64Decode(hosts.substr(bar + 1));
+    hashed.entry = entry;
+    m_hashed.push_back(hashed);
+    return;
+  }
+
+  std::vector<std::string> names;
+  boost::algorithm::split(names, hosts, boost::algorithm::is_any_of(","));
+
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    std::string name = boost::algorithm::to_lower_copy(names[i]);
+
+    if (name.empty())
+      continue;
+
+    if (name[0] == '!')
+      m_entries[entry].negated.push_back(name.substr(1));
+
+    else if (name.find_first_of("*?") != std::string::npos)
+    {
+      Pattern pattern;
+      pattern.pattern = name;
+      pattern.entry = entry;
+      m_patterns.push_back(pattern);
+    }
+    else
+      m_plain.insert(std::make_pair(name, entry));
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  KnownHosts::lookup
+
+  Returns the lines that apply to name. Plain names come straight from the
+  index; hashed names and patterns are matched once per name and the result
+  kept until the file is next parsed.
+
+  *-----------------------------------------------------------------------------*/
+
+std::vector<size_t> KnownHosts::lookup(const std::string& name)
+{
+  std::map<std::string, std::vector<size_t> >::iterator matched = m_matched.find(name);
+  if (matched == m_matched.end())
+  {
+    std::vector<size_t> entries;
+
+    for (size_t i = 0; i < m_hashed.size(); i++)
+      if (hmacSha1(m_hashed[i].salt, name) == m_hashed[i].hash)
+        entries.push_back(m_hashed[i].entry);
+
+    for (size_t i = 0; i < m_patterns.size(); i++)
+      if (fnmatch(m_patterns[i].pattern.c_str(), name.c_str(), 0) == 0)
+        entries.push_back(m_patterns[i].entry);
+
+    matched = m_matched.insert(std::make_pair(name, entries)).first;
+  }
+
+  std::vector<size_t> entries(matched->second);
+
+  std::pair<std::multimap<std::string, size_t>::iterator,
+            std::multimap<std::string, size_t>::iterator> plain = m_plain.equal_range(name);
+  for (std::multimap<std::string, size_t>::iterator it = plain.first; it != plain.second; it++)
+    entries.push_back(it->second);
+
+  // A line does not apply to names it excludes.
+  std::vector<size_t> applicable;
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const std::vector<std::string>& negated = m_entries[entries[i]].negated;
+
+    bool excluded = false;
+    for (size_t j = 0; j < negated.size() && !excluded; j++)
+      excluded = fnmatch(negated[j].c_str(), name.c_str(), 0) == 0;
+
+    if (!excluded)
+      applicable.push_back(entries[i]);
+  }
+
+  return applicable;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,131 @@
+/******************************************************************************
+
+  KnownHosts.h
+
+  KnownHosts checks host keys against ~/.ssh/known_hosts. The file is parsed
+  once per process into an index, rather than once per connection, since
+  managed known_hosts files run to tens of thousands of lines:
+
+    - plain host names map directly to their lines;
+    - hashed names (|1|salt|hash) cannot be indexed without knowing the name
+      they hash, so the first lookup of a name hashes it against each salt
+      and remembers which lines matched, as it does for wildcard patterns.
+
+  Each check compares the file's modification time and size with those it
+  was parsed at, and re-parses only when they differ. Keys added here are
+  appended to the file and the index together, without a re-parse.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_KnownHosts
+#define H_KnownHosts
+
+#include <ctime>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/thread/mutex.hpp>
+
+
+class KnownHosts
+{
+ public:
+  enum Result {
+    HOST_KEY_MATCH,
+    HOST_KEY_NOT_FOUND,
+    HOST_KEY_MISMATCH,
+    HOST_KEY_REVOKED
+  };
+
+  static KnownHosts& instance();
+
+  // Checks key, the raw blob from libssh2_session_hostkey, for hostName.
+  Result check(const std::string& hostName, unsigned int port, const char *key, size_t length);
+
+  // Records key for hostName, hashing the name as OpenSSH does. Returns
+  // false if the file could not be written.
+  bool add(const std::string& hostName, unsigned int port, const char *key, size_t length);
+
+ private:
+  KnownHosts();
+
+  enum Marker { MARKER_NONE, MARKER_REVOKED, MARKER_CERT_AUTHORITY };
+
+  struct Entry
+  {
+    Marker marker;
+    std::string keyType;
+    std::string key;
+    std::vector<std::string> negated;
+  };
+
+  struct HashedName
+  {
+    std::string salt;
+    std::string hash;
+    size_t entry;
+  };
+
+  struct Pattern
+  {
+    std::string pattern;
+    size_t entry;
+  };
+
+  static std::string makeName(const std::string& hostName, unsigned int port);
+  static std::string keyTypeOf(const std::string& key);
+
+  void refresh();
+  void parse();
+  void parseLine(const std::string& line);
+  void index(const std::string& hosts, size_t entry);
+  std::vector<size_t> lookup(const std::string& name);
+
+  boost::mutex m_mutex;
+  std::string m_path;
+  time_t m_mtime;
+  off_t m_size;
+
+  std::vector<Entry> m_entries;
+  std::multimap<std::string, size_t> m_plain;
+  std::vector<HashedName> m_hashed;
+  std::vector<Pattern> m_patterns;
+  std::set<std::string> m_revoked;
+
+  // Lines matched by hashed names and patterns, by name looked up.
+  std::map<std::string, std::vector<size_t> > m_matched;
+};
+
+#endif // H_KnownHosts
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
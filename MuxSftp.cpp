@@ -0,0 +1,341 @@
+/******************************************************************************
+
+  MuxSftp.cpp
+
+  MuxSftp is an SFTP client for subsystems opened through a ControlMaster.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <boost/bind.hpp>
+
+#include "MuxSftp.h"
+#include "WireFormat.h"
+
+
+#define SFTP_VERSION 3
+
+// Largest packet accepted from the server; OpenSSH's sftp-server sends at
+// most 256 KB.
+#define MAX_PACKET_SIZE 262144
+
+
+static void closeSockets(ReactorLoop *loop, int control, int stream)
+{
+  loop->detach(stream);
+  close(stream);
+  close(control);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxSftp::MuxSftp
+
+  *-----------------------------------------------------------------------------*/
+
+MuxSftp::MuxSftp(const std::string& key, int control, int stream, ReactorLoop *loop)
+  : m_key(key),
+    m_control(control),
+    m_stream(stream),
+    m_loop(loop),
+    m_nextId(1),
+    m_versionReceived(false),
+    m_initSent(false),
+    m_error(0)
+{
+  m_loop->attach(m_stream, boost::bind(&MuxSftp::directions, this));
+}
+
+
+MuxSftp::~MuxSftp()
+{
+  m_loop->post(boost::bind(closeSockets, m_loop, m_control, m_stream));
+}
+
+
+const std::string& MuxSftp::getKey() const
+{
+  return m_key;
+}
+
+
+ReactorLoop *MuxSftp::getLoop() const
+{
+  return m_loop;
+}
+
+
+void MuxSftp::submit(const ReactorLoop::Step& step, const ReactorLoop::Completion& done)
+{
+  m_loop->submit(m_stream, step, done);
+}
+
+
+int MuxSftp::init()
+{
+  if (!m_initSent)
+  {
+    std::string packet;
+    packet.push_back((char) FXP_INIT);
+    putUint32(packet, SFTP_VERSION);
+
+    putUint32(m_out, packet.length());
+    m_out.append(packet);
+    m_initSent = true;
+  }
+
+  int rc;
+  if ((rc = pump()))
+    return rc;
+
+  return m_versionReceived ? 0 : LIBSSH2_ERROR_EAGAIN;
+}
+
+
+uint32_t MuxSftp::request(unsigned char type, const std::string& payload)
+{
+  uint32_t id = m_nextId++;
+
+  std::string packet;
+  packet.push_back((char) type);
+  putUint32(packet, id);
+  packet.append(payload);
+
+  putUint32(m_out, packet.length());
+  m_out.append(packet);
+
+  m_awaited.insert(id);
+  return id;
+}
+
+
+int MuxSftp::reply(uint32_t id, unsigned char& type, std::string& payload)
+{
+  std::map<uint32_t, std::pair<unsigned char, std::string> >::iterator it = m_replies.find(id);
+
+  if (it == m_replies.end())
+  {
+    int rc;
+    if ((rc = pump()))
+      return rc;
+
+    if ((it = m_replies.find(id)) == m_replies.end())
+      return LIBSSH2_ERROR_EAGAIN;
+  }
+
+  type = it->second.first;
+  payload.swap(it->second.second);
+  m_replies.erase(it);
+  m_awaited.erase(id);
+  return 0;
+}
+
+
+int MuxSftp::statusResult(const std::string& payload, uint32_t *status)
+{
+  size_t offset = 0;
+  uint32_t code;
+
+  if (!getUint32(payload, offset, code))
+    return LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+  if (status)
+    *status = code;
+
+  return code == FX_OK ? 0 : LIBSSH2_ERROR_SFTP_PROTOCOL;
+}
+
+
+bool MuxSftp::skipAttributes(const std::string& payload, size_t& offset)
+{
+  uint32_t flags;
+  uint64_t size;
+  uint32_t modified;
+
+  return getAttributes(payload, offset, flags, size, modified);
+}
+
+
+bool MuxSftp::getAttributes(const std::string& payload, size_t& offset,
+                            uint32_t& flags, uint64_t& size, uint32_t& modified)
+{
+  uint32_t word;
+  std::string text;
+
+  if (!getUint32(payload, offset, flags))
+    return false;
+
+  if ((flags & ATTR_SIZE) && !getUint64(payload, offset, size))
+    return false;
+
+  if ((flags & ATTR_UIDGID) && !(getUint32(payload, offset, word) && getUint32(payload, offset, word)))
+    return false;
+
+  if ((flags & ATTR_PERMISSIONS) && !getUint32(payload, offset, word))
+    return false;
+
+  if ((flags & ATTR_ACMODTIME) && !(getUint32(payload, offset, word) && getUint32(payload, offset, modified)))
+    return false;
+
+  if (flags & ATTR_EXTENDED)
+  {
+    uint32_t count;
+    if (!getUint32(payload, offset, count))
+      return false;
+
+    for (uint32_t i = 0; i < count; i++)
+      if (!getString(payload, offset, text) || !getString(payload, offset, text))
+        return false;
+  }
+
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxSftp::pump
+
+  Writes what it can of the queued requests and reads whatever replies have
+  arrived, whoever they are for. Returns 0 unless the stream has failed, in
+  which case every operation on it fails with the same error.
+
+  *-----------------------------------------------------------------------------*/
+
+int MuxSftp::pump()
+{
+  if (m_error)
+    return m_error;
+
+  while (!m_out.empty())
+  {
+    ssize_t n = send(m_stream, m_out.data(), m_out.length(), MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return m_error = LIBSSH2_ERROR_SOCKET_SEND;
+
+      break;
+    }
+
+    m_out.erase(0, n);
+  }
+
+  char buffer[16384];
+  for (;;)
+  {
+    ssize_t n = recv(m_stream, buffer, sizeof(buffer), 0);
+
+    if (n == 0)
+      return m_error = LIBSSH2_ERROR_SOCKET_DISCONNECT;
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return m_error = LIBSSH2_ERROR_SOCKET_RECV;
+
+      break;
+    }
+
+    m_in.append(buffer, n);
+  }
+
+  size_t offset = 0;
+  for (;;)
+  {
+    size_t start = offset;
+    uint32_t length;
+
+    if (!getUint32(m_in, offset, length) || m_in.length() - offset < length)
+    {
+      offset = start;
+      break;
+    }
+
+    if (length < 1 || length > MAX_PACKET_SIZE)
+      return m_error = LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+    unsigned char type = m_in[offset];
+    size_t end = offset + length;
+    offset++;
+
+    uint32_t id;
+    if (type == FXP_VERSION)
+      m_versionReceived = true;
+
+    else if (!getUint32(m_in, offset, id) || offset > end)
+      return m_error = LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+    else if (m_awaited.count(id))
+      m_replies[id] = std::make_pair(type, m_in.substr(offset, end - offset));
+
+    offset = end;
+  }
+
+  m_in.erase(0, offset);
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  MuxSftp::directions
+
+  The reactor steps every operation on the stream whenever it is readable,
+  but an operation stepped early in a pass may miss a reply read on its
+  behalf by a later one. While any reply is waiting to be collected, the
+  stream is watched for writing too, which it nearly always is, so that
+  the operations are stepped again at once.
+
+  *-----------------------------------------------------------------------------*/
+
+int MuxSftp::directions()
+{
+  return !m_out.empty() || !m_replies.empty()
+         ? LIBSSH2_SESSION_BLOCK_INBOUND | LIBSSH2_SESSION_BLOCK_OUTBOUND
+         : LIBSSH2_SESSION_BLOCK_INBOUND;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,161 @@
+/******************************************************************************
+
+  MuxSftp.h
+
+  MuxSftp is an SFTP version 3 client (draft-ietf-secsh-filexfer-02) for an
+  SFTP subsystem opened through an OpenSSH ControlMaster; see
+  ControlMaster.h. libssh2 can only speak SFTP over its own channels, so the
+  packets are built and parsed here. Only what the SFTP operations in
+  SftpOperations.h need is implemented.
+
+  Like a PooledSession, a MuxSftp lives on one reactor loop, and everything
+  done with it must be submitted there. Several operations may be under way
+  at once: each request carries an id, and each operation waits for the
+  reply with its own.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_MuxSftp
+#define H_MuxSftp
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <stdint.h>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+
+
+FB_FORWARD_PTR(MuxSftp)
+
+class MuxSftp
+{
+ public:
+  // Packet types and constants from the protocol draft.
+  enum {
+    FXP_INIT = 1,
+    FXP_VERSION = 2,
+    FXP_OPEN = 3,
+    FXP_CLOSE = 4,
+    FXP_READ = 5,
+    FXP_OPENDIR = 11,
+    FXP_READDIR = 12,
+    FXP_REALPATH = 16,
+    FXP_STAT = 17,
+    FXP_STATUS = 101,
+    FXP_HANDLE = 102,
+    FXP_DATA = 103,
+    FXP_NAME = 104,
+    FXP_ATTRS = 105
+  };
+
+  enum {
+    ATTR_SIZE = 0x00000001,
+    ATTR_UIDGID = 0x00000002,
+    ATTR_PERMISSIONS = 0x00000004,
+    ATTR_ACMODTIME = 0x00000008,
+    ATTR_EXTENDED = 0x80000000
+  };
+
+  enum {
+    FX_OK = 0,
+    FX_EOF = 1
+  };
+
+  enum {
+    FXF_READ = 1
+  };
+
+  // Takes over the control connection and the subsystem's stream from a
+  // successful MuxRequest, and attaches the stream to loop.
+  MuxSftp(const std::string& key, int control, int stream, ReactorLoop *loop);
+
+  // Closes both sockets, from the loop; the master then closes the
+  // subsystem.
+  ~MuxSftp();
+
+  const std::string& getKey() const;
+  ReactorLoop *getLoop() const;
+
+  void submit(const ReactorLoop::Step& step, const ReactorLoop::Completion& done);
+
+  // Step: exchanges versions with the server.
+  int init();
+
+  // Queues a request; payload is what follows the request id. Returns the
+  // id, with which to collect the reply.
+  uint32_t request(unsigned char type, const std::string& payload);
+
+  // Step: returns 0 with the reply to id once it has arrived; payload is
+  // what follows the id. Returns a libssh2 socket error code if the stream
+  // has failed.
+  int reply(uint32_t id, unsigned char& type, std::string& payload);
+
+  // The error code for a status reply: 0 for FX_OK, otherwise
+  // LIBSSH2_ERROR_SFTP_PROTOCOL, as libssh2 reports a failed request.
+  static int statusResult(const std::string& payload, uint32_t *status = NULL);
+
+  // Skips a file attributes structure.
+  static bool skipAttributes(const std::string& payload, size_t& offset);
+
+  // Reads a file attributes structure; size and modified, the modification
+  // time, are set only if flags has ATTR_SIZE and ATTR_ACMODTIME.
+  static bool getAttributes(const std::string& payload, size_t& offset,
+                            uint32_t& flags, uint64_t& size, uint32_t& modified);
+
+ private:
+  int pump();
+  int directions();
+
+  std::string m_key;
+  int m_control;
+  int m_stream;
+  ReactorLoop *m_loop;
+
+  uint32_t m_nextId;
+  bool m_versionReceived;
+  bool m_initSent;
+  int m_error;
+
+  std::string m_out;
+  std::string m_in;
+
+  // Ids of the requests whose replies are still wanted, and the replies
+  // that have arrived but not yet been collected.
+  std::set<uint32_t> m_awaited;
+  std::map<uint32_t, std::pair<unsigned char, std::string> > m_replies;
+};
+
+#endif // H_MuxSftp
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
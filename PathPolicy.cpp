@@ -0,0 +1,432 @@
+/******************************************************************************
+
+  PathPolicy.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include <algorithm>
+#include <map>
+
+#include "PathPolicy.h"
+
+// The most states the automaton may have. Policies of thousands of
+// specifiers need a few per byte of specifier; this only stops a policy
+// whose globs multiply out.
+#define POLICY_MAX_STATES 65536
+
+
+PathPolicy::PathPolicy()
+  : m_states(1),
+    m_classCount(0),
+    m_start(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::isValidGlob
+
+  Braces must be closed, and may not be nested. A } outside braces is an
+  ordinary character.
+
+  *-----------------------------------------------------------------------------*/
+
+bool PathPolicy::isValidGlob(const std::string& glob)
+{
+  bool inBrace = false;
+
+  for (size_t i = 0; i < glob.size(); i++)
+    if (glob[i] == '{')
+    {
+      if (inBrace)
+        return false;
+
+      inBrace = true;
+    }
+    else if (glob[i] == '}')
+      inBrace = false;
+
+  return !inBrace;
+}
+
+
+void PathPolicy::addSection(int access)
+{
+  m_sections.push_back(access);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::addSpecifier
+
+  The specifier's states are all made together, after those of the
+  specifiers before it, so that ordering states orders their specifiers;
+  see verdict. What it names is followed by (/.*)?, for everything below.
+
+  *-----------------------------------------------------------------------------*/
+
+void PathPolicy::addSpecifier(const std::string& glob, bool include)
+{
+  if (m_sections.empty())
+    return;
+
+  Specifier specifier;
+  specifier.section = m_sections.size() - 1;
+  specifier.include = include;
+
+  int index = m_specifiers.size();
+  m_specifiers.push_back(specifier);
+
+  int start = addState();
+  addEpsilon(0, start);
+
+  size_t i = 0;
+  int end = addGlob(start, glob, i, false);
+
+  int below = addState();
+  addEdge(end, '/', '/', below);
+  addEdge(below, 0, 255, below);
+
+  m_states[end].specifier = index;
+  m_states[below].specifier = index;
+}
+
+
+int PathPolicy::addState()
+{
+  m_states.push_back(State());
+  return m_states.size() - 1;
+}
+
+
+void PathPolicy::addEdge(int from, unsigned char first, unsigned char last, int to)
+{
+  Edge edge;
+  edge.first = first;
+  edge.last = last;
+  edge.target = to;
+
+  m_states[from].edges.push_back(edge);
+}
+
+
+void PathPolicy::addEpsilon(int from, int to)
+{
+  m_states[from].epsilons.push_back(to);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::addGlob
+
+  Adds the states for glob from i on, following state, up to the end of the
+  glob or, within braces, up to the , or } that ends the alternative.
+  Returns the state the glob ends in.
+
+  * is taken as the regex (\\.|[^/])*, as FileService always has, so a
+  backslash takes the character after it, even a /, into the component.
+
+  *-----------------------------------------------------------------------------*/
+
+int PathPolicy::addGlob(int state, const std::string& glob, size_t& i, bool inBrace)
+{
+  while (i < glob.size())
+  {
+    unsigned char c = glob[i];
+    int next;
+
+    if (inBrace && (c == ',' || c == '}'))
+      return state;
+
+    if (glob.compare(i, 3, "...") == 0)
+    {
+      next = addState();
+      addEpsilon(state, next);
+      addEdge(next, 0, 255, next);
+      i += 3;
+    }
+    else if (c == '?')
+    {
+      next = addState();
+      addEdge(state, 0, 255, next);
+      i++;
+    }
+    else if (c == '*')
+    {
+      next = addState();
+      int escaped = addState();
+
+      addEpsilon(state, next);
+      addEdge(next, 0, '/' - 1, next);
+      addEdge(next, '/' + 1, 255, next);
+      addEdge(next, '\\', '\\', escaped);
+      addEdge(escaped, 0, 255, next);
+      i++;
+    }
+    else if (c == '{' && !inBrace)
+    {
+      next = addState();
+
+      do
+      {
+        i++;
+
+        int alternative = addState();
+        addEpsilon(state, alternative);
+        addEpsilon(addGlob(alternative, glob, i, true), next);
+      }
+      while (i < glob.size() && glob[i] == ',');
+
+      i++;
+    }
+    else
+    {
+      next = addState();
+      addEdge(state, c, c, next);
+      i++;
+    }
+
+    state = next;
+  }
+
+  return state;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::compile
+
+  Bytes are first divided into classes at every byte where an edge's range
+  begins or ends after one, so that the bytes of a class always go the
+  same way. The deterministic states are then found breadth first from the
+  closure of state 0.
+
+  *-----------------------------------------------------------------------------*/
+
+bool PathPolicy::compile()
+{
+  std::vector<bool> boundary(257, false);
+  boundary[0] = true;
+
+  for (size_t s = 0; s < m_states.size(); s++)
+    for (size_t e = 0; e < m_states[s].edges.size(); e++)
+    {
+      boundary[m_states[s].edges[e].first] = true;
+      boundary[m_states[s].edges[e].last + 1] = true;
+    }
+
+  int current = -1;
+  for (int b = 0; b < 256; b++)
+  {
+    if (boundary[b])
+      current++;
+
+    m_classes[b] = current;
+  }
+
+  m_classCount = current + 1;
+  m_transitions.clear();
+  m_verdicts.clear();
+
+  std::map<std::vector<int>, int> ids;
+  std::vector<std::vector<int> > sets;
+  std::vector<bool> seen(m_states.size(), false);
+
+  sets.push_back(std::vector<int>());
+  ids[sets.back()] = 0;
+
+  std::vector<int> start(1, 0);
+  close(start, seen);
+
+  m_start = sets.size();
+  ids[start] = m_start;
+  sets.push_back(start);
+
+  for (size_t d = 0; d < sets.size(); d++)
+  {
+    std::vector<int> set(sets[d]);
+    std::vector<std::vector<int> > moves(m_classCount);
+
+    for (size_t i = 0; i < set.size(); i++)
+    {
+      const std::vector<Edge>& edges = m_states[set[i]].edges;
+
+      for (size_t e = 0; e < edges.size(); e++)
+        for (int c = m_classes[edges[e].first]; c <= m_classes[edges[e].last]; c++)
+          moves[c].push_back(edges[e].target);
+    }
+
+    for (int c = 0; c < m_classCount; c++)
+    {
+      close(moves[c], seen);
+
+      std::map<std::vector<int>, int>::iterator it = ids.find(moves[c]);
+      if (it != ids.end())
+      {
+        m_transitions.push_back(it->second);
+        continue;
+      }
+
+      if (sets.size() >= POLICY_MAX_STATES)
+      {
+        m_transitions.clear();
+        m_verdicts.clear();
+        return false;
+      }
+
+      ids[moves[c]] = sets.size();
+      m_transitions.push_back(sets.size());
+      sets.push_back(moves[c]);
+    }
+
+    m_verdicts.push_back(verdict(set));
+  }
+
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::close
+
+  Replaces states with its closure over epsilons, sorted, keeping only the
+  states that matter to the deterministic automaton: those with edges, and
+  those that accept. seen is all false, and is left so.
+
+  *-----------------------------------------------------------------------------*/
+
+void PathPolicy::close(std::vector<int>& states, std::vector<bool>& seen) const
+{
+  std::vector<int> reached;
+  std::vector<int> pending(states);
+
+  while (!pending.empty())
+  {
+    int s = pending.back();
+    pending.pop_back();
+
+    if (seen[s])
+      continue;
+
+    seen[s] = true;
+    reached.push_back(s);
+
+    const std::vector<int>& epsilons = m_states[s].epsilons;
+    for (size_t i = 0; i < epsilons.size(); i++)
+      if (!seen[epsilons[i]])
+        pending.push_back(epsilons[i]);
+  }
+
+  states.clear();
+
+  for (size_t i = 0; i < reached.size(); i++)
+  {
+    seen[reached[i]] = false;
+
+    if (!m_states[reached[i]].edges.empty() || m_states[reached[i]].specifier >= 0)
+      states.push_back(reached[i]);
+  }
+
+  std::sort(states.begin(), states.end());
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::verdict
+
+  The access for a path that ends in the deterministic state made of
+  states. Their accepting specifiers come in order, so the last one seen
+  for each section is the last of the section to match.
+
+  *-----------------------------------------------------------------------------*/
+
+int PathPolicy::verdict(const std::vector<int>& states) const
+{
+  int access = ACCESS_NONE;
+  int section = -1;
+  bool include = false;
+
+  for (size_t i = 0; i < states.size(); i++)
+  {
+    int index = m_states[states[i]].specifier;
+    if (index < 0)
+      continue;
+
+    const Specifier& specifier = m_specifiers[index];
+
+    if (specifier.section != section)
+    {
+      if (section >= 0 && include)
+        access = m_sections[section];
+
+      section = specifier.section;
+    }
+
+    include = specifier.include;
+  }
+
+  if (section >= 0 && include)
+    access = m_sections[section];
+
+  return access;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PathPolicy::check
+
+  *-----------------------------------------------------------------------------*/
+
+int PathPolicy::check(const std::string& path) const
+{
+  if (m_verdicts.empty())
+    return ACCESS_NONE;
+
+  int state = m_start;
+
+  for (size_t i = 0; i < path.size(); i++)
+  {
+    state = m_transitions[state * m_classCount + m_classes[(unsigned char) path[i]]];
+
+    // Dead; nothing can match.
+    if (state == 0)
+      return ACCESS_NONE;
+  }
+
+  return m_verdicts[state];
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,132 @@
+/******************************************************************************
+
+  PathPolicy.h
+
+  A FileService policy compiled into one deterministic automaton over the
+  bytes of a path, so that checking a path costs one table lookup per byte
+  however many specifiers the policy has.
+
+  The policy is given as it is parsed: a section, the specifiers in it, the
+  next section, and so on. A path is in a section if the last of the
+  section's specifiers to match it is a + one. The last section the path
+  is in decides what may be done with it; a path in none may not be read
+  or written.
+
+  A specifier is an absolute path, which may be globbed: ? matches any one
+  character, * any run of characters within a path component, ... any run
+  of characters at all, and {a,b,...} any one of the alternatives, which
+  may not themselves contain braces. A specifier matches the path it names
+  and everything below it.
+
+  The automaton's states are sets of states of the nondeterministic one the
+  specifiers make, found by subset construction, and each knows the verdict
+  for a path that ends in it. Bytes that no specifier tells apart share a
+  column of the transition table.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_PathPolicy
+#define H_PathPolicy
+
+#include <string>
+#include <vector>
+
+
+class PathPolicy
+{
+ public:
+  enum Access { ACCESS_NONE = 0, ACCESS_READ = 1, ACCESS_WRITE = 2 };
+
+  PathPolicy();
+
+  // Whether a glob is well formed, which addSpecifier requires.
+  static bool isValidGlob(const std::string& glob);
+
+  // Starts a section granting access, a mask of the above.
+  void addSection(int access);
+
+  // Adds a specifier to the current section; include is true for a +
+  // specifier. Specifiers before the first section are ignored.
+  void addSpecifier(const std::string& glob, bool include);
+
+  // Builds the automaton once everything has been added. Returns false if
+  // it would have more than POLICY_MAX_STATES states.
+  bool compile();
+
+  // The access the policy gives path; ACCESS_NONE until compiled.
+  int check(const std::string& path) const;
+
+ private:
+  struct Edge
+  {
+    unsigned char first;
+    unsigned char last;
+    int target;
+  };
+
+  struct State
+  {
+    State() : specifier(-1) {}
+
+    std::vector<Edge> edges;
+    std::vector<int> epsilons;
+    int specifier; // accepting, for this specifier, if not -1
+  };
+
+  struct Specifier
+  {
+    int section;
+    bool include;
+  };
+
+  int addState();
+  void addEdge(int from, unsigned char first, unsigned char last, int to);
+  void addEpsilon(int from, int to);
+  int addGlob(int start, const std::string& glob, size_t& i, bool inBrace);
+
+  void close(std::vector<int>& states, std::vector<bool>& seen) const;
+  int verdict(const std::vector<int>& states) const;
+
+  // The nondeterministic automaton; state 0 starts every specifier.
+  std::vector<State> m_states;
+  std::vector<Specifier> m_specifiers;
+  std::vector<int> m_sections;
+
+  // The deterministic one. State 0 is dead: no specifier can match a path
+  // that reaches it, and it never leaves it.
+  unsigned char m_classes[256];
+  int m_classCount;
+  int m_start;
+  std::vector<int> m_transitions; // state * m_classCount + class
+  std::vector<unsigned char> m_verdicts;
+};
+
+#endif // H_PathPolicy
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
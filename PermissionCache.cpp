@@ -0,0 +1,138 @@
+/******************************************************************************
+
+  PermissionCache.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include "PermissionCache.h"
+
+// Paths remembered per service; far more than a page polls.
+#define PERMISSION_CACHE_SIZE 1024
+
+
+PermissionCache::PermissionCache()
+  : m_generation(0),
+    m_hits(0),
+    m_misses(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PermissionCache::lookup
+
+  A caller still holding a policy that has since been replaced finds
+  nothing, rather than the new policy's decisions.
+
+  *-----------------------------------------------------------------------------*/
+
+bool PermissionCache::lookup(unsigned int generation, const std::string& path, int& access)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  renew(generation);
+
+  std::map<std::string, EntryList::iterator>::iterator it = m_index.find(path);
+  if (generation < m_generation || it == m_index.end())
+  {
+    m_misses++;
+    return false;
+  }
+
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  access = it->second->second;
+
+  m_hits++;
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PermissionCache::store
+
+  A decision made under a policy that has since been replaced is dropped;
+  the path will be checked against the new one next time.
+
+  *-----------------------------------------------------------------------------*/
+
+void PermissionCache::store(unsigned int generation, const std::string& path, int access)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  renew(generation);
+
+  if (generation < m_generation)
+    return;
+
+  std::map<std::string, EntryList::iterator>::iterator it = m_index.find(path);
+  if (it != m_index.end())
+  {
+    it->second->second = access;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return;
+  }
+
+  if (m_index.size() >= PERMISSION_CACHE_SIZE)
+  {
+    m_index.erase(m_entries.back().first);
+    m_entries.pop_back();
+  }
+
+  m_entries.push_front(std::make_pair(path, access));
+  m_index[path] = m_entries.begin();
+}
+
+
+unsigned int PermissionCache::getHits()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_hits;
+}
+
+
+unsigned int PermissionCache::getMisses()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_misses;
+}
+
+
+void PermissionCache::renew(unsigned int generation)
+{
+  if (generation <= m_generation)
+    return;
+
+  m_generation = generation;
+  m_entries.clear();
+  m_index.clear();
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
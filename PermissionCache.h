@@ -0,0 +1,83 @@
+/******************************************************************************
+
+  PermissionCache.h
+
+  Pages poll the same few files over and over, and each get checks its path
+  against the service's policy. A FileService's PermissionCache remembers
+  the access the policy gave the paths checked most recently, so that a
+  path checked again is not run through the policy.
+
+  The decisions hold only for the policy that made them. Each policy the
+  service compiles has a new generation number, and the first lookup under
+  a new generation forgets everything remembered under the old one.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_PermissionCache
+#define H_PermissionCache
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+
+class PermissionCache
+{
+ public:
+  PermissionCache();
+
+  // Sets access to that remembered for path under the policy of the given
+  // generation, and counts a hit; otherwise counts a miss.
+  bool lookup(unsigned int generation, const std::string& path, int& access);
+
+  // Remembers the access the policy of the given generation gave path,
+  // forgetting the least recently used path if the cache is full.
+  void store(unsigned int generation, const std::string& path, int access);
+
+  unsigned int getHits();
+  unsigned int getMisses();
+
+ private:
+  typedef std::list<std::pair<std::string, int> > EntryList;
+
+  void renew(unsigned int generation);
+
+  boost::mutex m_mutex;
+  unsigned int m_generation;
+  EntryList m_entries; // most recently used first
+  std::map<std::string, EntryList::iterator> m_index;
+  unsigned int m_hits;
+  unsigned int m_misses;
+};
+
+#endif // H_PermissionCache
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
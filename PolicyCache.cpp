@@ -0,0 +1,135 @@
+/******************************************************************************
+
+  PolicyCache.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include "PolicyCache.h"
+
+
+/*-----------------------------------------------------------------------------*
+
+  PolicyCache::instance
+
+  *-----------------------------------------------------------------------------*/
+
+PolicyCache& PolicyCache::instance()
+{
+  static PolicyCache cache;
+  return cache;
+}
+
+
+PolicyCache::PolicyCache()
+{
+}
+
+
+bool PolicyCache::lookupSchemes(const std::string& key, const SftpStat& stat, std::vector<std::string>& schemes)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  const Entry *entry = find(key, stat);
+  if (!entry)
+    return false;
+
+  schemes = entry->schemes;
+  return true;
+}
+
+
+void PolicyCache::storeSchemes(const std::string& key, const SftpStat& stat, const std::vector<std::string>& schemes)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  store(key, stat).schemes = schemes;
+}
+
+
+bool PolicyCache::lookupPolicy(const std::string& key, const std::string& scheme, const SftpStat& stat, std::string& text)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  const Entry *entry = find(key + "/" + scheme, stat);
+  if (!entry)
+    return false;
+
+  text = entry->text;
+  return true;
+}
+
+
+void PolicyCache::storePolicy(const std::string& key, const std::string& scheme, const SftpStat& stat, const std::string& text)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  store(key + "/" + scheme, stat).text = text;
+}
+
+
+bool PolicyCache::lookupHome(const std::string& key, std::string& home)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, std::string>::const_iterator it = m_homes.find(key);
+  if (it == m_homes.end())
+    return false;
+
+  home = it->second;
+  return true;
+}
+
+
+void PolicyCache::storeHome(const std::string& key, const std::string& home)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_homes[key] = home;
+}
+
+
+const PolicyCache::Entry *PolicyCache::find(const std::string& key, const SftpStat& stat)
+{
+  EntryMap::const_iterator it = m_entries.find(key);
+
+  if (it == m_entries.end()
+      || it->second.size != stat.getSize()
+      || it->second.modified != stat.getModified())
+    return NULL;
+
+  return &it->second;
+}
+
+
+PolicyCache::Entry& PolicyCache::store(const std::string& key, const SftpStat& stat)
+{
+  Entry& entry = m_entries[key];
+  entry.size = stat.getSize();
+  entry.modified = stat.getModified();
+  return entry;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,104 @@
+/******************************************************************************
+
+  PolicyCache.h
+
+  Opening a connection lists the account's ~/.jshs/config, and each service
+  request reads the scheme's policy file from it, a few round trips apiece.
+  The files seldom change, so PolicyCache remembers, for each account keyed
+  by user@hostName:port as in SessionPool, the scheme list and the policies
+  that have been read, along with the size and modification time the
+  directory or file had when it was read. A single stat then tells whether
+  what is remembered is still good.
+
+  The stat is made before the read, so a file changed in between is read
+  in its new form and stored with its old stat, and is read again next
+  time. A file rewritten within the same second at the same size is not
+  noticed; the server gives modification times in whole seconds.
+
+  The cache also remembers each account's home directory, which services
+  need to expand ~ in their policies. It does not change, so once resolved
+  it is not asked for again.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_PolicyCache
+#define H_PolicyCache
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#include "SftpOperations.h"
+
+
+class PolicyCache
+{
+ public:
+  static PolicyCache& instance();
+
+  // Sets schemes to those remembered for the account, if its config
+  // directory is as stat found it when they were listed.
+  bool lookupSchemes(const std::string& key, const SftpStat& stat, std::vector<std::string>& schemes);
+  void storeSchemes(const std::string& key, const SftpStat& stat, const std::vector<std::string>& schemes);
+
+  // As for the schemes, for the text of one scheme's policy.
+  bool lookupPolicy(const std::string& key, const std::string& scheme, const SftpStat& stat, std::string& text);
+  void storePolicy(const std::string& key, const std::string& scheme, const SftpStat& stat, const std::string& text);
+
+  bool lookupHome(const std::string& key, std::string& home);
+  void storeHome(const std::string& key, const std::string& home);
+
+ private:
+  PolicyCache();
+
+  struct Entry
+  {
+    uint64_t size;
+    unsigned long modified;
+    std::vector<std::string> schemes;
+    std::string text;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  // The directory's entry is under the account's key, and each policy's
+  // under the key followed by a slash and the scheme.
+  const Entry *find(const std::string& key, const SftpStat& stat);
+  Entry& store(const std::string& key, const SftpStat& stat);
+
+  boost::mutex m_mutex;
+  EntryMap m_entries;
+  std::map<std::string, std::string> m_homes;
+};
+
+#endif // H_PolicyCache
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
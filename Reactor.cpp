@@ -0,0 +1,566 @@
+/******************************************************************************
+
+  Reactor.cpp
+
+  Reactor drives every SSH session in the process without blocking. It owns
+  one ReactorLoop per core; each loop is a thread waiting on an epoll set and
+  owns a subset of the sessions. All libssh2 calls on a session are made from
+  its loop's thread, which is also what keeps sessions shared through the
+  SessionPool safe: libssh2 must never see two threads in one session.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <libssh2.h>
+
+#include <boost/bind.hpp>
+
+#include "Reactor.h"
+
+// The most events taken from epoll_wait in one call.
+#define MAX_EVENTS 64
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::ReactorLoop
+
+  Creates the epoll set and the eventfd used to wake the loop when work is
+  posted from another thread, then starts the loop thread. The thread takes
+  the mutex before anything else, so it cannot run until m_thread has been
+  assigned and isLoopThread can be trusted.
+
+  *-----------------------------------------------------------------------------*/
+
+ReactorLoop::ReactorLoop()
+  : m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+    m_wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    m_timerSequence(0),
+    m_load(0),
+    m_stopping(false)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = m_wake;
+  epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &event);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_thread = boost::thread(boost::bind(&ReactorLoop::run, this));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::~ReactorLoop
+
+  *-----------------------------------------------------------------------------*/
+
+ReactorLoop::~ReactorLoop()
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_stopping = true;
+  }
+
+  wake();
+  m_thread.join();
+
+  close(m_wake);
+  close(m_epoll);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::post
+
+  Runs task on the loop thread.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::post(const Task& task)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_tasks.push_back(task);
+  }
+
+  wake();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::schedule
+
+  Runs task on the loop thread once milliseconds have passed. Timers cannot
+  be cancelled; a task that may be overtaken by events should check, when
+  it runs, whether it still has anything to do.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::schedule(unsigned int milliseconds, const Task& task)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    Timer timer;
+    timer.due = now() + milliseconds;
+    timer.sequence = m_timerSequence++;
+    timer.task = task;
+    m_timers.push(timer);
+  }
+
+  wake();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::attach
+
+  Adds a non-blocking socket to the loop. Until it is detached, operations
+  may be submitted against it.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::attach(int fd, const Directions& directions)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_load++;
+  }
+
+  if (isLoopThread())
+    doAttach(fd, directions);
+  else
+    post(boost::bind(&ReactorLoop::doAttach, this, fd, directions));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::detach
+
+  Removes a socket from the loop. Operations still pending on it complete
+  with LIBSSH2_ERROR_SOCKET_DISCONNECT. The socket is not closed.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::detach(int fd)
+{
+  if (isLoopThread())
+    doDetach(fd);
+  else
+    post(boost::bind(&ReactorLoop::doDetach, this, fd));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::submit
+
+  Queues an operation against an attached socket. Steps must not submit,
+  attach or detach themselves; completions may do all three.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::submit(int fd, const Step& step, const Completion& done)
+{
+  if (isLoopThread())
+    doSubmit(fd, step, done);
+  else
+    post(boost::bind(&ReactorLoop::doSubmit, this, fd, step, done));
+}
+
+
+bool ReactorLoop::isLoopThread() const
+{
+  return boost::this_thread::get_id() == m_thread.get_id();
+}
+
+
+bool ReactorLoop::isBusy(int fd) const
+{
+  EndpointMap::const_iterator it = m_endpoints.find(fd);
+  return it != m_endpoints.end() && !it->second.operations.empty();
+}
+
+
+void ReactorLoop::kick(int fd)
+{
+  if (m_endpoints.count(fd))
+    m_ready.insert(fd);
+}
+
+
+size_t ReactorLoop::getLoad()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_load;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::run
+
+  The loop thread. Sockets are watched level-triggered, so a socket that is
+  still ready after a pass will be reported again.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::run()
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  for (;;)
+  {
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      if (m_stopping)
+        break;
+    }
+
+    int count = epoll_wait(m_epoll, events, MAX_EVENTS, nextTimeout());
+    if (count < 0 && errno != EINTR)
+      break;
+
+    for (int i = 0; i < count; i++)
+    {
+      if (events[i].data.fd == m_wake)
+      {
+        uint64_t value;
+        while (read(m_wake, &value, sizeof(value)) > 0)
+          ;
+      }
+      else
+        m_ready.insert(events[i].data.fd);
+    }
+
+    runTimers();
+    runTasks();
+    serviceReady();
+  }
+}
+
+
+uint64_t ReactorLoop::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// The epoll_wait timeout that wakes the loop for the earliest timer.
+int ReactorLoop::nextTimeout()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  if (m_timers.empty())
+    return -1;
+
+  uint64_t current = now();
+  uint64_t due = m_timers.top().due;
+
+  return due <= current ? 0 : (int) (due - current);
+}
+
+
+void ReactorLoop::runTimers()
+{
+  std::vector<Task> tasks;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    uint64_t current = now();
+    while (!m_timers.empty() && m_timers.top().due <= current)
+    {
+      tasks.push_back(m_timers.top().task);
+      m_timers.pop();
+    }
+  }
+
+  for (size_t i = 0; i < tasks.size(); i++)
+    tasks[i]();
+}
+
+
+void ReactorLoop::wake()
+{
+  uint64_t value = 1;
+  if (write(m_wake, &value, sizeof(value)) < 0)
+  {
+    // The counter is saturated, so the loop is already due to wake.
+  }
+}
+
+
+void ReactorLoop::runTasks()
+{
+  std::deque<Task> tasks;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    tasks.swap(m_tasks);
+  }
+
+  while (!tasks.empty())
+  {
+    tasks.front()();
+    tasks.pop_front();
+  }
+}
+
+
+void ReactorLoop::serviceReady()
+{
+  while (!m_ready.empty())
+  {
+    int fd = *m_ready.begin();
+    m_ready.erase(m_ready.begin());
+    service(fd);
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::service
+
+  Steps every operation pending on fd. libssh2 reads whatever arrives on the
+  socket on behalf of any request, so a step that finishes may have consumed
+  the data another one was waiting for. Hence whenever an operation
+  completes, the socket is serviced again, until a pass makes no progress;
+  only then is it handed back to epoll.
+
+  Completions are called after the pass, so that they are free to submit to
+  or detach this socket.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::service(int fd)
+{
+  EndpointMap::iterator it = m_endpoints.find(fd);
+  if (it == m_endpoints.end())
+    return;
+
+  std::vector<std::pair<Completion, int> > finished;
+  std::list<Operation>& operations = it->second.operations;
+
+  std::list<Operation>::iterator op = operations.begin();
+  while (op != operations.end())
+  {
+    int rc = op->step();
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+    {
+      op++;
+      continue;
+    }
+
+    finished.push_back(std::make_pair(op->done, rc));
+    op = operations.erase(op);
+  }
+
+  for (size_t i = 0; i < finished.size(); i++)
+    finished[i].first(finished[i].second);
+
+  if (!finished.empty())
+    m_ready.insert(fd);
+
+  else if ((it = m_endpoints.find(fd)) != m_endpoints.end())
+    watch(fd, it->second);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  ReactorLoop::watch
+
+  Sets the epoll interest for fd to the direction its operations are blocked
+  on. Sockets without pending operations, or whose operations are blocked
+  elsewhere, are not watched at all: they are taken out of the epoll set
+  rather than left in it with no events, since epoll reports a hangup or
+  error whatever the mask, and an idle pooled session whose host has gone
+  would otherwise wake the loop on every pass. The next operation submitted
+  finds the hangup itself.
+
+  *-----------------------------------------------------------------------------*/
+
+void ReactorLoop::watch(int fd, Endpoint& endpoint)
+{
+  uint32_t events = 0;
+
+  if (!endpoint.operations.empty())
+  {
+    int directions = endpoint.directions ? endpoint.directions() : 0;
+
+    if (directions & LIBSSH2_SESSION_BLOCK_INBOUND)
+      events |= EPOLLIN;
+
+    if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+      events |= EPOLLOUT;
+
+    if (!events && !(directions & BLOCK_ELSEWHERE))
+      events = EPOLLIN;
+  }
+
+  if (events == endpoint.events)
+    return;
+
+  if (!events)
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+
+  else
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    epoll_ctl(m_epoll, endpoint.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+  }
+
+  endpoint.events = events;
+}
+
+
+void ReactorLoop::doAttach(int fd, const Directions& directions)
+{
+  // Not in the epoll set until an operation waits on it; see watch.
+  Endpoint& endpoint = m_endpoints[fd];
+  endpoint.directions = directions;
+  endpoint.events = 0;
+}
+
+
+void ReactorLoop::doDetach(int fd)
+{
+  EndpointMap::iterator it = m_endpoints.find(fd);
+  if (it == m_endpoints.end())
+    return;
+
+  std::list<Operation> abandoned;
+  abandoned.swap(it->second.operations);
+
+  if (it->second.events)
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+
+  m_endpoints.erase(it);
+  m_ready.erase(fd);
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_load--;
+  }
+
+  for (std::list<Operation>::iterator op = abandoned.begin(); op != abandoned.end(); op++)
+    op->done(LIBSSH2_ERROR_SOCKET_DISCONNECT);
+}
+
+
+void ReactorLoop::doSubmit(int fd, const Step& step, const Completion& done)
+{
+  EndpointMap::iterator it = m_endpoints.find(fd);
+  if (it == m_endpoints.end())
+  {
+    done(LIBSSH2_ERROR_SOCKET_DISCONNECT);
+    return;
+  }
+
+  Operation operation;
+  operation.step = step;
+  operation.done = done;
+  it->second.operations.push_back(operation);
+
+  m_ready.insert(fd);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Reactor::instance
+
+  One loop per core; sessions are spread over them as they are created and
+  stay on the loop they were given.
+
+  *-----------------------------------------------------------------------------*/
+
+Reactor& Reactor::instance()
+{
+  static Reactor reactor;
+  return reactor;
+}
+
+
+Reactor::Reactor()
+  : m_next(0)
+{
+  unsigned int count = boost::thread::hardware_concurrency();
+  if (count == 0)
+    count = 1;
+
+  for (unsigned int i = 0; i < count; i++)
+    m_loops.push_back(boost::shared_ptr<ReactorLoop>(new ReactorLoop()));
+}
+
+
+ReactorLoop *Reactor::assign()
+{
+  ReactorLoop *best = m_loops[0].get();
+  size_t best_load = best->getLoad();
+
+  for (size_t i = 1; i < m_loops.size(); i++)
+  {
+    size_t load = m_loops[i]->getLoad();
+    if (load < best_load)
+    {
+      best = m_loops[i].get();
+      best_load = load;
+    }
+  }
+
+  return best;
+}
+
+
+ReactorLoop *Reactor::any()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_loops[m_next++ % m_loops.size()].get();
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,191 @@
+/******************************************************************************
+
+  Reactor.h
+
+  Reactor drives every SSH session in the process without blocking. It owns
+  one ReactorLoop per core; each loop is a thread waiting on an epoll set and
+  owns a subset of the sessions. All libssh2 calls on a session are made from
+  its loop's thread, which is also what keeps sessions shared through the
+  SessionPool safe: libssh2 must never see two threads in one session.
+
+  Work is submitted to a loop as a step and a completion. The step makes as
+  much progress as it can and returns LIBSSH2_ERROR_EAGAIN if it would block;
+  the loop calls it again when its socket is ready in the direction libssh2
+  is waiting on. When the step returns anything else the completion is called
+  with that value, still on the loop thread. Loops also run tasks posted to
+  them, immediately or after a delay.
+
+  This is written against Linux epoll and eventfd.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Reactor
+#define H_Reactor
+
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <queue>
+#include <set>
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+
+class ReactorLoop
+{
+ public:
+  typedef boost::function<int ()> Step;
+  typedef boost::function<void (int)> Completion;
+  typedef boost::function<void ()> Task;
+
+  // Reports which way an endpoint is blocked, as a mask of
+  // LIBSSH2_SESSION_BLOCK_INBOUND and LIBSSH2_SESSION_BLOCK_OUTBOUND; or
+  // BLOCK_ELSEWHERE if its operations are waiting on something other than
+  // the socket, in which case the socket is not watched until it is kicked.
+  typedef boost::function<int ()> Directions;
+
+  enum { BLOCK_ELSEWHERE = 0x100 };
+
+  ReactorLoop();
+  ~ReactorLoop();
+
+  // Each of these may be called from any thread. When called from another
+  // thread they are queued and run on the loop thread in the order given.
+
+  void post(const Task& task);
+  void schedule(unsigned int milliseconds, const Task& task);
+  void attach(int fd, const Directions& directions);
+  void detach(int fd);
+  void submit(int fd, const Step& step, const Completion& done);
+
+  bool isLoopThread() const;
+
+  // Whether fd has operations pending. Only call from the loop thread.
+  bool isBusy(int fd) const;
+
+  // Steps fd's operations again in this pass, whether or not the socket is
+  // ready; for an endpoint whose operations wait on another's. Only call
+  // from the loop thread; steps may call it.
+  void kick(int fd);
+
+  // The number of endpoints attached; used to spread sessions over loops.
+  size_t getLoad();
+
+  // Milliseconds on a monotonic clock; the time base of schedule.
+  static uint64_t now();
+
+ private:
+  struct Operation
+  {
+    Step step;
+    Completion done;
+  };
+
+  struct Endpoint
+  {
+    Directions directions;
+    std::list<Operation> operations;
+    uint32_t events; // its interest in the epoll set; 0 if not in it
+  };
+
+  typedef std::map<int, Endpoint> EndpointMap;
+
+  struct Timer
+  {
+    uint64_t due;
+    uint64_t sequence;
+    Task task;
+
+    bool operator>(const Timer& other) const
+    {
+      return due > other.due || (due == other.due && sequence > other.sequence);
+    }
+  };
+
+  typedef std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > TimerQueue;
+
+  void run();
+  void wake();
+  int nextTimeout();
+  void runTimers();
+  void runTasks();
+  void serviceReady();
+  void service(int fd);
+  void watch(int fd, Endpoint& endpoint);
+
+  void doAttach(int fd, const Directions& directions);
+  void doDetach(int fd);
+  void doSubmit(int fd, const Step& step, const Completion& done);
+
+  int m_epoll;
+  int m_wake;
+
+  boost::mutex m_mutex;
+  std::deque<Task> m_tasks;
+  TimerQueue m_timers;
+  uint64_t m_timerSequence;
+  size_t m_load;
+  bool m_stopping;
+
+  // Only touched from the loop thread.
+  EndpointMap m_endpoints;
+  std::set<int> m_ready;
+
+  boost::thread m_thread;
+};
+
+
+class Reactor
+{
+ public:
+  static Reactor& instance();
+
+  // Picks the least loaded loop for a new session.
+  ReactorLoop *assign();
+
+  // A loop for work that is not tied to a session.
+  ReactorLoop *any();
+
+ private:
+  Reactor();
+
+  std::vector<boost::shared_ptr<ReactorLoop> > m_loops;
+  boost::mutex m_mutex;
+  size_t m_next;
+};
+
+#endif // H_Reactor
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
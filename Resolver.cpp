@@ -0,0 +1,199 @@
+/******************************************************************************
+
+  Resolver.cpp
+
+  Resolver looks up host names off the calling thread and caches the results
+  for the whole process.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstring>
+#include <sstream>
+
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "Resolver.h"
+
+
+#define DEFAULT_POSITIVE_TTL 300
+#define DEFAULT_NEGATIVE_TTL 10
+
+
+/*-----------------------------------------------------------------------------*
+
+  Resolver::instance
+
+  *-----------------------------------------------------------------------------*/
+
+Resolver& Resolver::instance()
+{
+  static Resolver resolver;
+  return resolver;
+}
+
+
+Resolver::Resolver()
+  : m_positiveTTL(DEFAULT_POSITIVE_TTL),
+    m_negativeTTL(DEFAULT_NEGATIVE_TTL)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Resolver::resolve
+
+  Answers from the cache when it can. Otherwise the caller waits on the
+  lookup for the name, starting one on its own thread if none is running.
+  Expired entries are dropped here, so the cache holds no more than the
+  names in recent use.
+
+  *-----------------------------------------------------------------------------*/
+
+void Resolver::resolve(const std::string& hostName,
+                       unsigned int port,
+                       ReactorLoop *loop,
+                       const Callback& done)
+{
+  std::stringstream service;
+  service << port;
+
+  std::string key(hostName);
+  key.append(":");
+  key.append(service.str());
+
+  Waiter waiter;
+  waiter.loop = loop;
+  waiter.done = done;
+
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  time_t now = time(NULL);
+  for (EntryMap::iterator it = m_entries.begin(); it != m_entries.end(); )
+    if (!it->second.resolving && it->second.expires <= now)
+      m_entries.erase(it++);
+    else
+      it++;
+
+  EntryMap::iterator it = m_entries.find(key);
+  if (it != m_entries.end())
+  {
+    Entry& entry = it->second;
+    if (entry.resolving)
+      entry.waiters.push_back(waiter);
+    else
+      loop->post(boost::bind(done, entry.result, entry.addresses));
+
+    return;
+  }
+
+  Entry& entry = m_entries[key];
+  entry.resolving = true;
+  entry.result = 0;
+  entry.expires = 0;
+  entry.waiters.push_back(waiter);
+
+  boost::thread(boost::bind(&Resolver::lookup, this, key, hostName, service.str())).detach();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Resolver::lookup
+
+  Runs on a thread of its own, since getaddrinfo blocks.
+
+  *-----------------------------------------------------------------------------*/
+
+void Resolver::lookup(const std::string& key, const std::string& hostName, const std::string& port)
+{
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = 0;
+  hints.ai_protocol = 0;          /* Any protocol */
+
+  struct addrinfo *result = NULL;
+  int rc = getaddrinfo(hostName.c_str(), port.c_str(), &hints, &result);
+
+  AddressList addresses;
+  if (rc == 0)
+    addresses = AddressList(result, freeaddrinfo);
+
+  std::vector<Waiter> waiters;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    Entry& entry = m_entries[key];
+    entry.resolving = false;
+    entry.result = rc;
+    entry.addresses = addresses;
+    entry.expires = time(NULL) + (rc == 0 ? m_positiveTTL : m_negativeTTL);
+    entry.waiters.swap(waiters);
+  }
+
+  for (size_t i = 0; i < waiters.size(); i++)
+    waiters[i].loop->post(boost::bind(waiters[i].done, rc, addresses));
+}
+
+
+unsigned int Resolver::getPositiveTTL()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_positiveTTL;
+}
+
+
+void Resolver::setPositiveTTL(unsigned int seconds)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_positiveTTL = seconds;
+}
+
+
+unsigned int Resolver::getNegativeTTL()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_negativeTTL;
+}
+
+
+void Resolver::setNegativeTTL(unsigned int seconds)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_negativeTTL = seconds;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,113 @@
+/******************************************************************************
+
+  Resolver.h
+
+  Resolver looks up host names off the calling thread and caches the results
+  for the whole process, so the connections a page opens to one host resolve
+  it once between them. A lookup already in progress is shared by everyone
+  who asks for the same name meanwhile. Failures are cached too, for a
+  shorter time, so a page retrying a bad name does not hammer the resolver.
+
+  getaddrinfo does not report the records' TTLs, so entries live for a fixed,
+  configurable time instead.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Resolver
+#define H_Resolver
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Reactor.h"
+
+
+class Resolver
+{
+ public:
+  // A getaddrinfo result, freed when the last holder lets go of it.
+  typedef boost::shared_ptr<struct addrinfo> AddressList;
+
+  // Called with 0 and the addresses, or with a getaddrinfo error code.
+  typedef boost::function<void (int, AddressList)> Callback;
+
+  static Resolver& instance();
+
+  // Resolves hostName for a TCP connection to port. done is always called
+  // on loop, even when the answer is cached.
+  void resolve(const std::string& hostName,
+               unsigned int port,
+               ReactorLoop *loop,
+               const Callback& done);
+
+  // Seconds that successful and failed lookups are kept.
+  unsigned int getPositiveTTL();
+  void setPositiveTTL(unsigned int seconds);
+  unsigned int getNegativeTTL();
+  void setNegativeTTL(unsigned int seconds);
+
+ private:
+  Resolver();
+
+  struct Waiter
+  {
+    ReactorLoop *loop;
+    Callback done;
+  };
+
+  struct Entry
+  {
+    bool resolving;
+    int result;
+    AddressList addresses;
+    time_t expires;
+    std::vector<Waiter> waiters;
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  void lookup(const std::string& key, const std::string& hostName, const std::string& port);
+
+  boost::mutex m_mutex;
+  EntryMap m_entries;
+  unsigned int m_positiveTTL;
+  unsigned int m_negativeTTL;
+};
+
+#endif // H_Resolver
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
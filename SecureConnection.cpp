@@ -32,11 +32,13 @@
  ******************************************************************************/
 
 
-#define DIR_BUFFER_SIZE 1024
-#define FILE_BUFFER_SIZE 4096
 #define CONFIG_DIR ".jshs/config"
 
+// Milliseconds between checks of the granted services' policies.
+#define POLICY_CHECK_INTERVAL 10000
+
 #include <cstdio>
+#include <set>
 #include <string>
 
 #include <libssh2.h>
@@ -53,13 +55,14 @@
 #endif
 */
 #include <netdb.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <boost/bind.hpp>
 #include <boost/functional.hpp>
-#include <boost/thread.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/options_description.hpp>
 
@@ -68,12 +71,19 @@
 #include "JSExceptions.h"
 
 
+#include "Admission.h"
+#include "CredentialCache.h"
 #include "HostServices.h"
+#include "KeyAuthentication.h"
+#include "KnownHosts.h"
+#include "PolicyCache.h"
+#include "Reactor.h"
+#include "Resolver.h"
 #include "SecureConnection.h"
 #include "Service.h"
-
-// TODO -- registration of components, then remove this
-#include "FileService.h"
+#include "ServiceRegistry.h"
+#include "SftpOperations.h"
+#include "WarmUp.h"
 
 /*****************************************************************************
 
@@ -83,6 +93,23 @@
       writeonly attribute DOMString password;
       readonly attribute DOMString host;
       readonly attribute unsigned short port;
+      readonly attribute DOMString remoteAddress;
+      readonly attribute unsigned long roundTripTime; // milliseconds; 0 if unknown
+      readonly attribute boolean compressed;
+      readonly attribute boolean multiplexed; // through an OpenSSH ControlMaster
+               attribute DOMString jumpHost; // [user@]host[:port], or ""
+               attribute DOMString compression; // "auto", "on" or "off"
+
+      // "auto", "bulk", "interactive" or "compat"
+               attribute DOMString algorithmProfile;
+      readonly attribute object algorithms; // kex, hostkey, cipher, mac, compression
+
+      // "accept-new" or "reject"
+               attribute DOMString unknownHostPolicy;
+
+      // milliseconds
+               attribute unsigned long connectTimeout;
+               attribute unsigned long attemptTimeout;
 
       // ready state
       const unsigned short NEW = 0;
@@ -120,14 +147,55 @@ SecureConnection::SecureConnection(HostServicesPtr hs,
     m_user(user),
     m_hostName(hostName),
     m_port(port),
+    m_bootstrapError(0),
+    m_watchingPolicies(false),
     m_readyState(SecureConnection::NEW),
-    m_sock(-1),
-    m_session(NULL),
-    m_sftp(NULL)
+    m_loop(NULL),
+    m_connectTimeout(DEFAULT_CONNECT_TIMEOUT),
+    m_attemptTimeout(DEFAULT_ATTEMPT_TIMEOUT),
+    m_compression(CompressionPolicy::COMPRESSION_AUTO),
+    m_algorithmProfile("auto"),
+    m_unknownHostPolicy("accept-new"),
+    m_bastion(false),
+    m_admitted(false),
+    m_reused(false),
+    m_reconnecting(false),
+    m_sessionStarted(false),
+    m_haveCredentials(false),
+    m_credentialsRequested(false)
 {
   registerProperty("user", make_property(this, &SecureConnection::get_user));
   registerProperty("hostName", make_property(this, &SecureConnection::get_hostName));
   registerProperty("port", make_property(this, &SecureConnection::get_port));
+  registerProperty("remoteAddress", make_property(this, &SecureConnection::get_remoteAddress));
+  registerProperty("roundTripTime", make_property(this, &SecureConnection::get_roundTripTime));
+  registerProperty("compressed", make_property(this, &SecureConnection::get_compressed));
+  registerProperty("multiplexed", make_property(this, &SecureConnection::get_multiplexed));
+
+  registerProperty("jumpHost", make_property(this,
+                                             &SecureConnection::get_jumpHost,
+                                             &SecureConnection::set_jumpHost));
+
+  registerProperty("compression", make_property(this,
+                                                &SecureConnection::get_compression,
+                                                &SecureConnection::set_compression));
+
+  registerProperty("unknownHostPolicy", make_property(this,
+                                                      &SecureConnection::get_unknownHostPolicy,
+                                                      &SecureConnection::set_unknownHostPolicy));
+
+  registerProperty("algorithms", make_property(this, &SecureConnection::get_algorithms));
+  registerProperty("algorithmProfile", make_property(this,
+                                                     &SecureConnection::get_algorithmProfile,
+                                                     &SecureConnection::set_algorithmProfile));
+
+  registerProperty("connectTimeout", make_property(this,
+                                                   &SecureConnection::get_connectTimeout,
+                                                   &SecureConnection::set_connectTimeout));
+
+  registerProperty("attemptTimeout", make_property(this,
+                                                   &SecureConnection::get_attemptTimeout,
+                                                   &SecureConnection::set_attemptTimeout));
 
   registerAttribute("NEW",        static_cast<int>(NEW),        true);
   registerAttribute("CONNECTING", static_cast<int>(CONNECTING), true);
@@ -165,7 +233,7 @@ SecureConnection::SecureConnection(HostServicesPtr hs,
   registerMethod("requestServiceByScheme", make_method(this, &SecureConnection::requestServiceByScheme));
   registerMethod("releaseService", make_method(this, &SecureConnection::releaseService));
 
-  registerMethod("close", make_method(this, &SecureConnection::closeConnection));
+  registerMethod("close", make_method(this, &SecureConnection::scheduleClose));
 
   registerEvent("onreadystatechange");
   registerEvent("onrequest");
@@ -184,7 +252,25 @@ SecureConnection::~SecureConnection()
 
 LIBSSH2_SESSION *SecureConnection::getSession() const
 {
-  return m_session;
+  return m_pooled ? m_pooled->getSession() : NULL;
+}
+
+
+PooledSessionPtr SecureConnection::getPooledSession() const
+{
+  return m_pooled;
+}
+
+
+MuxSftpPtr SecureConnection::getMuxSftp() const
+{
+  return m_mux;
+}
+
+
+SftpChannelPoolPtr SecureConnection::getSftpChannels() const
+{
+  return m_channels;
 }
 
 
@@ -218,6 +304,131 @@ unsigned int SecureConnection::get_port() const
 }
 
 
+unsigned int SecureConnection::get_connectTimeout() const
+{
+  return m_connectTimeout;
+}
+
+
+void SecureConnection::set_connectTimeout(unsigned int milliseconds)
+{
+  m_connectTimeout = milliseconds;
+}
+
+
+unsigned int SecureConnection::get_attemptTimeout() const
+{
+  return m_attemptTimeout;
+}
+
+
+void SecureConnection::set_attemptTimeout(unsigned int milliseconds)
+{
+  m_attemptTimeout = milliseconds;
+}
+
+
+std::string SecureConnection::get_remoteAddress() const
+{
+  return m_pooled ? m_pooled->getRemoteAddress() : "";
+}
+
+
+std::string SecureConnection::get_compression() const
+{
+  return CompressionPolicy::modeName(m_compression);
+}
+
+
+void SecureConnection::set_compression(const std::string& mode)
+{
+  if (!CompressionPolicy::parseMode(mode, m_compression))
+    throw FB::script_error("Unknown compression mode.");
+}
+
+
+bool SecureConnection::get_compressed() const
+{
+  return m_pooled && m_pooled->isCompressed();
+}
+
+
+std::string SecureConnection::get_unknownHostPolicy() const
+{
+  return m_unknownHostPolicy;
+}
+
+
+void SecureConnection::set_unknownHostPolicy(const std::string& policy)
+{
+  if (policy != "accept-new" && policy != "reject")
+    throw FB::script_error("Unknown host policy must be \"accept-new\" or \"reject\".");
+
+  m_unknownHostPolicy = policy;
+}
+
+
+std::string SecureConnection::get_algorithmProfile() const
+{
+  return m_algorithmProfile;
+}
+
+
+void SecureConnection::set_algorithmProfile(const std::string& profile)
+{
+  if (!AlgorithmProfile::isProfile(profile))
+    throw FB::script_error("Unknown algorithm profile.");
+
+  m_algorithmProfile = profile;
+}
+
+
+FB::VariantMap SecureConnection::get_algorithms() const
+{
+  FB::VariantMap algorithms;
+
+  if (m_pooled)
+  {
+    const PooledSession::Algorithms& negotiated = m_pooled->getAlgorithms();
+    for (PooledSession::Algorithms::const_iterator it = negotiated.begin(); it != negotiated.end(); it++)
+      algorithms[it->first] = it->second;
+  }
+
+  return algorithms;
+}
+
+
+unsigned int SecureConnection::get_roundTripTime() const
+{
+  return m_pooled ? m_pooled->getRoundTripTime() : 0;
+}
+
+
+bool SecureConnection::get_multiplexed() const
+{
+  return m_mux.get() != NULL;
+}
+
+
+std::string SecureConnection::get_jumpHost() const
+{
+  return m_jumpHost;
+}
+
+
+void SecureConnection::set_jumpHost(const std::string& jumpHost)
+{
+  std::string user;
+  std::string hostName;
+  unsigned int port;
+
+  if (!jumpHost.empty() && !JumpHost::parse(jumpHost, m_user, user, hostName, port))
+    throw FB::script_error("Jump host must be given as [user@]host[:port].");
+
+  m_jumpHost = jumpHost;
+}
+
+
 int SecureConnection::get_readyState() const
 {
   return m_readyState;
@@ -280,8 +491,14 @@ FB::VariantList SecureConnection::get_serviceSchemes() const
 
 FB::VariantList SecureConnection::get_services() const
 {
-  
-  return FB::make_variant_list(m_services);
+  return FB::make_variant_list(getServices());
+}
+
+
+std::vector<ServicePtr> SecureConnection::getServices() const
+{
+  boost::mutex::scoped_lock lock(m_servicesMutex);
+  return m_services;
 }
 
 
@@ -293,413 +510,1484 @@ std::string SecureConnection::description()
 }
 
 
-void SecureConnection::open()
+const std::string& SecureConnection::getHomeDirectory() const
 {
-  if (m_readyState != NEW && m_readyState != CLOSED) 
-    reportError(FB::script_error("SecureConnection is already open."));
+  return m_home;
+}
 
-  else if (!isOriginAllowed())
-    reportError(FB::script_error("Host access would violate same origin policy."));
 
-  else
-    m_hs.lock()->plugin()->requestCredentials(shared_ptr());
+SecureConnectionPtr SecureConnection::self()
+{
+  return FB::ptr_cast<SecureConnection>(shared_from_this());
 }
 
 
-void SecureConnection::credentialsRequestFilled(const std::string& password)
+ReactorLoop *SecureConnection::getLoop() const
 {
-  m_password = password;
-  boost::thread(boost::bind(&SecureConnection::completeOpen, ref(this)));
+  boost::mutex::scoped_lock lock(m_loopMutex);
+  return m_loop;
 }
 
 
-void SecureConnection::credentialsRequestDenied()
+void SecureConnection::setLoop(ReactorLoop *loop)
 {
-  reportError(FB::script_error("Authorization request canceled."));
+  boost::mutex::scoped_lock lock(m_loopMutex);
+  m_loop = loop;
 }
 
 
-void SecureConnection::completeOpen()
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::postToLoop
+
+  Runs task on the connection's loop. A connection that has moved to
+  another loop by the time the task runs -- to a session another
+  connection replaced, say -- is followed there.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::postToLoop(const ReactorLoop::Task& task)
 {
-  try 
-  {
-    setReadyState(CONNECTING);
+  getLoop()->post(boost::bind(&SecureConnection::runOnLoop, self(), task));
+}
 
-    createSocket();
-    startSession();
-    authenticate();
-    getServiceSchemes();
 
-    setReadyState(OPEN);
+void SecureConnection::runOnLoop(const ReactorLoop::Task& task)
+{
+  if (!getLoop()->isLoopThread())
+  {
+    postToLoop(task);
+    return;
   }
-  catch (FB::script_error e)
+
+  task();
+}
+
+
+void SecureConnection::open()
+{
+  if (m_readyState != NEW && m_readyState != CLOSED) 
+    reportError(FB::script_error("SecureConnection is already open."));
+
+  else if (!isOriginAllowed())
+    reportError(FB::script_error("Host access would violate same origin policy."));
+
+  // An authenticated session to the same account is already pooled, so
+  // there is no need to ask for credentials.
+  else if (mayReuseSession(SessionPool::makeKey(m_user, m_hostName, m_port))
+           && (m_pooled = SessionPool::instance().acquire(SessionPool::makeKey(m_user, m_hostName, m_port))))
   {
-    closeConnection();
-    reportError(e);
+    m_reused = true;
+    setLoop(m_pooled->getLoop());
+    m_loop->post(boost::bind(&SecureConnection::completeOpen, self()));
   }
+
+  else
+    openThroughControlMaster();
 }
 
 
-bool predicate(const std::string& s1, const std::string& s2)
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::openThroughControlMaster
+
+  If the user keeps an OpenSSH ControlMaster connection to the account, the
+  SFTP subsystem is opened through it, with no connect, handshake or
+  authentication of our own, and no prompt. Otherwise, or if the master
+  will not open it, it is opened through the session broker, if one is
+  running; see openThroughBroker.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::openThroughControlMaster()
 {
-  return !s1.compare(s2);
+  setLoop(Reactor::instance().assign());
+  setReadyState(CONNECTING);
+
+  ControlMaster::instance().find(m_user, m_hostName, m_port, m_loop,
+                                 boost::bind(&SecureConnection::controlMasterFound, self(), _1));
 }
 
 
-void SecureConnection::requestServiceByScheme(const std::string& scheme)
+void SecureConnection::controlMasterFound(const std::string& path)
 {
-  if (m_readyState != OPEN)
-    throw FB::script_error("Connection is not open.");
+  if (!isOpening())
+    return;
 
-  LIBSSH2_SFTP_HANDLE *config = NULL;
-  std::stringstream config_text;
+  if (path.empty())
+  {
+    openThroughBroker();
+    return;
+  }
 
-  try {
-    if (m_serviceSchemes.size() == 0)
-      getServiceSchemes();
+  MuxRequestPtr request = boost::make_shared<MuxRequest>(path, "sftp", true, m_loop);
+  request->start(boost::bind(&SecureConnection::controlMasterOpened, self(), request, _1));
+}
 
-    if (m_serviceSchemes.end() == std::find_if(m_serviceSchemes.begin(),
-					       m_serviceSchemes.end(),
-					       boost::bind(predicate, scheme, _1)))
-      throw FB::script_error("Service not available.");
 
-    std::string filename(CONFIG_DIR);
-    filename.append("/");
-    filename.append(scheme);
+void SecureConnection::controlMasterOpened(MuxRequestPtr request, int rc)
+{
+  if (!isOpening())
+    return;
 
-    if (!(config = libssh2_sftp_open(m_sftp, filename.c_str(), LIBSSH2_FXF_READ, 0)))
-      throw FB::script_error("Unable to open service policy.");
+  if (rc)
+    openThroughBroker();
 
-    char buffer[FILE_BUFFER_SIZE];
-    int rc;
-    while ((rc = libssh2_sftp_read(config, buffer, sizeof(buffer)-1)) > 0)
-    {
-      buffer[rc] = 0;
-      config_text << buffer;
-    }
+  else
+    startMuxSftp(request);
+}
 
-    if (rc < 0)
-      throw FB::script_error("Unable to read service policy.");
 
-    libssh2_sftp_close(config);
-    config = NULL;
+/*-----------------------------------------------------------------------------*
 
-    // TODO scheme->constructor registry
-    grantService(FileService::create(FB::ptr_cast<SecureConnection>(shared_from_this()),
-				     scheme, config_text.str()));
-  }
-  catch (FB::script_error e) 
+  SecureConnection::openThroughBroker
+
+  The broker (see broker/Broker.h) is a process of the user's that outlives
+  pages and tabs. It keeps the sessions it opens, so one opened for an
+  earlier page is ready for this one, and the SSH work for them is done in
+  its process rather than the browser's. It only authenticates with keys,
+  and only connects directly; an account it cannot open, or no broker
+  running, and the session is opened here; see openDirect.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::openThroughBroker()
+{
+  if (!m_jumpHost.empty())
   {
-    if (config)
-      libssh2_sftp_close(config);
-    reportError(e);
+    openDirect();
+    return;
   }
+
+  std::vector<std::string> environment;
+  environment.push_back(ControlMaster::makeBrokerAccount(SessionPool::makeKey(m_user, m_hostName, m_port)));
+
+  MuxRequestPtr request = boost::make_shared<MuxRequest>(ControlMaster::getBrokerPath(), "sftp", true,
+                                                         m_loop, environment);
+  request->start(boost::bind(&SecureConnection::brokerOpened, self(), request, _1));
 }
 
 
-void SecureConnection::grantService(ServicePtr service)
+void SecureConnection::brokerOpened(MuxRequestPtr request, int rc)
 {
-  m_services.push_back(service);
-  FireEvent("ongrant", FB::variant_list_of(shared_from_this())(service));
+  if (!isOpening())
+    return;
+
+  if (rc)
+    openDirect();
+
+  else
+    startMuxSftp(request);
 }
 
 
-void SecureConnection::releaseService(ServicePtr service)
+void SecureConnection::startMuxSftp(MuxRequestPtr request)
 {
-  // check that services is in m_services, remove
-  service->revoke();
+  m_mux = boost::make_shared<MuxSftp>(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                      request->releaseControl(),
+                                      request->releaseStream(),
+                                      m_loop);
+
+  m_mux->submit(boost::bind(&MuxSftp::init, m_mux),
+                boost::bind(&SecureConnection::sftpChannelOpened, self(), _1));
 }
 
 
-void SecureConnection::revokeAllServices()
+void SecureConnection::openDirect()
 {
-  while (m_services.size() > 0) {
-    m_services.back()->revoke();
-    m_services.pop_back();
-  }
+  if (m_reconnecting)
+    reopenSession();
+
+  else
+    startOpen();
 }
 
 
-void SecureConnection::closeConnection()
-{
-  setReadyState(CLOSING);
-  
-  revokeAllServices();
+/*-----------------------------------------------------------------------------*
 
-  if (m_sftp)
-  {
-    libssh2_sftp_shutdown(m_sftp);
-    m_sftp = NULL;
-  }
+  SecureConnection::startOpen
 
-  if (m_session)
-  {
-    libssh2_session_disconnect(m_session, "Finished.");
-    libssh2_session_free(m_session);
-    m_session = NULL;
-  }
+  Opens a new session. Resolving, connecting and the SSH handshake do not
+  need the password, so they start right away and run while the user is
+  being asked for it. Whichever of the two finishes last -- the handshake in
+  sessionStarted or the prompt in credentialsReceived -- starts
+  authentication. Accounts not known to need a password are not prompted
+  for one until key authentication has failed; see keysAuthenticated.
 
-  if (m_sock != -1)
-  {
-#ifdef WIN32
-    closesocket(m_sock);
-#else
-    close(m_sock);
-#endif
-    m_sock = -1;
-  }
+  *-----------------------------------------------------------------------------*/
 
-  setReadyState(CLOSED);
+void SecureConnection::startOpen()
+{
+  m_reused = false;
+  m_sessionStarted = false;
+  m_haveCredentials = false;
+  m_password = "";
+
+  // Accounts known to need a password are asked for it while connecting;
+  // the rest try keys first, and are asked only if the keys are refused.
+  m_credentialsRequested = KeyAuthentication::rememberedMethod(SessionPool::makeKey(m_user, m_hostName, m_port))
+                           == KeyAuthentication::METHOD_PASSWORD;
+
+  setLoop(Reactor::instance().assign());
+  m_loop->post(boost::bind(&SecureConnection::completeOpen, self()));
+
+  if (m_credentialsRequested)
+    m_hs.lock()->plugin()->requestCredentials(shared_ptr());
 }
 
 
-void SecureConnection::setReadyState(SecureConnection::ReadyState state)
+void SecureConnection::credentialsRequestFilled(const std::string& password)
 {
-  if (m_readyState != state)
-  {
-    m_readyState = state;
-    FireEvent("onreadystatechange", FB::variant_list_of(shared_from_this())(m_readyState));
-  }
+  postToLoop(boost::bind(&SecureConnection::credentialsReceived, self(), password));
 }
 
 
-void SecureConnection::reportError(const FB::script_error& e) 
+void SecureConnection::credentialsRequestDenied()
 {
-  FireEvent("onerror", FB::variant_list_of(shared_from_this())(e.what()));
+  reportError(FB::script_error("Authorization request canceled."));
+  postToLoop(boost::bind(&SecureConnection::closeConnection, self()));
 }
 
 
-bool SecureConnection::isOriginAllowed()
+void SecureConnection::credentialsReceived(const std::string& password)
 {
-  // TODO implement same-origin policy for hostName
-  // use either window.location.origin, or read the permissions
-  // from the manifest for an app.
-  return true;
+  // The open may have failed while the user was typing.
+  if (m_readyState != CONNECTING || m_haveCredentials)
+    return;
+
+  m_password = password;
+  m_haveCredentials = true;
+
+  if (m_sessionStarted)
+    authenticate();
 }
 
-void SecureConnection::createSocket()
-{
-  struct addrinfo hints;
-  struct addrinfo *result, *p;
 
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-  hints.ai_socktype = SOCK_STREAM; 
-  hints.ai_flags = 0;
-  hints.ai_protocol = 0;          /* Any protocol */
+/*-----------------------------------------------------------------------------*
 
-  std::stringstream port;
-  port << m_port;
-  
-  int rc;
-  if ((rc = getaddrinfo(m_hostName.c_str(), port.str().c_str(), &hints, &result)) != 0)
-  {
-    std::stringstream msg;
-    msg << "Cannot resolve remote host: " << gai_strerror(rc);
+  SecureConnection::completeOpen
 
-    throw FB::script_error(msg.str());
-  }
+  Runs on the connection's reactor loop. Opening is a chain of non-blocking
+  operations -- connect, startup, authenticate, SFTP init, read the service
+  schemes -- each submitted from the completion of the one before. A pooled
+  session starts the chain at the SFTP init. Any failure ends in failOpen.
 
-  for (p = result, m_sock = -1; p != NULL && m_sock == -1; p = p->ai_next)
-  {
-    if ((m_sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
-      continue;
+  *-----------------------------------------------------------------------------*/
 
-    if (connect(m_sock, p->ai_addr, p->ai_addrlen) != 0)
-    {
-      close(m_sock); 
-      m_sock = -1;
-      continue;
-    }
-  }
+void SecureConnection::completeOpen()
+{
+  setReadyState(CONNECTING);
 
-  if (m_sock == -1)
-    throw FB::script_error("Unable to connect to remote host.");
+  if (m_pooled)
+    openSftpChannel();
+
+  else
+    createSocket();
 }
 
 
-void SecureConnection::startSession()
-{
-  m_session = libssh2_session_init();
-  if (!m_session)
-    throw FB::script_error("Cannot initialize secure session.");
+/*-----------------------------------------------------------------------------*
 
-  int rc;
-  if ((rc = libssh2_session_startup(m_session, m_sock)))
-  { 
-    std::stringstream msg;
-    msg << "Cannot start session with host: return code: " << rc;
+  SecureConnection::failOpen
 
-    throw FB::script_error(msg.str());
-  }
+  rc is the libssh2 error the open failed with, 0 if there is none. A
+  borrowed session is shared with other connections, so it is only
+  discarded, and a new one opened in its place, if the link to the host is
+  gone; any other failure is this connection's own.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::failOpen(const FB::script_error& e)
+{
+  failOpen(e, 0);
 }
 
-  /*
-  enum HostCheckResult {
-    KNOWN_HOST_CHECK_FAILURE = 1,
-    UNKNOWN_HOST,
-    KNOWN_HOST_KEY_MISMATCH
-  };
-  */
-  //  void checkKnownHost(boost::optional<const FB::JSObjectPtr&> callbackAdviseUnknownHost);
-/*
-void SecureConnection::checkKnownHost(boost::optional<const FB::JSObjectPtr&> callbackAdviseUnknownHost)
+
+void SecureConnection::failOpen(const FB::script_error& e, int rc)
 {
-  // unable to open known hosts file at all, even with fopen.
-  // all attempts return EACCES, yet I can find no reason why this should be.
-  // So, for now, this is disabled.
-  return;
+  finishHandshake();
 
-  LIBSSH2_KNOWNHOSTS *hosts = libssh2_knownhost_init(m_session);
+  if (m_bastion)
+    JumpHost::instance().failed(SessionPool::makeKey(m_user, m_hostName, m_port), e.what());
 
-  if(!hosts)
-    throw FB::script_error("Unable to access known hosts list.");
+  bool lost = !m_reused || PooledSession::isLinkFailure(rc);
 
-  try
+  if (m_reconnecting)
   {
-    std::string hosts_file(getenv("HOME"));
-    hosts_file.append("/.ssh/known_hosts");
+    if (m_pooled && lost)
+      SessionPool::instance().discard(m_pooled);
 
-    int rc;
-    if (0 > (rc = libssh2_knownhost_readfile(hosts, hosts_file.c_str(), LIBSSH2_KNOWNHOST_FILE_OPENSSH)))
+    // Another connection's replacement session has failed too; try a new
+    // one of our own.
+    if (m_reused && lost)
     {
-      std::stringstream msg;
-      msg << "Unable to read known hosts file [" << hosts_file.c_str() << "]: " << rc;
-
-      throw FB::script_error(msg.str());
+      SessionPool::instance().release(m_pooled);
+      m_pooled.reset();
+      reopenSession();
     }
-      
-    size_t len;
-    int type;
-    const char *key = libssh2_session_hostkey(m_session, &len, &type);
-    if (!key) 
+    else
     {
-      libssh2_knownhost_free(hosts);
-      throw FB::script_error("Unable to obtain host key.");
+      closeConnection();
+      reportError(FB::script_error("Connection to remote host lost."));
     }
-    
-    int check = libssh2_knownhost_check(hosts, m_hostName.c_str(), key, len,
-					LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW,
-					NULL);
-
-    if (check != LIBSSH2_KNOWNHOST_CHECK_MATCH)
-    {
-      // TODO check policy to see that unknown hosts may be added.
-      HostCheckResult failure;
-      switch (check)
-      {
-      case LIBSSH2_KNOWNHOST_CHECK_FAILURE:
-	failure = KNOWN_HOST_CHECK_FAILURE;
-	break;
-
-      case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
-	failure = UNKNOWN_HOST;
-	break;
-
-      case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
-	failure = KNOWN_HOST_KEY_MISMATCH;
-	break;
-
-      default:
-	throw FB::script_error("Unknown failure mode in known host check.");
-      }
-
-      if (!callbackAdviseUnknownHost)
-	throw FB::script_error("Unknown host; not added to known hosts.");
-
-      FB::variant result = callbackAdviseUnknownHost.get()->Invoke("", FB::variant_list_of(failure));
-      if (!result.convert_cast<bool>())
-	throw FB::script_error("Unknown host; not added to known hosts.");
-      
-      int typemask = LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW;
-      
-      if (type == LIBSSH2_HOSTKEY_TYPE_RSA)
-	typemask |= LIBSSH2_KNOWNHOST_KEY_SSHRSA;
-
-      else if (type == LIBSSH2_HOSTKEY_TYPE_DSS)
-	typemask |= LIBSSH2_KNOWNHOST_KEY_SSHDSS;
-
-      struct libssh2_knownhost *store;
-      if ((rc = libssh2_knownhost_add(hosts, m_hostName.c_str(), 0, (char *)key, len,
-				      typemask, &store)))
-      {
-	std::stringstream msg;
-	msg << "Failed to add unknown host to known hosts: return code: " << rc;
-
-	throw FB::script_error(msg.str());
-      }
-      
-      if ((rc = libssh2_knownhost_writefile(hosts, hosts_file.c_str(), LIBSSH2_KNOWNHOST_FILE_OPENSSH)))
-      {
-	std::stringstream msg;
-	msg << "Failed to write updated known hosts file: return code: " << rc;
-
-	throw FB::script_error(msg.str());
-      }
+  }
+  else if (m_reused && lost)
+  {
+    // The pooled session has gone bad; make sure no one else gets it and
+    // fall back to opening a new one. The connection stays CONNECTING, so
+    // the page sees one open.
+    if (m_sftp)
+    {
+      m_sftp->setBroken();
+      m_sftp.reset();
+    }
+
+    m_channels.reset();
+
+    SessionPool::instance().discard(m_pooled);
+    SessionPool::instance().release(m_pooled);
+    m_pooled.reset();
+
+    startOpen();
+  }
+  else
+  {
+    // No point in the user finishing a prompt for a connection that failed.
+    m_hs.lock()->plugin()->cancelCredentialsRequest(shared_ptr());
+
+    if (m_pooled && !m_reused)
+      SessionPool::instance().discard(m_pooled);
+    closeConnection();
+    reportError(e);
+  }
+}
+
+
+// Whether the steps of opening a session are wanted; they are abandoned
+// once the connection is closed.
+bool SecureConnection::isOpening() const
+{
+  return m_readyState == CONNECTING || m_reconnecting;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::reconnect
+
+  Replaces a session whose connection has been lost, without the connection
+  leaving OPEN. Services call this from the loop when an operation fails
+  with a link failure; they are told through Service::reconnected once the
+  new session's SFTP channel is up, and can then reissue what was in flight.
+  If the connection cannot be re-established it is closed, which revokes
+  the services.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::reconnect()
+{
+  if (m_readyState != OPEN || m_reconnecting)
+    return;
+
+  m_reconnecting = true;
+
+  // The master may have been restarted, or it may be gone; in that case
+  // the session is opened directly.
+  if (m_mux)
+  {
+    m_mux.reset();
+    ControlMaster::instance().find(m_user, m_hostName, m_port, m_loop,
+                                   boost::bind(&SecureConnection::controlMasterFound, self(), _1));
+    return;
+  }
+
+  if (m_sftp)
+  {
+    m_sftp->setBroken();
+    m_sftp.reset();
+  }
+
+  m_channels.reset();
+
+  SessionPool::instance().discard(m_pooled);
+  SessionPool::instance().release(m_pooled);
+  m_pooled.reset();
+
+  reopenSession();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::reopenSession
+
+  Another connection to the same account may already have replaced the
+  lost session, in which case its replacement is borrowed. Otherwise a new
+  session is opened and authenticated with the password this connection
+  was opened with, or failing that one still in the CredentialCache, so
+  the user is not asked again. Pooled sessions do not keep passwords.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::reopenSession()
+{
+  if ((m_pooled = SessionPool::instance().acquire(SessionPool::makeKey(m_user, m_hostName, m_port))))
+  {
+    m_reused = true;
+    setLoop(m_pooled->getLoop());
+    m_loop->post(boost::bind(&SecureConnection::openSftpChannel, self()));
+    return;
+  }
+
+  std::string key = SessionPool::makeKey(m_user, m_hostName, m_port);
+
+  if (m_password.empty())
+    CredentialCache::instance().lookup(key, m_password);
+
+  if (!m_password.empty()
+      || KeyAuthentication::rememberedMethod(key) == KeyAuthentication::METHOD_PUBLICKEY)
+  {
+    m_reused = false;
+    m_sessionStarted = false;
+    m_haveCredentials = !m_password.empty();
+    m_credentialsRequested = false;
+    createSocket();
+  }
+  else
+  {
+    closeConnection();
+    reportError(FB::script_error("Connection to remote host lost."));
+  }
+}
+
+
+void SecureConnection::completeReconnect()
+{
+  m_reconnecting = false;
+
+  std::vector<ServicePtr> services = getServices();
+  for (size_t i = 0; i < services.size(); i++)
+    services[i]->reconnected();
+}
+
+
+bool predicate(const std::string& s1, const std::string& s2)
+{
+  return !s1.compare(s2);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::requestServiceByScheme
+
+  The connection's state, its channels and the policies read for it all
+  belong to its loop, so the request is handled there, and errors are
+  reported through onerror.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::requestServiceByScheme(const std::string& scheme)
+{
+  if (!getLoop())
+    throw FB::script_error("Connection is not open.");
+
+  postToLoop(boost::bind(&SecureConnection::serviceRequested, self(), scheme));
+}
+
+
+void SecureConnection::serviceRequested(const std::string& scheme)
+{
+  if (m_readyState != OPEN)
+  {
+    reportError(FB::script_error("Connection is not open."));
+    return;
+  }
+
+  if (m_serviceSchemes.end() == std::find_if(m_serviceSchemes.begin(),
+                                             m_serviceSchemes.end(),
+                                             boost::bind(predicate, scheme, _1)))
+  {
+    reportError(FB::script_error("Service not available."));
+    return;
+  }
+
+  // Read while the connection was opened; see getServiceSchemes.
+  std::map<std::string, std::string>::const_iterator it = m_policies.find(scheme);
+  if (it != m_policies.end())
+  {
+    startService(scheme, it->second);
+    return;
+  }
+
+  if (m_channels)
+    m_channels->borrow(boost::bind(&SecureConnection::readServicePolicy, self(), scheme, _1, _2));
+
+  else
+    readServicePolicy(scheme, SftpChannelPtr(), 0);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::readServicePolicy
+
+  Reads a policy that was not read while the connection was opened, on a
+  subsystem borrowed for it unless the connection is multiplexed. A policy
+  that has not changed since it was last read is taken from the cache; see
+  PolicyCache.h. Otherwise, or if the stat failed, it is read, and
+  remembered if the stat succeeded. The subsystem is given back once the
+  last of these lets go of it.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::readServicePolicy(const std::string& scheme, SftpChannelPtr sftp, int rc)
+{
+  if (rc || (!sftp && !m_mux))
+  {
+    reportError(FB::script_error("Unable to initialize SFTP channel."));
+    return;
+  }
+
+  std::string filename(CONFIG_DIR);
+  filename.append("/");
+  filename.append(scheme);
+
+  SftpStatPtr stat = sftp
+                     ? boost::make_shared<SftpStat>(getSession(), sftp->get(), filename)
+                     : boost::make_shared<SftpStat>(m_mux, filename);
+
+  submitSftp(boost::bind(&SftpStat::step, stat),
+             boost::bind(&SecureConnection::servicePolicyStatted, self(), scheme, sftp, stat, _1));
+}
+
+
+void SecureConnection::servicePolicyStatted(const std::string& scheme, SftpChannelPtr sftp, SftpStatPtr stat, int rc)
+{
+  std::string text;
+
+  if (rc == 0 && PolicyCache::instance().lookupPolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                                      scheme, *stat, text))
+  {
+    startService(scheme, text);
+    return;
+  }
+
+  SftpReadFilePtr policy = sftp
+                           ? boost::make_shared<SftpReadFile>(getSession(), sftp->get(), stat->getPath())
+                           : boost::make_shared<SftpReadFile>(m_mux, stat->getPath());
+
+  submitSftp(boost::bind(&SftpReadFile::step, policy),
+             boost::bind(&SecureConnection::servicePolicyRead, self(), scheme, sftp, policy,
+                         rc ? SftpStatPtr() : stat, _1));
+}
+
+
+void SecureConnection::servicePolicyRead(const std::string& scheme, SftpChannelPtr sftp, SftpReadFilePtr policy,
+                                         SftpStatPtr stat, int rc)
+{
+  if (sftp && PooledSession::isLinkFailure(rc))
+    sftp->setBroken();
+
+  if (rc)
+  {
+    reportError(FB::script_error(policy->wasOpened()
+                                 ? "Unable to read service policy."
+                                 : "Unable to open service policy."));
+    return;
+  }
+
+  if (stat)
+    PolicyCache::instance().storePolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                        scheme, *stat, policy->getContents());
+
+  startService(scheme, policy->getContents());
+}
+
+
+void SecureConnection::startService(const std::string& scheme, const std::string& policy)
+{
+  m_policies[scheme] = policy;
+
+  // The service grants itself once it has started, and is built when the
+  // page first uses it; see Service.h.
+  ServiceRegistry::instance().create(self(), scheme, policy);
+}
+
+
+void SecureConnection::grantService(ServicePtr service)
+{
+  {
+    boost::mutex::scoped_lock lock(m_servicesMutex);
+    m_services.push_back(service);
+  }
+
+  FireEvent("ongrant", FB::variant_list_of(shared_from_this())(service));
+}
+
+
+void SecureConnection::releaseService(ServicePtr service)
+{
+  // check that services is in m_services, remove
+  service->revoke();
+}
+
+
+void SecureConnection::revokeAllServices()
+{
+  std::vector<ServicePtr> services;
+  {
+    boost::mutex::scoped_lock lock(m_servicesMutex);
+    services.swap(m_services);
+  }
+
+  while (services.size() > 0) {
+    services.back()->revoke();
+    services.pop_back();
+  }
+}
+
+
+void SecureConnection::scheduleClose()
+{
+  if (getLoop())
+    postToLoop(boost::bind(&SecureConnection::closeConnection, self()));
+  else
+    closeConnection();
+}
+
+
+void SecureConnection::closeConnection()
+{
+  setReadyState(CLOSING);
+
+  m_reconnecting = false;
+  m_password = "";
+  
+  revokeAllServices();
+  finishHandshake();
+
+  // Still connecting; socketConnected will see that the connection is
+  // closing and close the socket.
+  if (m_connector)
+    m_connector->cancel();
+
+  if (m_pooled)
+  {
+    m_sftp.reset();
+    m_channels.reset();
+
+    SessionPool::instance().release(m_pooled);
+    m_pooled.reset();
+  }
+
+  m_mux.reset();
+
+  // Closed before its session was handed over; those waiting on the
+  // bastion are told it failed.
+  if (m_bastion)
+    JumpHost::instance().failed(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                "Connection to jump host closed.");
+
+  setReadyState(CLOSED);
+}
+
+
+void SecureConnection::setReadyState(SecureConnection::ReadyState state)
+{
+  if (m_readyState != state)
+  {
+    m_readyState = state;
+    FireEvent("onreadystatechange", FB::variant_list_of(shared_from_this())(m_readyState));
+  }
+}
+
+
+void SecureConnection::reportError(const FB::script_error& e) 
+{
+  FireEvent("onerror", FB::variant_list_of(shared_from_this())(e.what()));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::mayReuseSession
+
+  A pooled session was authenticated for whichever page opened it. Another
+  page may borrow it only if it could have authenticated without asking
+  the user: the account takes keys, or its password is still in the
+  CredentialCache, which the prompt would have filled the request from.
+  Any other page opens a session of its own, and is asked for the password.
+
+  *-----------------------------------------------------------------------------*/
+
+bool SecureConnection::mayReuseSession(const std::string& key)
+{
+  std::string password;
+
+  return KeyAuthentication::rememberedMethod(key) == KeyAuthentication::METHOD_PUBLICKEY
+         || CredentialCache::instance().lookup(key, password);
+}
+
+
+bool SecureConnection::isOriginAllowed()
+{
+  // TODO implement same-origin policy for hostName
+  // use either window.location.origin, or read the permissions
+  // from the manifest for an app.
+  return true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::createSocket
+
+  Resolves the host, usually from the Resolver's cache, and hands its
+  addresses to a Connector, which races them; see Connector.h. A host behind
+  a jump host is reached through a tunnel instead. A host warmed up when the
+  plugin loaded may have a session handshaken already; see WarmUp.h. The
+  connection then moves to that session's loop, and takes over the turn
+  the session was handshaken in.
+
+  Otherwise the connection first waits for a turn to handshake with the
+  host, which it holds until it has authenticated; see Admission.h.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::createSocket()
+{
+  if (m_jumpHost.empty())
+  {
+    PooledSessionPtr warm = WarmUp::instance().take(m_hostName, m_port, m_compression, m_algorithmProfile);
+    if (warm)
+    {
+      m_admitted = true;
+      m_pooled = warm;
+      m_pooled->setKey(SessionPool::makeKey(m_user, m_hostName, m_port));
+      setLoop(m_pooled->getLoop());
+      m_loop->post(boost::bind(&SecureConnection::sessionStarted, self(), 0));
+      return;
+    }
+  }
+
+  Admission::instance().admitHandshake(m_hostName, m_port, m_loop,
+                                       boost::bind(&SecureConnection::handshakeAdmitted, self()));
+}
+
+
+void SecureConnection::handshakeAdmitted()
+{
+  if (!isOpening())
+  {
+    Admission::instance().finishHandshake(m_hostName, m_port);
+    return;
+  }
+
+  m_admitted = true;
+
+  if (!m_jumpHost.empty())
+    openTunnel();
+
+  else
+    Resolver::instance().resolve(m_hostName, m_port, m_loop,
+                                 boost::bind(&SecureConnection::hostResolved, self(), _1, _2));
+}
+
+
+void SecureConnection::finishHandshake()
+{
+  if (m_admitted)
+  {
+    m_admitted = false;
+    Admission::instance().finishHandshake(m_hostName, m_port);
+  }
+}
+
+
+void SecureConnection::hostResolved(int rc, Resolver::AddressList addresses)
+{
+  if (!isOpening())
+    return;
+
+  if (rc)
+  {
+    std::stringstream msg;
+    msg << "Cannot resolve remote host: " << gai_strerror(rc);
+
+    failOpen(FB::script_error(msg.str()));
+    return;
+  }
+
+  m_connector = boost::make_shared<Connector>(m_loop, addresses.get(), m_attemptTimeout, m_connectTimeout);
+  m_connector->start(boost::bind(&SecureConnection::socketConnected, self(), _1));
+}
+
+
+void SecureConnection::socketConnected(int rc)
+{
+  ConnectorPtr connector = m_connector;
+  m_connector.reset();
+
+  if (!isOpening())
+  {
+    if (rc == 0)
+      close(connector->getSocket());
+  }
+  else if (rc == Connector::CONNECT_TIMED_OUT)
+    failOpen(FB::script_error("Timed out connecting to remote host."));
+
+  else if (rc)
+    failOpen(FB::script_error("Unable to connect to remote host."));
+
+  else
+    startSession(connector->getSocket(), connector->getAddress());
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::openTunnel
+
+  The bastion resolves and connects to the host, through a direct-tcpip
+  channel on its session, which is shared with every other connection
+  through the same bastion. The session then starts over the tunnel's
+  socket as over any other. It has no address of its own, so in "auto" mode
+  compression is chosen as for a link that has not been measured.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::openTunnel()
+{
+  std::string user;
+  std::string hostName;
+  unsigned int port;
+
+  JumpHost::parse(m_jumpHost, m_user, user, hostName, port);
+  JumpHost::instance().acquire(self(), user, hostName, port, m_loop,
+                               boost::bind(&SecureConnection::bastionAcquired, self(), _1, _2));
+}
+
+
+void SecureConnection::bastionAcquired(BastionPtr bastion, const std::string& error)
+{
+  if (!isOpening())
+    return;
+
+  if (!bastion)
+  {
+    std::stringstream msg;
+    msg << "Cannot open jump host: " << error;
+
+    failOpen(FB::script_error(msg.str()));
+    return;
+  }
+
+  bastion->openTunnel(m_hostName, m_port, m_loop,
+                      boost::bind(&SecureConnection::tunnelOpened, self(), _1, _2));
+}
+
+
+void SecureConnection::tunnelOpened(int rc, int sock)
+{
+  if (!isOpening())
+  {
+    if (rc == 0)
+      close(sock);
+  }
+  else if (rc)
+    failOpen(FB::script_error("Jump host is unable to connect to remote host."));
+
+  else
+    startSession(sock, "");
+}
+
+
+void SecureConnection::startSession(int sock, const std::string& address)
+{
+  m_pooled = boost::make_shared<PooledSession>(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                               sock, m_loop);
+  m_pooled->setRemoteAddress(address);
+
+  if (!m_pooled->getSession())
+  {
+    failOpen(FB::script_error("Cannot initialize secure session."));
+    return;
+  }
+
+  // Compression is negotiated in the handshake, so it is settled now.
+  if (CompressionPolicy::instance().choose(m_compression, address, sock))
+    libssh2_session_flag(m_pooled->getSession(), LIBSSH2_FLAG_COMPRESS, 1);
+
+  // If libssh2 supports none of a profile's algorithms, its defaults stand.
+  AlgorithmProfile::instance().apply(m_algorithmProfile, m_pooled->getSession());
+
+  m_pooled->submit(boost::bind(libssh2_session_startup, m_pooled->getSession(), m_pooled->getSocket()),
+                   boost::bind(&SecureConnection::sessionStarted, self(), _1));
+}
+
+
+void SecureConnection::sessionStarted(int rc)
+{
+  // sshd drops connections over its MaxStartups before the banner. If
+  // others of ours were handshaking, the host is taken to be at its limit
+  // and this one waits for another turn.
+  if (rc && m_admitted && (PooledSession::isLinkFailure(rc) || rc == LIBSSH2_ERROR_BANNER_RECV))
+  {
+    m_admitted = false;
+
+    if (Admission::instance().handshakeRefused(m_hostName, m_port))
+    {
+      m_pooled.reset();
+      createSocket();
+      return;
     }
+  }
+
+  if (rc)
+  { 
+    std::stringstream msg;
+    msg << "Cannot start session with host: return code: " << rc;
+
+    failOpen(FB::script_error(msg.str()));
+  }
+  else
+  {
+    m_pooled->recordAlgorithms();
+
+    if (!checkHostKey())
+      return;
+
+    m_sessionStarted = true;
 
-    libssh2_knownhost_free(hosts);
+    if (m_haveCredentials)
+      authenticate();
+
+    // Otherwise credentialsReceived authenticates once the user answers.
+    else if (!m_credentialsRequested)
+      authenticateWithKeys();
   }
-  catch (FB::script_error e)
+}
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::checkHostKey
+
+  Checks the host's key against known_hosts before anything is sent to the
+  host, the password in particular. A changed or revoked key ends the open.
+  An unknown host is added to known_hosts if the unknown host policy is
+  "accept-new", as OpenSSH does with StrictHostKeyChecking=accept-new, and
+  refused if it is "reject".
+
+  *-----------------------------------------------------------------------------*/
+
+bool SecureConnection::checkHostKey()
+{
+  size_t length;
+  int type;
+  const char *key = libssh2_session_hostkey(getSession(), &length, &type);
+
+  if (!key)
   {
-    libssh2_knownhost_free(hosts);
-    throw e;
+    failOpen(FB::script_error("Unable to obtain host key."));
+    return false;
   }
-  catch (std::exception e)
+
+  switch (KnownHosts::instance().check(m_hostName, m_port, key, length))
   {
-    libssh2_knownhost_free(hosts);
-    throw e;
+  case KnownHosts::HOST_KEY_MATCH:
+    return true;
+
+  case KnownHosts::HOST_KEY_NOT_FOUND:
+    if (m_unknownHostPolicy == "accept-new")
+    {
+      KnownHosts::instance().add(m_hostName, m_port, key, length);
+      return true;
+    }
+
+    failOpen(FB::script_error("Unknown host; not added to known hosts."));
+    return false;
+
+  case KnownHosts::HOST_KEY_REVOKED:
+    failOpen(FB::script_error("Host key has been revoked."));
+    return false;
+
+  default:
+    failOpen(FB::script_error("Host key does not match known hosts."));
+    return false;
   }
 }
 
-*/
 void SecureConnection::authenticate()
 {
-  int rc;
-  if ((rc = libssh2_userauth_password(m_session, m_user.c_str(), m_password.c_str())))
-    throw FB::script_error("Invalid username or password");
+  m_pooled->submit(boost::bind(&SecureConnection::stepAuthenticate, self()),
+                   boost::bind(&SecureConnection::authenticated, self(), _1));
+}
 
-  m_password = "";
+
+int SecureConnection::stepAuthenticate()
+{
+  return libssh2_userauth_password(getSession(), m_user.c_str(), m_password.c_str());
+}
+
+
+void SecureConnection::authenticated(int rc)
+{
+  if (rc)
+  {
+    // Other connections to the account should ask again, not be handed the
+    // same wrong password.
+    if (!PooledSession::isLinkFailure(rc))
+      CredentialCache::instance().forget(m_pooled->getKey());
+
+    m_password = "";
+    failOpen(FB::script_error("Invalid username or password"));
+  }
+  else
+  {
+    KeyAuthentication::rememberMethod(m_pooled->getKey(), KeyAuthentication::METHOD_PASSWORD);
+    sessionAuthenticated();
+  }
+}
+
+
+void SecureConnection::authenticateWithKeys()
+{
+  KeyAuthenticationPtr keys = boost::make_shared<KeyAuthentication>(getSession(), m_user);
+  m_pooled->submit(boost::bind(&KeyAuthentication::step, keys),
+                   boost::bind(&SecureConnection::keysAuthenticated, self(), keys, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::keysAuthenticated
+
+  If no key was accepted, the account is remembered as needing a password
+  and the user is asked for one now. A reconnect cannot ask, so it fails.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::keysAuthenticated(KeyAuthenticationPtr keys, int rc)
+{
+  if (rc == 0)
+  {
+    KeyAuthentication::rememberMethod(m_pooled->getKey(), KeyAuthentication::METHOD_PUBLICKEY);
+    sessionAuthenticated();
+  }
+  else if (PooledSession::isLinkFailure(rc) || m_reconnecting)
+    failOpen(FB::script_error("Unable to authenticate with remote host."));
+
+  else
+  {
+    KeyAuthentication::rememberMethod(m_pooled->getKey(), KeyAuthentication::METHOD_PASSWORD);
+
+    m_credentialsRequested = true;
+    m_hs.lock()->plugin()->requestCredentials(shared_ptr());
+  }
+}
+
+
+void SecureConnection::sessionAuthenticated()
+{
+  finishHandshake();
+  SessionPool::instance().add(m_pooled);
+
+  // A bastion's session needs no SFTP; it goes to JumpHost, reference and
+  // all, and this connection is done.
+  if (m_bastion)
+  {
+    PooledSessionPtr session = m_pooled;
+    m_pooled.reset();
+
+    JumpHost::instance().opened(session);
+    closeConnection();
+    return;
+  }
+
+  openSftpChannel();
 }
 
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::openSftpChannel
+
+  Borrows a subsystem from the session's pool for bootstrapping, which
+  starts the pool's first if it has none; see SftpChannelPool.h. If the
+  connection has moved on by the time the subsystem is lent, it is simply
+  given back.
+
+  *-----------------------------------------------------------------------------*/
+
 void SecureConnection::openSftpChannel()
 {
-  if (!m_sftp && !(m_sftp = libssh2_sftp_init(m_session)))
-    throw FB::script_error("Unable to initialize SFTP channel.");
+  m_channels = SftpChannelPool::forSession(m_pooled);
+  m_channels->borrow(boost::bind(&SecureConnection::sftpBorrowed, self(), m_channels, _1, _2));
+}
+
+
+void SecureConnection::sftpBorrowed(SftpChannelPoolPtr channels, SftpChannelPtr sftp, int rc)
+{
+  if (channels != m_channels || !isOpening())
+    return;
+
+  m_sftp = sftp;
+  sftpChannelOpened(rc);
+}
+
+
+void SecureConnection::sftpChannelOpened(int rc)
+{
+  // The master opened the session but the subsystem did not start; opening
+  // directly may yet work.
+  if (rc && m_mux)
+  {
+    m_mux.reset();
+    openDirect();
+  }
+
+  else if (rc)
+    failOpen(FB::script_error("Unable to initialize SFTP channel."), rc);
+
+  else if (m_reconnecting)
+  {
+    // The session works; the services borrow for themselves.
+    m_sftp.reset();
+    completeReconnect();
+  }
+
+  else
+    getServiceSchemes();
+}
+
+
+// SFTP operations go to whichever of the two kinds of session is open.
+void SecureConnection::submitSftp(const ReactorLoop::Step& step, const ReactorLoop::Completion& done)
+{
+  if (m_mux)
+    m_mux->submit(step, done);
+
+  else
+    m_pooled->submit(step, done);
 }
 
 
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::getServiceSchemes
+
+  Bootstraps the connection's services in one SftpBatch: the config
+  directory is statted and the home directory resolved together, and once
+  the scheme list is known every scheme's policy is statted and, unless
+  the cache has it, read, all in flight at once. The list, the policies and
+  the home directory are then at hand for requestServiceByScheme and the
+  services it starts, and the connection is opened. The list and each
+  policy are taken from the cache if they have not changed since they were
+  last read, and the home directory if it has been resolved before; see
+  PolicyCache.h.
+
+  A policy that cannot be read now is left to be read, and its error
+  reported, when its service is requested.
+
+  *-----------------------------------------------------------------------------*/
+
 void SecureConnection::getServiceSchemes()
 {
-  openSftpChannel();
+  m_policies.clear();
+  m_bootstrapError = 0;
+
+  SftpBatchPtr batch = boost::make_shared<SftpBatch>(!m_mux);
 
-  LIBSSH2_SFTP_HANDLE *config_dir = NULL;
+  SftpStatPtr stat = m_mux
+                     ? boost::make_shared<SftpStat>(m_mux, CONFIG_DIR)
+                     : boost::make_shared<SftpStat>(getSession(), m_sftp->get(), CONFIG_DIR);
 
-  try
+  batch->add(SftpBatch::KIND_STAT, boost::bind(&SftpStat::step, stat),
+             boost::bind(&SecureConnection::serviceSchemesStatted, self(), batch.get(), stat, _1));
+
+  if (!PolicyCache::instance().lookupHome(SessionPool::makeKey(m_user, m_hostName, m_port), m_home))
   {
-    if ((config_dir = libssh2_sftp_opendir(m_sftp, CONFIG_DIR)))
-    {
-      int rc;
-      char buffer[DIR_BUFFER_SIZE];
-      LIBSSH2_SFTP_ATTRIBUTES attrs;
-      while ((rc = libssh2_sftp_readdir(config_dir, buffer, sizeof(buffer), &attrs)) > 0)
-	if (strncmp(buffer, ".", rc) && strncmp(buffer, "..", rc))
-	  m_serviceSchemes.push_back(std::string(buffer));
-
-      if (rc < 0) 
-	throw FB::script_error("Error while reading services' policies.");
-
-      libssh2_sftp_closedir(config_dir);
-      config_dir = NULL;
-    }
+    SftpRealPathPtr home = m_mux
+                           ? boost::make_shared<SftpRealPath>(m_mux, ".")
+                           : boost::make_shared<SftpRealPath>(getSession(), m_sftp->get(), ".");
+
+    batch->add(SftpBatch::KIND_REALPATH, boost::bind(&SftpRealPath::step, home),
+               boost::bind(&SecureConnection::homeResolved, self(), home, _1));
+  }
+
+  submitSftp(boost::bind(&SftpBatch::step, batch),
+             boost::bind(&SecureConnection::bootstrapped, self(), batch, _1));
+}
+
+
+void SecureConnection::serviceSchemesStatted(SftpBatch *batch, SftpStatPtr stat, int rc)
+{
+  if (rc == 0 && PolicyCache::instance().lookupSchemes(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                                       *stat, m_serviceSchemes))
+  {
+    prefetchPolicies(batch);
+    return;
+  }
+
+  SftpReadDirPtr config_dir = m_mux
+                              ? boost::make_shared<SftpReadDir>(m_mux, CONFIG_DIR)
+                              : boost::make_shared<SftpReadDir>(getSession(), m_sftp->get(), CONFIG_DIR);
+
+  batch->add(SftpBatch::KIND_OPEN, boost::bind(&SftpReadDir::step, config_dir),
+             boost::bind(&SecureConnection::serviceSchemesRead, self(), batch, config_dir,
+                         rc ? SftpStatPtr() : stat, _1));
+}
+
+
+void SecureConnection::serviceSchemesRead(SftpBatch *batch, SftpReadDirPtr config_dir, SftpStatPtr stat, int rc)
+{
+  // A missing config directory simply means that no services are offered;
+  // one that could not be listed for a lost link does not.
+  if (rc && (config_dir->wasOpened() || PooledSession::isLinkFailure(rc)))
+  {
+    m_bootstrapError = rc;
+    return;
+  }
+
+  m_serviceSchemes = config_dir->getEntries();
+
+  if (rc == 0 && stat)
+    PolicyCache::instance().storeSchemes(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                         *stat, m_serviceSchemes);
+
+  prefetchPolicies(batch);
+}
+
+
+void SecureConnection::prefetchPolicies(SftpBatch *batch)
+{
+  for (size_t i = 0; i < m_serviceSchemes.size(); i++)
+  {
+    std::string filename(CONFIG_DIR);
+    filename.append("/");
+    filename.append(m_serviceSchemes[i]);
+
+    SftpStatPtr stat = m_mux
+                       ? boost::make_shared<SftpStat>(m_mux, filename)
+                       : boost::make_shared<SftpStat>(getSession(), m_sftp->get(), filename);
+
+    batch->add(SftpBatch::KIND_STAT, boost::bind(&SftpStat::step, stat),
+               boost::bind(&SecureConnection::policyPrefetchStatted, self(), batch,
+                           m_serviceSchemes[i], stat, _1));
+  }
+}
+
+
+void SecureConnection::policyPrefetchStatted(SftpBatch *batch, const std::string& scheme, SftpStatPtr stat, int rc)
+{
+  std::string text;
+
+  if (rc == 0 && PolicyCache::instance().lookupPolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                                      scheme, *stat, text))
+  {
+    m_policies[scheme] = text;
+    return;
+  }
+
+  SftpReadFilePtr policy = m_mux
+                           ? boost::make_shared<SftpReadFile>(m_mux, stat->getPath())
+                           : boost::make_shared<SftpReadFile>(getSession(), m_sftp->get(), stat->getPath());
+
+  batch->add(SftpBatch::KIND_OPEN, boost::bind(&SftpReadFile::step, policy),
+             boost::bind(&SecureConnection::policyPrefetched, self(), scheme, policy,
+                         rc ? SftpStatPtr() : stat, _1));
+}
+
+
+void SecureConnection::policyPrefetched(const std::string& scheme, SftpReadFilePtr policy, SftpStatPtr stat, int rc)
+{
+  if (rc)
+    return;
+
+  m_policies[scheme] = policy->getContents();
+
+  if (stat)
+    PolicyCache::instance().storePolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                        scheme, *stat, policy->getContents());
+}
+
+
+void SecureConnection::homeResolved(SftpRealPathPtr home, int rc)
+{
+  if (rc == 0)
+  {
+    m_home = home->getRealPath();
+    PolicyCache::instance().storeHome(SessionPool::makeKey(m_user, m_hostName, m_port), m_home);
+  }
+}
+
+
+void SecureConnection::bootstrapped(SftpBatchPtr batch, int rc)
+{
+  // Given back for the services to borrow.
+  if (m_sftp && PooledSession::isLinkFailure(rc))
+    m_sftp->setBroken();
+
+  m_sftp.reset();
+
+  if (m_bootstrapError)
+    failOpen(FB::script_error("Error while reading services' policies."), m_bootstrapError);
+
+  // The batch itself failed, rather than one of its operations.
+  else if (rc)
+  {
+    std::stringstream msg;
+    msg << "Error while reading services' policies: return code: " << rc;
+
+    failOpen(FB::script_error(msg.str()), rc);
+  }
+
+  else
+  {
+    setReadyState(OPEN);
+    watchPolicies();
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SecureConnection::watchPolicies
+
+  While the connection is open, the policies of the services it has
+  granted, and the others it has read, are checked every
+  POLICY_CHECK_INTERVAL. They are statted in one SftpBatch, and only those
+  whose stat differs from what PolicyCache has are read. m_policies is
+  brought up to date, for services requested later, and each service is
+  given its policy's text; one whose policy has changed rebuilds itself
+  while its commands carry on; see Service::policyChanged. A policy that
+  can no longer be read is left as it was.
+
+  *-----------------------------------------------------------------------------*/
+
+void SecureConnection::watchPolicies()
+{
+  if (m_watchingPolicies || m_readyState != OPEN)
+    return;
+
+  m_watchingPolicies = true;
+  m_loop->schedule(POLICY_CHECK_INTERVAL,
+                   boost::bind(&SecureConnection::checkPolicies, SecureConnectionWeakPtr(self())));
+}
+
+
+void SecureConnection::checkPolicies(SecureConnectionWeakPtr weak)
+{
+  SecureConnectionPtr connection = weak.lock();
+  if (!connection)
+    return;
+
+  if (connection->m_readyState != OPEN || connection->m_reconnecting
+      || (connection->getServices().empty() && connection->m_policies.empty()))
+    connection->policiesChecked(SftpBatchPtr(), SftpChannelPtr(), 0);
+
+  else if (connection->m_mux)
+    connection->policiesBorrowed(SftpChannelPtr(), 0);
+
+  else
+    connection->m_channels->borrow(boost::bind(&SecureConnection::policiesBorrowed, connection, _1, _2));
+}
+
+
+void SecureConnection::policiesBorrowed(SftpChannelPtr sftp, int rc)
+{
+  if (rc || (!sftp && !m_mux))
+  {
+    policiesChecked(SftpBatchPtr(), sftp, rc);
+    return;
   }
-  catch (FB::script_error e) 
+
+  SftpBatchPtr batch = boost::make_shared<SftpBatch>(!m_mux);
+  std::set<std::string> schemes;
+
+  std::vector<ServicePtr> services = getServices();
+  for (size_t i = 0; i < services.size(); i++)
+    schemes.insert(services[i]->get_scheme());
+
+  // Policies read at bootstrap for services not yet requested are kept
+  // current too, so that a later request starts with the latest.
+  for (std::map<std::string, std::string>::const_iterator it = m_policies.begin(); it != m_policies.end(); it++)
+    schemes.insert(it->first);
+
+  for (std::set<std::string>::const_iterator it = schemes.begin(); it != schemes.end(); it++)
   {
-    if (config_dir)
-      libssh2_sftp_closedir(config_dir);
+    std::string filename(CONFIG_DIR);
+    filename.append("/");
+    filename.append(*it);
+
+    SftpStatPtr stat = sftp
+                       ? boost::make_shared<SftpStat>(getSession(), sftp->get(), filename)
+                       : boost::make_shared<SftpStat>(m_mux, filename);
+
+    batch->add(SftpBatch::KIND_STAT, boost::bind(&SftpStat::step, stat),
+               boost::bind(&SecureConnection::policyCheckStatted, self(), batch.get(), sftp, *it, stat, _1));
+  }
+
+  submitSftp(boost::bind(&SftpBatch::step, batch),
+             boost::bind(&SecureConnection::policiesChecked, self(), batch, sftp, _1));
+}
+
+
+void SecureConnection::policyCheckStatted(SftpBatch *batch, SftpChannelPtr sftp, const std::string& scheme,
+                                          SftpStatPtr stat, int rc)
+{
+  if (rc)
+    return;
 
-    throw e;
+  std::string text;
+
+  if (PolicyCache::instance().lookupPolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                           scheme, *stat, text))
+  {
+    updatePolicy(scheme, text);
+    return;
   }
+
+  SftpReadFilePtr policy = sftp
+                           ? boost::make_shared<SftpReadFile>(getSession(), sftp->get(), stat->getPath())
+                           : boost::make_shared<SftpReadFile>(m_mux, stat->getPath());
+
+  batch->add(SftpBatch::KIND_OPEN, boost::bind(&SftpReadFile::step, policy),
+             boost::bind(&SecureConnection::policyCheckRead, self(), scheme, policy, stat, _1));
+}
+
+
+void SecureConnection::policyCheckRead(const std::string& scheme, SftpReadFilePtr policy, SftpStatPtr stat, int rc)
+{
+  if (rc)
+    return;
+
+  PolicyCache::instance().storePolicy(SessionPool::makeKey(m_user, m_hostName, m_port),
+                                      scheme, *stat, policy->getContents());
+
+  updatePolicy(scheme, policy->getContents());
+}
+
+
+void SecureConnection::updatePolicy(const std::string& scheme, const std::string& text)
+{
+  m_policies[scheme] = text;
+
+  std::vector<ServicePtr> services = getServices();
+  for (size_t i = 0; i < services.size(); i++)
+    if (services[i]->get_scheme() == scheme)
+      services[i]->policyChanged(text);
+}
+
+
+void SecureConnection::policiesChecked(SftpBatchPtr batch, SftpChannelPtr sftp, int rc)
+{
+  if (sftp && PooledSession::isLinkFailure(rc))
+    sftp->setBroken();
+
+  m_watchingPolicies = false;
+  watchPolicies();
 }
 
 
@@ -35,15 +35,29 @@
 #ifndef H_SecureConnection
 #define H_SecureConnection
 
+#include <map>
 #include <string>
 
 #include <libssh2.h>
 #include <libssh2_sftp.h>
 
+#include <boost/thread/mutex.hpp>
 #include <boost/weak_ptr.hpp>
 
 #include "JSAPIAuto.h"
+#include "AlgorithmProfile.h"
+#include "CompressionPolicy.h"
+#include "Connector.h"
+#include "ControlMaster.h"
 #include "HostServices.h"
+#include "JumpHost.h"
+#include "KeyAuthentication.h"
+#include "MuxSftp.h"
+#include "Reactor.h"
+#include "Resolver.h"
+#include "SessionPool.h"
+#include "SftpChannelPool.h"
+#include "SftpOperations.h"
 
 
 FB_FORWARD_PTR(Service);
@@ -53,6 +67,7 @@ class SecureConnection : public FB::JSAPIAuto
 {
  public:
   friend class FileService;
+  friend class JumpHost;
 
   SecureConnection(HostServicesPtr plugin,
 		   const std::string& user,
@@ -63,6 +78,21 @@ class SecureConnection : public FB::JSAPIAuto
 
   LIBSSH2_SESSION *getSession() const;
 
+  // Everything done with the session must go through its reactor loop.
+  PooledSessionPtr getPooledSession() const;
+
+  // The SFTP subsystem of a session opened through an OpenSSH ControlMaster,
+  // in which case there is no pooled session.
+  MuxSftpPtr getMuxSftp() const;
+
+  // The SFTP subsystems of the pooled session, which its services borrow
+  // for their operations; see SftpChannelPool.h.
+  SftpChannelPoolPtr getSftpChannels() const;
+
+  // The user's home directory on the host, resolved while opening; "" if
+  // it could not be.
+  const std::string& getHomeDirectory() const;
+
   std::string get_user() const;
   std::string get_password() const;
   void set_password(const std::string& password);
@@ -70,6 +100,52 @@ class SecureConnection : public FB::JSAPIAuto
   std::string get_hostName() const;
   unsigned int get_port() const;
 
+  // Connect deadlines, in milliseconds: for the whole of connecting, and
+  // for each address tried.
+  static const unsigned int DEFAULT_CONNECT_TIMEOUT = 30000;
+  static const unsigned int DEFAULT_ATTEMPT_TIMEOUT = 10000;
+
+  unsigned int get_connectTimeout() const;
+  void set_connectTimeout(unsigned int milliseconds);
+  unsigned int get_attemptTimeout() const;
+  void set_attemptTimeout(unsigned int milliseconds);
+
+  // The numeric address the session is connected to, or "" if none.
+  std::string get_remoteAddress() const;
+
+  // The compression mode, "auto", "on" or "off", used when a session is
+  // opened; and whether the session in use is compressed.
+  std::string get_compression() const;
+  void set_compression(const std::string& mode);
+  bool get_compressed() const;
+
+  // What to do with a host not in known_hosts: "accept-new" adds its key,
+  // "reject" refuses to connect.
+  std::string get_unknownHostPolicy() const;
+  void set_unknownHostPolicy(const std::string& policy);
+
+  // The algorithm profile used when a session is opened, one of "auto",
+  // "bulk", "interactive" and "compat"; and the algorithms negotiated by
+  // the session in use.
+  std::string get_algorithmProfile() const;
+  void set_algorithmProfile(const std::string& profile);
+  FB::VariantMap get_algorithms() const;
+
+  // Round-trip time to the host in milliseconds: the kernel's estimate for
+  // the session's TCP socket, sampled at each keepalive. 0 until sampled,
+  // and always 0 for a session that has no TCP socket of its own -- one
+  // tunnelled through a jump host, or multiplexed through a ControlMaster
+  // or the broker.
+  unsigned int get_roundTripTime() const;
+
+  // Whether the session was opened through the user's OpenSSH ControlMaster.
+  bool get_multiplexed() const;
+
+  // The bastion the host is reached through, as [user@]host[:port], or ""
+  // to connect directly; see JumpHost.h.
+  std::string get_jumpHost() const;
+  void set_jumpHost(const std::string& jumpHost);
+
   enum ReadyState {
     NEW,
     CONNECTING,
@@ -93,30 +169,103 @@ class SecureConnection : public FB::JSAPIAuto
   FB::VariantList get_services() const;
   FB::VariantList get_serviceSchemes() const;
 
+  // Called from the page; the work is done on the connection's loop.
   void requestServiceByScheme(const std::string& scheme);
   void releaseService(ServicePtr service);
+  void scheduleClose();
 
   void credentialsRequestFilled(const std::string& password);
   void credentialsRequestDenied();
 
+  // Only call from the connection's loop, or before it has one.
   void closeConnection();
 
+  // Called by a service whose operation failed because the connection was
+  // lost; see SecureConnection.cpp.
+  void reconnect();
+
+  std::string description();
+
  protected:
+  SecureConnectionPtr self();
+
   void setReadyState(ReadyState state);
   void reportError(const FB::script_error& e);
 
   void open();
+  void openThroughControlMaster();
+  void controlMasterFound(const std::string& path);
+  void controlMasterOpened(MuxRequestPtr request, int rc);
+  void openThroughBroker();
+  void brokerOpened(MuxRequestPtr request, int rc);
+  void startMuxSftp(MuxRequestPtr request);
+  void openDirect();
+  void startOpen();
   void completeOpen();
-
+  void credentialsReceived(const std::string& password);
+  void failOpen(const FB::script_error& e);
+  void failOpen(const FB::script_error& e, int rc);
+  bool isOpening() const;
+  void reopenSession();
+  void completeReconnect();
+
+  // The steps of opening, in order. Each submits the next from its
+  // completion; see completeOpen.
   bool isOriginAllowed();
+  bool mayReuseSession(const std::string& key);
   void createSocket();
-  void startSession();
+  void handshakeAdmitted();
+  void finishHandshake();
+  void hostResolved(int rc, Resolver::AddressList addresses);
+  void openTunnel();
+  void bastionAcquired(BastionPtr bastion, const std::string& error);
+  void tunnelOpened(int rc, int sock);
+  void socketConnected(int rc);
+  void startSession(int sock, const std::string& address);
+  void sessionStarted(int rc);
+  bool checkHostKey();
   void authenticate();
-  void getServiceSchemes();
-
+  int stepAuthenticate();
+  void authenticated(int rc);
+  void authenticateWithKeys();
+  void keysAuthenticated(KeyAuthenticationPtr keys, int rc);
+  void sessionAuthenticated();
   void openSftpChannel();
+  void sftpBorrowed(SftpChannelPoolPtr channels, SftpChannelPtr sftp, int rc);
+  void sftpChannelOpened(int rc);
+  void submitSftp(const ReactorLoop::Step& step, const ReactorLoop::Completion& done);
+  void getServiceSchemes();
+  void serviceSchemesStatted(SftpBatch *batch, SftpStatPtr stat, int rc);
+  void serviceSchemesRead(SftpBatch *batch, SftpReadDirPtr config_dir, SftpStatPtr stat, int rc);
+  void prefetchPolicies(SftpBatch *batch);
+  void policyPrefetchStatted(SftpBatch *batch, const std::string& scheme, SftpStatPtr stat, int rc);
+  void policyPrefetched(const std::string& scheme, SftpReadFilePtr policy, SftpStatPtr stat, int rc);
+  void homeResolved(SftpRealPathPtr home, int rc);
+  void bootstrapped(SftpBatchPtr batch, int rc);
+
+  void watchPolicies();
+  static void checkPolicies(SecureConnectionWeakPtr weak);
+  void policiesBorrowed(SftpChannelPtr sftp, int rc);
+  void policyCheckStatted(SftpBatch *batch, SftpChannelPtr sftp, const std::string& scheme,
+                          SftpStatPtr stat, int rc);
+  void policyCheckRead(const std::string& scheme, SftpReadFilePtr policy, SftpStatPtr stat, int rc);
+  void updatePolicy(const std::string& scheme, const std::string& text);
+  void policiesChecked(SftpBatchPtr batch, SftpChannelPtr sftp, int rc);
+
+  void readServicePolicy(const std::string& scheme, SftpChannelPtr sftp, int rc);
+  void servicePolicyStatted(const std::string& scheme, SftpChannelPtr sftp, SftpStatPtr stat, int rc);
+  void servicePolicyRead(const std::string& scheme, SftpChannelPtr sftp, SftpReadFilePtr policy,
+                         SftpStatPtr stat, int rc);
+  void startService(const std::string& scheme, const std::string& policy);
   void grantService(ServicePtr service);
   void revokeAllServices();
+  void serviceRequested(const std::string& scheme);
+
+  ReactorLoop *getLoop() const;
+  void setLoop(ReactorLoop *loop);
+  void postToLoop(const ReactorLoop::Task& task);
+  void runOnLoop(const ReactorLoop::Task& task);
+  std::vector<ServicePtr> getServices() const;
 
 
  private:
@@ -128,6 +277,23 @@ class SecureConnection : public FB::JSAPIAuto
   unsigned int m_port;
 
   std::vector<std::string> m_serviceSchemes;
+
+  // What the services need from the host, read while opening: each
+  // scheme's policy text, and the user's home directory, "" if it could not
+  // be resolved.
+  std::map<std::string, std::string> m_policies;
+  std::string m_home;
+
+  // What failed bootstrapping, if anything did; see serviceSchemesRead.
+  int m_bootstrapError;
+
+  // Set while a check of the services' policies is scheduled or under way;
+  // see watchPolicies.
+  bool m_watchingPolicies;
+
+  // Granted on the loop, revoked and listed on the page's thread, and
+  // checked on the loop; readers take a copy. See getServices.
+  mutable boost::mutex m_servicesMutex;
   std::vector<ServicePtr> m_services;
 
   int m_readyState;
@@ -137,9 +303,45 @@ class SecureConnection : public FB::JSAPIAuto
   FB::JSObjectPtr m_ongrant;
   FB::JSObjectPtr m_onerror;
 
-  int m_sock;
-  LIBSSH2_SESSION *m_session;
-  LIBSSH2_SFTP *m_sftp;
+  // The loop the connection's session lives on. It changes only while
+  // the connection opens or reconnects; the page's thread reads it with
+  // getLoop, under m_loopMutex.
+  ReactorLoop *m_loop;
+  mutable boost::mutex m_loopMutex;
+
+  unsigned int m_connectTimeout;
+  unsigned int m_attemptTimeout;
+  CompressionPolicy::Mode m_compression;
+  std::string m_algorithmProfile;
+  std::string m_unknownHostPolicy;
+  std::string m_jumpHost;
+
+  // Set on the connection JumpHost opens a bastion's session with, which
+  // hands the session over once it is authenticated.
+  bool m_bastion;
+
+  // Set while the connection holds a turn to handshake with the host, from
+  // connecting until authenticated; see Admission.h.
+  bool m_admitted;
+
+  // Only set while connecting. Once connected, the socket is given to a
+  // PooledSession, which is added to the pool after authentication.
+  ConnectorPtr m_connector;
+
+  PooledSessionPtr m_pooled;
+  SftpChannelPoolPtr m_channels;
+  MuxSftpPtr m_mux;
+  bool m_reused;
+  bool m_reconnecting;
+
+  // Password authentication waits for both of these; see startOpen. Key
+  // authentication is tried instead if no password has been asked for.
+  bool m_sessionStarted;
+  bool m_haveCredentials;
+  bool m_credentialsRequested;
+
+  // Borrowed from m_channels while the connection bootstraps.
+  SftpChannelPtr m_sftp;
 
 };
 
@@ -36,7 +36,9 @@ Service::Service(SecureConnectionPtr connection,
 		 const std::string& configText)
   : m_connection(connection),
     m_scheme(scheme),
-    m_configText(configText)
+    m_configText(configText),
+    m_built(false),
+    m_revoked(false)
 {
   registerAttribute("connection", connection, true);
   registerAttribute("scheme",     scheme,     true);
@@ -61,6 +63,44 @@ std::string Service::get_scheme() const
 
 
 void Service::revoke() 
+{
+  boost::mutex::scoped_lock lock(m_activateMutex);
+  m_revoked = true;
+}
+
+
+void Service::activate()
+{
+  boost::mutex::scoped_lock lock(m_activateMutex);
+
+  if (m_built || m_revoked)
+    return;
+
+  m_built = true;
+  build();
+}
+
+
+void Service::policyChanged(const std::string& configText)
+{
+  boost::mutex::scoped_lock lock(m_activateMutex);
+
+  if (configText == m_configText)
+    return;
+
+  m_configText = configText;
+
+  if (m_built && !m_revoked)
+    build();
+}
+
+
+void Service::build()
+{
+}
+
+
+void Service::reconnected()
 {
 }
 
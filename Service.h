@@ -5,6 +5,15 @@
   Service is a base class for all provided services, a place to hang common
   code.
 
+  A service is granted as soon as it has started, but it is built -- its
+  policy parsed and whatever else it needs to serve set up -- only when one
+  of its methods is first called, so that a page pays for no more than the
+  services it uses. See activate.
+
+  The connection watches the policies of the services it has granted, and
+  a service whose policy changes is rebuilt in place, without disturbing
+  what it is doing. See policyChanged.
+
   ---------------------------------------------------------------------------
 
   This file is part of JS/HS.
@@ -31,6 +40,8 @@
 
 #include <string.h>
 
+#include <boost/thread/mutex.hpp>
+
 #include "JSAPIAuto.h"
 
 #include "SecureConnection.h"
@@ -51,17 +62,42 @@ class Service : public FB::JSAPIAuto
   FB::JSAPIPtr get_connection() const;
   std::string get_scheme() const;
 
+  // Services that override revoke must call it, so that a service revoked
+  // before its first use is never built.
   virtual void revoke();
 
+  // Called on the connection's loop once a lost connection has been
+  // re-established; the connection's pooled session is the new one.
+  virtual void reconnected();
+
+  // Called on the connection's loop with the text of the scheme's policy
+  // file whenever it has been checked. If it differs from the text the
+  // service has, it is kept for build, and a service already built is
+  // built again with it.
+  void policyChanged(const std::string& configText);
+
  protected:
+  // Each scripted method calls this before anything else. The first call
+  // builds the service; later ones, and any after revoke, do nothing.
+  // build is called with the lock held, so that it reads m_configText
+  // safely and is never run twice at once; it must leave the service as
+  // it was if the policy has errors.
+  void activate();
+  virtual void build();
+
   std::string m_scheme;
   std::string m_configText;
   SecureConnectionWeakPtr m_connection;
   
  private:
+  boost::mutex m_activateMutex;
+  bool m_built;
+  bool m_revoked;
 };
 
-typedef ServicePtr *(ServiceFactory)(SecureConnectionPtr connection,
+// Makes a service for a scheme and starts it; the service grants itself to
+// the connection once it has started. See ServiceRegistry.h.
+typedef ServicePtr (*ServiceFactory)(SecureConnectionPtr connection,
 				     const std::string& scheme,
 				     const std::string& configText);
 
@@ -0,0 +1,80 @@
+/******************************************************************************
+
+  ServiceRegistry.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include "FileService.h"
+#include "ServiceRegistry.h"
+
+
+/*-----------------------------------------------------------------------------*
+
+  ServiceRegistry::instance
+
+  *-----------------------------------------------------------------------------*/
+
+ServiceRegistry& ServiceRegistry::instance()
+{
+  static ServiceRegistry registry;
+  return registry;
+}
+
+
+ServiceRegistry::ServiceRegistry()
+  : m_default(&FileService::create)
+{
+  m_factories["file"] = &FileService::create;
+}
+
+
+void ServiceRegistry::add(const std::string& scheme, ServiceFactory factory)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_factories[scheme] = factory;
+}
+
+
+ServicePtr ServiceRegistry::create(SecureConnectionPtr connection,
+                                   const std::string& scheme,
+                                   const std::string& configText)
+{
+  ServiceFactory factory = m_default;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::map<std::string, ServiceFactory>::const_iterator it = m_factories.find(scheme);
+    if (it != m_factories.end())
+      factory = it->second;
+  }
+
+  return factory(connection, scheme, configText);
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,71 @@
+/******************************************************************************
+
+  ServiceRegistry.h
+
+  Each scheme a host offers in ~/.jshs/config is served by the service
+  whose factory is registered for it. A scheme without a factory of its
+  own is a FileService, as every scheme was before there were others.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_ServiceRegistry
+#define H_ServiceRegistry
+
+#include <map>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include "Service.h"
+
+
+class ServiceRegistry
+{
+ public:
+  static ServiceRegistry& instance();
+
+  // Replaces any factory already registered for the scheme.
+  void add(const std::string& scheme, ServiceFactory factory);
+
+  // Makes and starts the scheme's service with the policy read for it.
+  ServicePtr create(SecureConnectionPtr connection,
+                    const std::string& scheme,
+                    const std::string& configText);
+
+ private:
+  ServiceRegistry();
+
+  boost::mutex m_mutex;
+  std::map<std::string, ServiceFactory> m_factories;
+  ServiceFactory m_default;
+};
+
+#endif // H_ServiceRegistry
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,601 @@
+/******************************************************************************
+
+  SessionPool.cpp
+
+  SessionPool keeps authenticated SSH sessions alive across SecureConnection
+  objects, and across plugin instances in the same process. Sessions are
+  keyed by user@hostName:port; a SecureConnection that opens to a key which
+  already has a live session borrows it and creates only its own SFTP
+  subsystem, skipping the TCP connect, key exchange and authentication.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cerrno>
+#include <sstream>
+#include <vector>
+
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+
+#include "SessionPool.h"
+
+// Seconds an unreferenced session is kept before it is closed.
+#define DEFAULT_IDLE_TIMEOUT 300
+
+// Seconds between keepalives on a quiet session.
+#define DEFAULT_KEEPALIVE_INTERVAL 60
+
+// Seconds between sweeps for idle sessions.
+#define REAP_INTERVAL 30
+
+
+/*-----------------------------------------------------------------------------*
+
+  Session teardown
+
+  Disconnecting and freeing a non-blocking session can each return
+  LIBSSH2_ERROR_EAGAIN, so they are steps like any other. The socket is
+  detached and closed last.
+
+  *-----------------------------------------------------------------------------*/
+
+static int disconnectSession(LIBSSH2_SESSION *session)
+{
+  return libssh2_session_disconnect(session, "Finished.");
+}
+
+
+static int freeSession(LIBSSH2_SESSION *session)
+{
+  return libssh2_session_free(session);
+}
+
+
+static void closeSocket(ReactorLoop *loop, int sock, int rc)
+{
+  loop->detach(sock);
+#ifdef WIN32
+  closesocket(sock);
+#else
+  close(sock);
+#endif
+}
+
+
+static void sessionDisconnected(ReactorLoop *loop, int sock, LIBSSH2_SESSION *session, int rc)
+{
+  loop->submit(sock,
+               boost::bind(freeSession, session),
+               boost::bind(closeSocket, loop, sock, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PooledSession::PooledSession
+
+  *-----------------------------------------------------------------------------*/
+
+PooledSession::PooledSession(const std::string& key, int sock, ReactorLoop *loop)
+  : m_key(key),
+    m_sock(sock),
+    m_session(libssh2_session_init()),
+    m_loop(loop),
+    m_compressed(false),
+    m_roundTripTime(0),
+    m_bytesReceived(0),
+    m_references(0),
+    m_idleSince(time(NULL))
+{
+  if (m_session)
+  {
+    libssh2_session_set_blocking(m_session, 0);
+
+    *libssh2_session_abstract(m_session) = this;
+    libssh2_session_callback_set(m_session, LIBSSH2_CALLBACK_RECV, (void *) &PooledSession::receive);
+
+    m_loop->attach(m_sock, boost::bind(libssh2_session_block_directions, m_session));
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PooledSession::~PooledSession
+
+  *-----------------------------------------------------------------------------*/
+
+PooledSession::~PooledSession()
+{
+  if (m_session)
+  {
+    // The session outlives this object while it is torn down.
+    *libssh2_session_abstract(m_session) = NULL;
+
+    m_loop->submit(m_sock,
+                   boost::bind(disconnectSession, m_session),
+                   boost::bind(sessionDisconnected, m_loop, m_sock, m_session, _1));
+  }
+  else if (m_sock != -1)
+  {
+#ifdef WIN32
+    closesocket(m_sock);
+#else
+    close(m_sock);
+#endif
+  }
+}
+
+
+const std::string& PooledSession::getKey() const
+{
+  return m_key;
+}
+
+
+void PooledSession::setKey(const std::string& key)
+{
+  m_key = key;
+}
+
+
+LIBSSH2_SESSION *PooledSession::getSession() const
+{
+  return m_session;
+}
+
+
+int PooledSession::getSocket() const
+{
+  return m_sock;
+}
+
+
+ReactorLoop *PooledSession::getLoop() const
+{
+  return m_loop;
+}
+
+
+const std::string& PooledSession::getRemoteAddress() const
+{
+  return m_remoteAddress;
+}
+
+
+void PooledSession::setRemoteAddress(const std::string& address)
+{
+  m_remoteAddress = address;
+}
+
+
+const PooledSession::Algorithms& PooledSession::getAlgorithms() const
+{
+  return m_algorithms;
+}
+
+
+void PooledSession::setAlgorithms(const Algorithms& algorithms)
+{
+  m_algorithms = algorithms;
+}
+
+
+static void recordMethod(LIBSSH2_SESSION *session, int method, const char *name,
+                         PooledSession::Algorithms& algorithms)
+{
+  const char *negotiated = libssh2_session_methods(session, method);
+  if (negotiated)
+    algorithms[name] = negotiated;
+}
+
+
+void PooledSession::recordAlgorithms()
+{
+  Algorithms algorithms;
+
+  recordMethod(m_session, LIBSSH2_METHOD_KEX,     "kex",         algorithms);
+  recordMethod(m_session, LIBSSH2_METHOD_HOSTKEY, "hostkey",     algorithms);
+  recordMethod(m_session, LIBSSH2_METHOD_CRYPT_CS, "cipher",     algorithms);
+  recordMethod(m_session, LIBSSH2_METHOD_MAC_CS,  "mac",         algorithms);
+  recordMethod(m_session, LIBSSH2_METHOD_COMP_SC, "compression", algorithms);
+
+  setAlgorithms(algorithms);
+  setCompressed(algorithms.count("compression") && algorithms["compression"] != "none");
+}
+
+
+bool PooledSession::isCompressed() const
+{
+  return m_compressed;
+}
+
+
+void PooledSession::setCompressed(bool compressed)
+{
+  m_compressed = compressed;
+}
+
+
+bool PooledSession::isLinkFailure(int rc)
+{
+  switch (rc)
+  {
+  case LIBSSH2_ERROR_SOCKET_NONE:
+  case LIBSSH2_ERROR_SOCKET_SEND:
+  case LIBSSH2_ERROR_SOCKET_RECV:
+  case LIBSSH2_ERROR_SOCKET_DISCONNECT:
+  case LIBSSH2_ERROR_SOCKET_TIMEOUT:
+  case LIBSSH2_ERROR_TIMEOUT:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+
+unsigned int PooledSession::getRoundTripTime()
+{
+  boost::mutex::scoped_lock lock(m_statsMutex);
+  return m_roundTripTime;
+}
+
+
+void PooledSession::startKeepalive()
+{
+  m_loop->post(boost::bind(&PooledSession::sampleRoundTripTime, shared_from_this()));
+  m_loop->schedule(SessionPool::instance().getKeepaliveInterval() * 1000,
+                   boost::bind(&PooledSession::keepalive, PooledSessionWeakPtr(shared_from_this())));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PooledSession::keepalive
+
+  Runs on the session's loop. A session with operations in flight is not
+  quiet and needs no keepalive; libssh2 would not accept one in the middle
+  of another operation's packet anyway. The timer holds only a weak pointer,
+  so the keepalives stop once the session is gone.
+
+  *-----------------------------------------------------------------------------*/
+
+void PooledSession::keepalive(PooledSessionWeakPtr weak)
+{
+  PooledSessionPtr session = weak.lock();
+  if (!session)
+    return;
+
+  unsigned int interval = SessionPool::instance().getKeepaliveInterval();
+  unsigned int next = interval ? interval : DEFAULT_KEEPALIVE_INTERVAL;
+
+  session->sampleRoundTripTime();
+
+  if (interval && !session->m_loop->isBusy(session->m_sock))
+  {
+    libssh2_keepalive_config(session->m_session, 1, interval);
+
+    int seconds = 0;
+    int rc = libssh2_keepalive_send(session->m_session, &seconds);
+
+    if (rc == 0 && seconds > 0)
+      next = seconds;
+
+    else if (rc && rc != LIBSSH2_ERROR_EAGAIN)
+    {
+      SessionPool::instance().discard(session);
+      return;
+    }
+  }
+
+  session->m_loop->schedule(next * 1000, boost::bind(&PooledSession::keepalive, weak));
+}
+
+
+void PooledSession::sampleRoundTripTime()
+{
+#ifdef TCP_INFO
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+
+  if (getsockopt(m_sock, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+  {
+    boost::mutex::scoped_lock lock(m_statsMutex);
+    m_roundTripTime = info.tcpi_rtt / 1000;
+  }
+#endif
+}
+
+
+uint64_t PooledSession::getBytesReceived() const
+{
+  return m_bytesReceived;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  PooledSession::receive
+
+  libssh2's recv callback: what libssh2 does by default, and counts the bytes
+  read for getBytesReceived.
+
+  *-----------------------------------------------------------------------------*/
+
+ssize_t PooledSession::receive(libssh2_socket_t sock, void *buffer, size_t length, int flags, void **abstract)
+{
+  ssize_t n = recv(sock, buffer, length, flags);
+  if (n < 0)
+    return -errno;
+
+  PooledSession *session = (PooledSession *) *abstract;
+  if (session)
+    session->m_bytesReceived += n;
+
+  return n;
+}
+
+
+void PooledSession::submit(const ReactorLoop::Step& step, const ReactorLoop::Completion& done)
+{
+  m_loop->submit(m_sock, step, done);
+}
+
+
+void PooledSession::post(const ReactorLoop::Task& task)
+{
+  m_loop->post(task);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::instance
+
+  The pool is process-wide so that every plugin instance loaded into the
+  browser shares it.
+
+  *-----------------------------------------------------------------------------*/
+
+SessionPool& SessionPool::instance()
+{
+  static SessionPool pool;
+  return pool;
+}
+
+
+SessionPool::SessionPool()
+  : m_idleTimeout(DEFAULT_IDLE_TIMEOUT),
+    m_keepaliveInterval(DEFAULT_KEEPALIVE_INTERVAL),
+    m_reaping(false)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::makeKey
+
+  *-----------------------------------------------------------------------------*/
+
+std::string SessionPool::makeKey(const std::string& user,
+                                 const std::string& hostName,
+                                 unsigned int port)
+{
+  std::stringstream key;
+  key << user << "@" << hostName << ":" << port;
+  return key.str();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::acquire
+
+  When several sessions are pooled under the same key, which happens when
+  connections to the same account open at the same time, the one with the
+  fewest borrowers is handed out.
+
+  *-----------------------------------------------------------------------------*/
+
+PooledSessionPtr SessionPool::acquire(const std::string& key)
+{
+  expireIdle();
+
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  PooledSessionPtr best;
+  std::pair<SessionMap::iterator, SessionMap::iterator> range = m_sessions.equal_range(key);
+  for (SessionMap::iterator it = range.first; it != range.second; it++)
+    if (!best || it->second->m_references < best->m_references)
+      best = it->second;
+
+  if (best)
+    best->m_references++;
+
+  return best;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::add
+
+  *-----------------------------------------------------------------------------*/
+
+void SessionPool::add(PooledSessionPtr session)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    session->m_references = 1;
+    m_sessions.insert(std::make_pair(session->m_key, session));
+  }
+
+  session->startKeepalive();
+  startReaper();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::release
+
+  *-----------------------------------------------------------------------------*/
+
+void SessionPool::release(PooledSessionPtr session)
+{
+  if (!session)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (session->m_references > 0 && --session->m_references == 0)
+      session->m_idleSince = time(NULL);
+  }
+
+  expireIdle();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::discard
+
+  *-----------------------------------------------------------------------------*/
+
+void SessionPool::discard(PooledSessionPtr session)
+{
+  if (!session)
+    return;
+
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::pair<SessionMap::iterator, SessionMap::iterator> range = m_sessions.equal_range(session->m_key);
+  for (SessionMap::iterator it = range.first; it != range.second; it++)
+    if (it->second == session)
+    {
+      m_sessions.erase(it);
+      break;
+    }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SessionPool::expireIdle
+
+  Expired sessions are collected under the lock but destroyed after it is
+  released, since closing them talks to the remote host.
+
+  *-----------------------------------------------------------------------------*/
+
+void SessionPool::expireIdle()
+{
+  std::vector<PooledSessionPtr> expired;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    time_t now = time(NULL);
+
+    SessionMap::iterator it = m_sessions.begin();
+    while (it != m_sessions.end())
+    {
+      PooledSessionPtr session = it->second;
+      if (session->m_references == 0 && now - session->m_idleSince >= (time_t) m_idleTimeout)
+      {
+        expired.push_back(session);
+        m_sessions.erase(it++);
+      }
+      else
+        it++;
+    }
+  }
+}
+
+
+unsigned int SessionPool::getIdleTimeout()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_idleTimeout;
+}
+
+
+void SessionPool::setIdleTimeout(unsigned int seconds)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_idleTimeout = seconds;
+  }
+
+  expireIdle();
+}
+
+
+unsigned int SessionPool::getKeepaliveInterval()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  return m_keepaliveInterval;
+}
+
+
+void SessionPool::setKeepaliveInterval(unsigned int seconds)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_keepaliveInterval = seconds;
+}
+
+
+void SessionPool::startReaper()
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (m_reaping)
+      return;
+
+    m_reaping = true;
+  }
+
+  Reactor::instance().any()->schedule(REAP_INTERVAL * 1000, boost::bind(&SessionPool::reap, this));
+}
+
+
+void SessionPool::reap()
+{
+  expireIdle();
+  Reactor::instance().any()->schedule(REAP_INTERVAL * 1000, boost::bind(&SessionPool::reap, this));
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
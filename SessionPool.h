@@ -0,0 +1,207 @@
+/******************************************************************************
+
+  SessionPool.h
+
+  SessionPool keeps authenticated SSH sessions alive across SecureConnection
+  objects, and across plugin instances in the same process. Sessions are
+  keyed by user@hostName:port; a SecureConnection that opens to a key which
+  already has a live session borrows it, skipping the TCP connect, key
+  exchange and authentication; its SFTP subsystems are shared too, see
+  SftpChannelPool.h.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_SessionPool
+#define H_SessionPool
+
+#include <ctime>
+#include <map>
+#include <string>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libssh2.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+
+
+FB_FORWARD_PTR(PooledSession)
+
+class PooledSession : public boost::enable_shared_from_this<PooledSession>
+{
+ public:
+  friend class SessionPool;
+
+  // Creates a non-blocking libssh2 session for a connected socket and
+  // attaches the socket to loop. getSession returns NULL if libssh2 could
+  // not allocate the session.
+  PooledSession(const std::string& key, int sock, ReactorLoop *loop);
+
+  // Disconnects and frees the session and closes its socket. The work is
+  // queued on the session's loop, so this never blocks.
+  ~PooledSession();
+
+  const std::string& getKey() const;
+
+  // Only before the session is shared: a session handshaken ahead of time
+  // is keyed by account once a connection takes it.
+  void setKey(const std::string& key);
+
+  LIBSSH2_SESSION *getSession() const;
+  int getSocket() const;
+  ReactorLoop *getLoop() const;
+
+  // The numeric address of the remote end, for reporting.
+  const std::string& getRemoteAddress() const;
+  void setRemoteAddress(const std::string& address);
+
+  // The algorithms negotiated in the handshake, keyed by "kex", "hostkey",
+  // "cipher", "mac" and "compression".
+  typedef std::map<std::string, std::string> Algorithms;
+  const Algorithms& getAlgorithms() const;
+  void setAlgorithms(const Algorithms& algorithms);
+
+  // Records the algorithms, and whether compression was negotiated, once
+  // the handshake is done.
+  void recordAlgorithms();
+
+  // Whether zlib transport compression was negotiated.
+  bool isCompressed() const;
+  void setCompressed(bool compressed);
+
+  // Whether an error returned by a libssh2 call on a session means the
+  // connection to the host is gone, rather than that the call failed.
+  static bool isLinkFailure(int rc);
+
+  // The kernel's smoothed round-trip time for the socket, in milliseconds,
+  // as of the last keepalive; 0 until it has been measured, and always 0
+  // if the socket is not TCP, as for a session through a Tunnel.
+  unsigned int getRoundTripTime();
+
+  // Bytes read from the socket so far, whichever operation read them. An
+  // operation that finds the count moved during a pass knows that data for
+  // the others may have been queued meanwhile. Only call from the loop.
+  uint64_t getBytesReceived() const;
+
+  // Every call into the session must be made from a step or completion
+  // submitted here, or from a task posted here.
+  void submit(const ReactorLoop::Step& step, const ReactorLoop::Completion& done);
+  void post(const ReactorLoop::Task& task);
+
+ private:
+  // Pooled sessions send a keepalive whenever they have been quiet for the
+  // pool's keepalive interval, so that NAT and firewall state does not time
+  // out. A session whose keepalive fails is discarded from the pool.
+  void startKeepalive();
+  static void keepalive(PooledSessionWeakPtr weak);
+  void sampleRoundTripTime();
+
+  static ssize_t receive(libssh2_socket_t sock, void *buffer, size_t length, int flags, void **abstract);
+
+  std::string m_key;
+  int m_sock;
+  LIBSSH2_SESSION *m_session;
+  ReactorLoop *m_loop;
+  std::string m_remoteAddress;
+  bool m_compressed;
+  Algorithms m_algorithms;
+
+  boost::mutex m_statsMutex;
+  unsigned int m_roundTripTime;
+
+  uint64_t m_bytesReceived;
+
+  // Guarded by the pool's mutex.
+  int m_references;
+  time_t m_idleSince;
+};
+
+
+class SessionPool
+{
+ public:
+  static SessionPool& instance();
+
+  static std::string makeKey(const std::string& user,
+                             const std::string& hostName,
+                             unsigned int port);
+
+  // Returns a live session for key with its reference count incremented, or
+  // an empty pointer if there is none.
+  PooledSessionPtr acquire(const std::string& key);
+
+  // Adds a freshly authenticated session, already acquired once on behalf
+  // of the caller.
+  void add(PooledSessionPtr session);
+
+  // Gives back a reference obtained from acquire or add. The session stays
+  // open until it has been unreferenced for longer than the idle timeout.
+  void release(PooledSessionPtr session);
+
+  // Removes a session that has failed so that no one else acquires it. The
+  // session is closed once its last borrower lets go of it.
+  void discard(PooledSessionPtr session);
+
+  // Closes every unreferenced session idle for longer than the timeout.
+  void expireIdle();
+
+  unsigned int getIdleTimeout();
+  void setIdleTimeout(unsigned int seconds);
+
+  // Seconds between keepalives on a quiet session; 0 disables them.
+  unsigned int getKeepaliveInterval();
+  void setKeepaliveInterval(unsigned int seconds);
+
+ private:
+  SessionPool();
+
+  // Runs expireIdle periodically, so idle sessions are closed even when no
+  // connection comes or goes.
+  void startReaper();
+  void reap();
+
+  typedef std::multimap<std::string, PooledSessionPtr> SessionMap;
+
+  boost::mutex m_mutex;
+  SessionMap m_sessions;
+  unsigned int m_idleTimeout;
+  unsigned int m_keepaliveInterval;
+  bool m_reaping;
+};
+
+#endif // H_SessionPool
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,349 @@
+/******************************************************************************
+
+  SftpChannelPool.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "Admission.h"
+#include "SftpChannelPool.h"
+#include "SftpOperations.h"
+
+// Subsystems per session; well within the channel limit, so that commands
+// have room beside them.
+#define SFTP_POOL_SIZE 4
+
+// Milliseconds a subsystem may sit idle before it is closed, unless it is
+// the pool's last.
+#define SFTP_POOL_IDLE_TIMEOUT 30000
+
+
+boost::mutex SftpChannelPool::s_mutex;
+std::map<PooledSession *, SftpChannelPoolWeakPtr> SftpChannelPool::s_pools;
+unsigned int SftpChannelPool::s_size = SFTP_POOL_SIZE;
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::forSession
+
+  Pools of sessions that have gone are cleared out as new ones are made.
+  A pool holds its session, so a live pool's is never mistaken for a new
+  session at the same address.
+
+  *-----------------------------------------------------------------------------*/
+
+SftpChannelPoolPtr SftpChannelPool::forSession(PooledSessionPtr session)
+{
+  boost::mutex::scoped_lock lock(s_mutex);
+
+  std::map<PooledSession *, SftpChannelPoolWeakPtr>::iterator it = s_pools.find(session.get());
+  if (it != s_pools.end())
+  {
+    SftpChannelPoolPtr pool = it->second.lock();
+    if (pool)
+      return pool;
+  }
+
+  std::map<PooledSession *, SftpChannelPoolWeakPtr>::iterator next;
+  for (it = s_pools.begin(); it != s_pools.end(); it = next)
+  {
+    next = it;
+    next++;
+
+    if (it->second.expired())
+      s_pools.erase(it);
+  }
+
+  SftpChannelPoolPtr pool(new SftpChannelPool(session));
+  s_pools[session.get()] = pool;
+  return pool;
+}
+
+
+unsigned int SftpChannelPool::getSize()
+{
+  boost::mutex::scoped_lock lock(s_mutex);
+  return s_size;
+}
+
+
+void SftpChannelPool::setSize(unsigned int size)
+{
+  boost::mutex::scoped_lock lock(s_mutex);
+  s_size = size ? size : 1;
+}
+
+
+SftpChannelPool::SftpChannelPool(PooledSessionPtr session)
+  : m_session(session),
+    m_open(0),
+    m_opening(0),
+    m_trimming(false)
+{
+}
+
+
+SftpChannelPool::~SftpChannelPool()
+{
+  for (size_t i = 0; i < m_idle.size(); i++)
+    sftpClose(m_session, m_idle[i].sftp);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannel::SftpChannel
+
+  *-----------------------------------------------------------------------------*/
+
+SftpChannel::SftpChannel(SftpChannelPoolPtr pool, LIBSSH2_SFTP *sftp)
+  : m_pool(pool),
+    m_sftp(sftp),
+    m_broken(false)
+{
+}
+
+
+SftpChannel::~SftpChannel()
+{
+  m_pool->giveBack(m_sftp, m_broken);
+}
+
+
+LIBSSH2_SFTP *SftpChannel::get() const
+{
+  return m_sftp;
+}
+
+
+void SftpChannel::setBroken()
+{
+  m_broken = true;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::borrow
+
+  *-----------------------------------------------------------------------------*/
+
+void SftpChannelPool::borrow(const Lender& lender)
+{
+  m_session->post(boost::bind(&SftpChannelPool::lend, shared_from_this(), lender));
+}
+
+
+void SftpChannelPool::giveBack(LIBSSH2_SFTP *sftp, bool broken)
+{
+  m_session->post(boost::bind(&SftpChannelPool::takeBack, shared_from_this(), sftp, broken));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::lend
+
+  The subsystem given back last is lent first, so that the others go idle
+  and can be closed.
+
+  *-----------------------------------------------------------------------------*/
+
+void SftpChannelPool::lend(const Lender& lender)
+{
+  if (!m_idle.empty())
+  {
+    LIBSSH2_SFTP *sftp = m_idle.back().sftp;
+    m_idle.pop_back();
+
+    lender(boost::make_shared<SftpChannel>(shared_from_this(), sftp), 0);
+    return;
+  }
+
+  m_waiting.push_back(lender);
+  grow();
+}
+
+
+void SftpChannelPool::takeBack(LIBSSH2_SFTP *sftp, bool broken)
+{
+  if (!broken)
+  {
+    hand(sftp);
+    return;
+  }
+
+  m_open--;
+  sftpClose(m_session, sftp);
+
+  grow();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::grow
+
+  Starts another subsystem if more are waiting than are being started and
+  the pool is not yet at its size.
+
+  *-----------------------------------------------------------------------------*/
+
+void SftpChannelPool::grow()
+{
+  if (m_waiting.size() <= m_opening || m_open + m_opening >= getSize())
+    return;
+
+  m_opening++;
+
+  Slot slot = boost::make_shared<LIBSSH2_SFTP *>((LIBSSH2_SFTP *) NULL);
+  Admission::instance().admitChannel(m_session, boost::bind(&SftpChannelPool::admitted,
+                                                            shared_from_this(), slot));
+}
+
+
+void SftpChannelPool::admitted(Slot slot)
+{
+  m_session->submit(boost::bind(sftpInit, m_session->getSession(), slot.get()),
+                    boost::bind(&SftpChannelPool::opened, shared_from_this(), slot, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::opened
+
+  A subsystem the host refused while others were open or starting waits
+  for them, in case the host is only at its limit; see Admission.h. If
+  there are none, those waiting are told of the failure.
+
+  *-----------------------------------------------------------------------------*/
+
+void SftpChannelPool::opened(Slot slot, int rc)
+{
+  m_opening--;
+
+  if (rc == 0)
+  {
+    m_open++;
+    hand(*slot);
+    return;
+  }
+
+  if (rc == LIBSSH2_ERROR_CHANNEL_FAILURE)
+  {
+    if (Admission::instance().channelRefused(m_session))
+    {
+      if (m_open == 0 && m_opening == 0)
+        grow();
+
+      return;
+    }
+  }
+  else
+    Admission::instance().releaseChannel(m_session);
+
+  if (m_open || m_opening)
+    return;
+
+  std::deque<Lender> waiting;
+  waiting.swap(m_waiting);
+
+  for (size_t i = 0; i < waiting.size(); i++)
+    waiting[i](SftpChannelPtr(), rc);
+}
+
+
+void SftpChannelPool::hand(LIBSSH2_SFTP *sftp)
+{
+  if (!m_waiting.empty())
+  {
+    Lender lender = m_waiting.front();
+    m_waiting.pop_front();
+
+    lender(boost::make_shared<SftpChannel>(shared_from_this(), sftp), 0);
+    return;
+  }
+
+  Idle idle;
+  idle.sftp = sftp;
+  idle.since = ReactorLoop::now();
+
+  m_idle.push_back(idle);
+  startTrim();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpChannelPool::trim
+
+  Closes the subsystems that have been idle for the timeout, oldest first,
+  leaving the pool at least one open. The check runs only while there is
+  something it might close.
+
+  *-----------------------------------------------------------------------------*/
+
+void SftpChannelPool::startTrim()
+{
+  if (m_trimming || m_open < 2 || m_idle.empty())
+    return;
+
+  m_trimming = true;
+  m_session->getLoop()->schedule(SFTP_POOL_IDLE_TIMEOUT,
+                                 boost::bind(&SftpChannelPool::trim,
+                                             SftpChannelPoolWeakPtr(shared_from_this())));
+}
+
+
+void SftpChannelPool::trim(SftpChannelPoolWeakPtr weak)
+{
+  SftpChannelPoolPtr pool = weak.lock();
+  if (!pool)
+    return;
+
+  pool->m_trimming = false;
+
+  uint64_t now = ReactorLoop::now();
+
+  while (!pool->m_idle.empty() && pool->m_open > 1
+         && now - pool->m_idle.front().since >= SFTP_POOL_IDLE_TIMEOUT)
+  {
+    sftpClose(pool->m_session, pool->m_idle.front().sftp);
+    pool->m_idle.erase(pool->m_idle.begin());
+    pool->m_open--;
+  }
+
+  pool->startTrim();
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
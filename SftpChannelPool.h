@@ -0,0 +1,151 @@
+/******************************************************************************
+
+  SftpChannelPool.h
+
+  Every connection to an account, and every service granted on one, shares
+  the account's PooledSession, and would otherwise start an SFTP subsystem
+  of its own on it: another channel and subsystem handshake per service,
+  each with its requests queued behind one another. A session's channel
+  pool instead lends subsystems to whoever needs one for an operation, and
+  takes them back when the operation is done.
+
+  A borrower is given an idle subsystem if there is one. If not, and the
+  pool has fewer than its size open, another is started for it in a turn
+  on the session (see Admission.h); otherwise it waits for one to be given
+  back. So the pool grows as far as its size while operations overlap,
+  and subsystems left idle for a while are closed again, down to one.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_SftpChannelPool
+#define H_SftpChannelPool
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+#include "SessionPool.h"
+
+
+FB_FORWARD_PTR(SftpChannelPool)
+FB_FORWARD_PTR(SftpChannel)
+
+// A subsystem lent by a pool. It is given back when the last reference to
+// it goes, from whichever thread.
+class SftpChannel
+{
+ public:
+  SftpChannel(SftpChannelPoolPtr pool, LIBSSH2_SFTP *sftp);
+  ~SftpChannel();
+
+  LIBSSH2_SFTP *get() const;
+
+  // A subsystem an operation failed on with a link failure is broken, and
+  // is closed rather than lent again.
+  void setBroken();
+
+ private:
+  SftpChannelPoolPtr m_pool;
+  LIBSSH2_SFTP *m_sftp;
+  bool m_broken;
+};
+
+
+class SftpChannelPool : public boost::enable_shared_from_this<SftpChannelPool>
+{
+  friend class SftpChannel;
+
+ public:
+  // Called on the session's loop with a subsystem, or with none and the
+  // error that kept one from starting.
+  typedef boost::function<void (SftpChannelPtr channel, int rc)> Lender;
+
+  // The session's pool, made if it has none. The pool lasts as long as
+  // someone holds it or a subsystem it lent.
+  static SftpChannelPoolPtr forSession(PooledSessionPtr session);
+
+  // The most subsystems one pool opens; at least 1.
+  static unsigned int getSize();
+  static void setSize(unsigned int size);
+
+  // Closes the subsystems left in the pool.
+  ~SftpChannelPool();
+
+  // May be called from any thread.
+  void borrow(const Lender& lender);
+
+ private:
+  explicit SftpChannelPool(PooledSessionPtr session);
+
+  struct Idle
+  {
+    LIBSSH2_SFTP *sftp;
+    uint64_t since;
+  };
+
+  typedef boost::shared_ptr<LIBSSH2_SFTP *> Slot;
+
+  void giveBack(LIBSSH2_SFTP *sftp, bool broken);
+  void lend(const Lender& lender);
+  void takeBack(LIBSSH2_SFTP *sftp, bool broken);
+  void grow();
+  void admitted(Slot slot);
+  void opened(Slot slot, int rc);
+  void hand(LIBSSH2_SFTP *sftp);
+  void startTrim();
+  static void trim(SftpChannelPoolWeakPtr weak);
+
+  static boost::mutex s_mutex;
+  static std::map<PooledSession *, SftpChannelPoolWeakPtr> s_pools;
+  static unsigned int s_size;
+
+  // Only used on the session's loop.
+  PooledSessionPtr m_session;
+  std::deque<Lender> m_waiting;
+  std::vector<Idle> m_idle;
+  unsigned int m_open;
+  unsigned int m_opening;
+  bool m_trimming;
+};
+
+#endif // H_SftpChannelPool
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,834 @@
+/******************************************************************************
+
+  SftpOperations.cpp
+
+  Non-blocking SFTP operations for use as Reactor steps. Each operation keeps
+  the state it needs between calls to step(), which returns
+  LIBSSH2_ERROR_EAGAIN until the operation has finished, and then 0 or a
+  negative libssh2 error code. Handles opened along the way are always
+  closed before step() reports its result.
+
+  Each operation runs either on a libssh2 SFTP subsystem or on a MuxSftp,
+  for a subsystem opened through a ControlMaster, according to how it was
+  constructed. The results are the same either way.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "Admission.h"
+#include "SftpOperations.h"
+#include "WireFormat.h"
+
+#define DIR_BUFFER_SIZE 1024
+#define FILE_BUFFER_SIZE 4096
+#define PATH_BUFFER_SIZE 4096
+
+// Bytes asked for by each read on a MuxSftp; every SFTP server must allow
+// at least this much.
+#define MUX_READ_SIZE 32768
+
+
+/*-----------------------------------------------------------------------------*
+
+  sftpInit
+
+  *-----------------------------------------------------------------------------*/
+
+int sftpInit(LIBSSH2_SESSION *session, LIBSSH2_SFTP **sftp)
+{
+  if (!*sftp && !(*sftp = libssh2_sftp_init(session)))
+    return libssh2_session_last_errno(session);
+
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  sftpClose
+
+  *-----------------------------------------------------------------------------*/
+
+static void sftpClosed(PooledSessionPtr session, int rc)
+{
+  Admission::instance().releaseChannel(session);
+}
+
+
+void sftpClose(PooledSessionPtr session, LIBSSH2_SFTP *sftp)
+{
+  session->submit(boost::bind(libssh2_sftp_shutdown, sftp),
+                  boost::bind(sftpClosed, session, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadFile::SftpReadFile
+
+  *-----------------------------------------------------------------------------*/
+
+SftpReadFile::SftpReadFile(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path)
+  : m_session(session),
+    m_sftp(sftp),
+    m_handle(NULL),
+    m_path(path),
+    m_state(OPEN),
+    m_opened(false),
+    m_openStatus(0),
+    m_result(0),
+    m_request(0)
+{
+}
+
+
+SftpReadFile::SftpReadFile(MuxSftpPtr mux, const std::string& path)
+  : m_session(NULL),
+    m_sftp(NULL),
+    m_handle(NULL),
+    m_path(path),
+    m_state(OPEN),
+    m_opened(false),
+    m_openStatus(0),
+    m_result(0),
+    m_mux(mux),
+    m_request(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadFile::step
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpReadFile::step()
+{
+  if (m_mux)
+    return stepMux();
+
+  int rc;
+  char buffer[FILE_BUFFER_SIZE];
+
+  for (;;)
+    switch (m_state)
+    {
+    case OPEN:
+      if (!(m_handle = libssh2_sftp_open(m_sftp, m_path.c_str(), LIBSSH2_FXF_READ, 0)))
+      {
+        if ((rc = libssh2_session_last_errno(m_session)) == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+
+        if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL)
+          m_openStatus = libssh2_sftp_last_error(m_sftp);
+
+        m_result = rc ? rc : LIBSSH2_ERROR_SFTP_PROTOCOL;
+        m_state = DONE;
+        break;
+      }
+
+      m_opened = true;
+      m_state = READ;
+      break;
+
+    case READ:
+      while ((rc = libssh2_sftp_read(m_handle, buffer, sizeof(buffer))) > 0)
+        m_contents.append(buffer, rc);
+
+      if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_result = rc;
+      m_state = CLOSE;
+      break;
+
+    case CLOSE:
+      if ((rc = libssh2_sftp_close(m_handle)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_handle = NULL;
+      m_state = DONE;
+      break;
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadFile::stepMux
+
+  The same steps as step, as requests and replies. m_request is the id of
+  the request awaiting its reply, or 0 if the state's request has not yet
+  been sent.
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpReadFile::stepMux()
+{
+  int rc;
+  unsigned char type;
+  std::string payload;
+  size_t offset;
+
+  for (;;)
+    switch (m_state)
+    {
+    case OPEN:
+      if (!m_request)
+      {
+        std::string open;
+        putString(open, m_path);
+        putUint32(open, MuxSftp::FXF_READ);
+        putUint32(open, 0);                 // no attributes
+        m_request = m_mux->request(MuxSftp::FXP_OPEN, open);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      offset = 0;
+
+      if (rc || type != MuxSftp::FXP_HANDLE || !getString(payload, offset, m_muxHandle))
+      {
+        uint32_t status;
+        if (!rc && type == MuxSftp::FXP_STATUS && MuxSftp::statusResult(payload, &status))
+          m_openStatus = status;
+
+        m_result = rc ? rc : LIBSSH2_ERROR_SFTP_PROTOCOL;
+        m_state = DONE;
+        break;
+      }
+
+      m_opened = true;
+      m_state = READ;
+      break;
+
+    case READ:
+      if (!m_request)
+      {
+        std::string read;
+        putString(read, m_muxHandle);
+        putUint64(read, m_contents.length());
+        putUint32(read, MUX_READ_SIZE);
+        m_request = m_mux->request(MuxSftp::FXP_READ, read);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      offset = 0;
+
+      // The handle is open, so every way out of here goes through CLOSE.
+      if (rc)
+      {
+        m_result = rc;
+        m_state = CLOSE;
+        break;
+      }
+
+      if (type == MuxSftp::FXP_DATA)
+      {
+        std::string data;
+        if (getString(payload, offset, data))
+        {
+          m_contents.append(data);
+          break;
+        }
+
+        m_result = LIBSSH2_ERROR_SFTP_PROTOCOL;
+      }
+      else
+      {
+        // Only end of file ends it cleanly; any other reply, or a status
+        // that does not parse, leaves the contents short.
+        uint32_t status = MuxSftp::FX_OK;
+        if (type == MuxSftp::FXP_STATUS)
+          MuxSftp::statusResult(payload, &status);
+
+        if (status != MuxSftp::FX_EOF)
+          m_result = LIBSSH2_ERROR_SFTP_PROTOCOL;
+      }
+
+      m_state = CLOSE;
+      break;
+
+    case CLOSE:
+      if (!m_request)
+      {
+        std::string close;
+        putString(close, m_muxHandle);
+        m_request = m_mux->request(MuxSftp::FXP_CLOSE, close);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      m_state = DONE;
+      break;
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+bool SftpReadFile::wasOpened() const
+{
+  return m_opened;
+}
+
+
+unsigned long SftpReadFile::getOpenStatus() const
+{
+  return m_openStatus;
+}
+
+
+const std::string& SftpReadFile::getPath() const
+{
+  return m_path;
+}
+
+
+const std::string& SftpReadFile::getContents() const
+{
+  return m_contents;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadDir::SftpReadDir
+
+  *-----------------------------------------------------------------------------*/
+
+SftpReadDir::SftpReadDir(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path)
+  : m_session(session),
+    m_sftp(sftp),
+    m_handle(NULL),
+    m_path(path),
+    m_state(OPEN),
+    m_opened(false),
+    m_result(0),
+    m_request(0)
+{
+}
+
+
+SftpReadDir::SftpReadDir(MuxSftpPtr mux, const std::string& path)
+  : m_session(NULL),
+    m_sftp(NULL),
+    m_handle(NULL),
+    m_path(path),
+    m_state(OPEN),
+    m_opened(false),
+    m_result(0),
+    m_mux(mux),
+    m_request(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadDir::step
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpReadDir::step()
+{
+  if (m_mux)
+    return stepMux();
+
+  int rc;
+  char buffer[DIR_BUFFER_SIZE];
+  LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+  for (;;)
+    switch (m_state)
+    {
+    case OPEN:
+      if (!(m_handle = libssh2_sftp_opendir(m_sftp, m_path.c_str())))
+      {
+        if ((rc = libssh2_session_last_errno(m_session)) == LIBSSH2_ERROR_EAGAIN)
+          return rc;
+
+        m_result = rc ? rc : LIBSSH2_ERROR_SFTP_PROTOCOL;
+        m_state = DONE;
+        break;
+      }
+
+      m_opened = true;
+      m_state = READ;
+      break;
+
+    case READ:
+      while ((rc = libssh2_sftp_readdir(m_handle, buffer, sizeof(buffer), &attrs)) > 0)
+        addEntry(std::string(buffer, rc));
+
+      if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_result = rc;
+      m_state = CLOSE;
+      break;
+
+    case CLOSE:
+      if ((rc = libssh2_sftp_closedir(m_handle)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_handle = NULL;
+      m_state = DONE;
+      break;
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpReadDir::stepMux
+
+  As SftpReadFile::stepMux. Each READDIR reply carries a batch of names,
+  until the server answers with end of file.
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpReadDir::stepMux()
+{
+  int rc;
+  unsigned char type;
+  std::string payload;
+  size_t offset;
+
+  for (;;)
+    switch (m_state)
+    {
+    case OPEN:
+      if (!m_request)
+      {
+        std::string open;
+        putString(open, m_path);
+        m_request = m_mux->request(MuxSftp::FXP_OPENDIR, open);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      offset = 0;
+
+      if (rc || type != MuxSftp::FXP_HANDLE || !getString(payload, offset, m_muxHandle))
+      {
+        m_result = rc ? rc : LIBSSH2_ERROR_SFTP_PROTOCOL;
+        m_state = DONE;
+        break;
+      }
+
+      m_opened = true;
+      m_state = READ;
+      break;
+
+    case READ:
+      if (!m_request)
+      {
+        std::string read;
+        putString(read, m_muxHandle);
+        m_request = m_mux->request(MuxSftp::FXP_READDIR, read);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      offset = 0;
+
+      if (rc)
+      {
+        m_result = rc;
+        m_state = CLOSE;
+        break;
+      }
+
+      if (type == MuxSftp::FXP_NAME)
+      {
+        uint32_t count;
+        std::string name;
+        std::string longName;
+
+        bool valid = getUint32(payload, offset, count);
+        for (uint32_t i = 0; valid && i < count; i++)
+          if ((valid = getString(payload, offset, name)
+                       && getString(payload, offset, longName)
+                       && MuxSftp::skipAttributes(payload, offset)))
+            addEntry(name);
+
+        if (valid)
+          break;
+
+        m_result = LIBSSH2_ERROR_SFTP_PROTOCOL;
+      }
+      else
+      {
+        uint32_t status = MuxSftp::FX_OK;
+        if (type == MuxSftp::FXP_STATUS)
+          MuxSftp::statusResult(payload, &status);
+
+        if (status != MuxSftp::FX_EOF)
+          m_result = LIBSSH2_ERROR_SFTP_PROTOCOL;
+      }
+
+      m_state = CLOSE;
+      break;
+
+    case CLOSE:
+      if (!m_request)
+      {
+        std::string close;
+        putString(close, m_muxHandle);
+        m_request = m_mux->request(MuxSftp::FXP_CLOSE, close);
+      }
+
+      if ((rc = m_mux->reply(m_request, type, payload)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_request = 0;
+      m_state = DONE;
+      break;
+
+    case DONE:
+      return m_result;
+    }
+}
+
+
+void SftpReadDir::addEntry(const std::string& name)
+{
+  if (name != "." && name != "..")
+    m_entries.push_back(name);
+}
+
+
+bool SftpReadDir::wasOpened() const
+{
+  return m_opened;
+}
+
+
+const std::string& SftpReadDir::getPath() const
+{
+  return m_path;
+}
+
+
+const std::vector<std::string>& SftpReadDir::getEntries() const
+{
+  return m_entries;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpRealPath::SftpRealPath
+
+  *-----------------------------------------------------------------------------*/
+
+SftpRealPath::SftpRealPath(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path)
+  : m_session(session),
+    m_sftp(sftp),
+    m_path(path),
+    m_request(0)
+{
+}
+
+
+SftpRealPath::SftpRealPath(MuxSftpPtr mux, const std::string& path)
+  : m_session(NULL),
+    m_sftp(NULL),
+    m_path(path),
+    m_mux(mux),
+    m_request(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpRealPath::step
+
+  A single request, so there is no state beyond the request id.
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpRealPath::step()
+{
+  int rc;
+
+  if (!m_mux)
+  {
+    char buffer[PATH_BUFFER_SIZE];
+
+    if ((rc = libssh2_sftp_realpath(m_sftp, m_path.c_str(), buffer, sizeof(buffer))) < 0)
+      return rc;
+
+    m_realPath.assign(buffer, rc);
+    return 0;
+  }
+
+  unsigned char type;
+  std::string payload;
+  size_t offset = 0;
+  uint32_t count;
+
+  if (!m_request)
+  {
+    std::string realPath;
+    putString(realPath, m_path);
+    m_request = m_mux->request(MuxSftp::FXP_REALPATH, realPath);
+  }
+
+  if ((rc = m_mux->reply(m_request, type, payload)))
+    return rc;
+
+  if (type != MuxSftp::FXP_NAME
+      || !getUint32(payload, offset, count)
+      || count != 1
+      || !getString(payload, offset, m_realPath))
+    return LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+  return 0;
+}
+
+
+const std::string& SftpRealPath::getPath() const
+{
+  return m_path;
+}
+
+
+const std::string& SftpRealPath::getRealPath() const
+{
+  return m_realPath;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpStat::SftpStat
+
+  *-----------------------------------------------------------------------------*/
+
+SftpStat::SftpStat(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path)
+  : m_session(session),
+    m_sftp(sftp),
+    m_path(path),
+    m_size(0),
+    m_modified(0),
+    m_request(0)
+{
+}
+
+
+SftpStat::SftpStat(MuxSftpPtr mux, const std::string& path)
+  : m_session(NULL),
+    m_sftp(NULL),
+    m_path(path),
+    m_size(0),
+    m_modified(0),
+    m_mux(mux),
+    m_request(0)
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpStat::step
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpStat::step()
+{
+  int rc;
+
+  if (!m_mux)
+  {
+    LIBSSH2_SFTP_ATTRIBUTES attributes;
+
+    if ((rc = libssh2_sftp_stat(m_sftp, m_path.c_str(), &attributes)))
+      return rc;
+
+    if (!(attributes.flags & LIBSSH2_SFTP_ATTR_SIZE) || !(attributes.flags & LIBSSH2_SFTP_ATTR_ACMODTIME))
+      return LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+    m_size = attributes.filesize;
+    m_modified = attributes.mtime;
+    return 0;
+  }
+
+  unsigned char type;
+  std::string payload;
+  size_t offset = 0;
+  uint32_t flags;
+  uint64_t size;
+  uint32_t modified;
+
+  if (!m_request)
+  {
+    std::string stat;
+    putString(stat, m_path);
+    m_request = m_mux->request(MuxSftp::FXP_STAT, stat);
+  }
+
+  if ((rc = m_mux->reply(m_request, type, payload)))
+    return rc;
+
+  if (type != MuxSftp::FXP_ATTRS
+      || !MuxSftp::getAttributes(payload, offset, flags, size, modified)
+      || !(flags & MuxSftp::ATTR_SIZE)
+      || !(flags & MuxSftp::ATTR_ACMODTIME))
+    return LIBSSH2_ERROR_SFTP_PROTOCOL;
+
+  m_size = size;
+  m_modified = modified;
+  return 0;
+}
+
+
+const std::string& SftpStat::getPath() const
+{
+  return m_path;
+}
+
+
+uint64_t SftpStat::getSize() const
+{
+  return m_size;
+}
+
+
+unsigned long SftpStat::getModified() const
+{
+  return m_modified;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpBatch::SftpBatch
+
+  *-----------------------------------------------------------------------------*/
+
+SftpBatch::SftpBatch(bool serial)
+  : m_serial(serial)
+{
+  for (int i = 0; i < KINDS; i++)
+    m_busy[i] = false;
+}
+
+
+void SftpBatch::add(Kind kind, const ReactorLoop::Step& step, const ReactorLoop::Completion& done)
+{
+  Operation operation;
+  operation.kind = kind;
+  operation.step = step;
+  operation.done = done;
+  operation.started = false;
+
+  m_operations.push_back(operation);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  SftpBatch::step
+
+  Steps every operation that may run, in the order they were added. An
+  operation that finishes may free its kind for one waiting behind it, or
+  add others, so passes are made until one finishes nothing.
+
+  *-----------------------------------------------------------------------------*/
+
+int SftpBatch::step()
+{
+  bool progress = true;
+
+  while (progress)
+  {
+    progress = false;
+
+    std::list<Operation>::iterator it = m_operations.begin();
+    while (it != m_operations.end())
+    {
+      if (!it->started)
+      {
+        if (m_serial && m_busy[it->kind])
+        {
+          it++;
+          continue;
+        }
+
+        it->started = true;
+        m_busy[it->kind] = true;
+      }
+
+      int rc = it->step();
+      if (rc == LIBSSH2_ERROR_EAGAIN)
+      {
+        it++;
+        continue;
+      }
+
+      // Taken off the list first, so that the completion may add to it.
+      Operation operation = *it;
+      it = m_operations.erase(it);
+      m_busy[operation.kind] = false;
+      progress = true;
+
+      operation.done(rc);
+    }
+  }
+
+  return m_operations.empty() ? 0 : LIBSSH2_ERROR_EAGAIN;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
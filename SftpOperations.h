@@ -0,0 +1,241 @@
+/******************************************************************************
+
+  SftpOperations.h
+
+  Non-blocking SFTP operations for use as Reactor steps. Each operation keeps
+  the state it needs between calls to step(), which returns
+  LIBSSH2_ERROR_EAGAIN until the operation has finished, and then 0 or a
+  negative libssh2 error code. Handles opened along the way are always
+  closed before step() reports its result.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_SftpOperations
+#define H_SftpOperations
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+
+#include "APITypes.h"
+
+#include "MuxSftp.h"
+#include "SessionPool.h"
+
+
+// Starts the SFTP subsystem, storing it in *sftp once it is up.
+int sftpInit(LIBSSH2_SESSION *session, LIBSSH2_SFTP **sftp);
+
+// Shuts down an SFTP subsystem from its session's loop. The session is kept
+// alive until the shutdown has finished, and the subsystem's turn on the
+// session is then given up; see Admission.h.
+void sftpClose(PooledSessionPtr session, LIBSSH2_SFTP *sftp);
+
+
+FB_FORWARD_PTR(SftpReadFile)
+
+class SftpReadFile
+{
+ public:
+  SftpReadFile(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path);
+  SftpReadFile(MuxSftpPtr mux, const std::string& path);
+
+  int step();
+
+  // After a failure, tells whether the file could not be opened at all or
+  // failed while being read.
+  bool wasOpened() const;
+
+  // The SFTP status the server refused the open with, such as
+  // LIBSSH2_FX_NO_SUCH_FILE; 0 if it did not refuse it.
+  unsigned long getOpenStatus() const;
+
+  const std::string& getPath() const;
+  const std::string& getContents() const;
+
+ private:
+  enum State { OPEN, READ, CLOSE, DONE };
+
+  int stepMux();
+
+  LIBSSH2_SESSION *m_session;
+  LIBSSH2_SFTP *m_sftp;
+  LIBSSH2_SFTP_HANDLE *m_handle;
+  std::string m_path;
+  std::string m_contents;
+  State m_state;
+  bool m_opened;
+  unsigned long m_openStatus;
+  int m_result;
+
+  // Set instead of the above for a subsystem opened through a
+  // ControlMaster.
+  MuxSftpPtr m_mux;
+  std::string m_muxHandle;
+  uint32_t m_request;
+};
+
+
+FB_FORWARD_PTR(SftpReadDir)
+
+class SftpReadDir
+{
+ public:
+  SftpReadDir(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path);
+  SftpReadDir(MuxSftpPtr mux, const std::string& path);
+
+  int step();
+
+  bool wasOpened() const;
+
+  const std::string& getPath() const;
+
+  // Entry names, without . and ..
+  const std::vector<std::string>& getEntries() const;
+
+ private:
+  enum State { OPEN, READ, CLOSE, DONE };
+
+  int stepMux();
+  void addEntry(const std::string& name);
+
+  LIBSSH2_SESSION *m_session;
+  LIBSSH2_SFTP *m_sftp;
+  LIBSSH2_SFTP_HANDLE *m_handle;
+  std::string m_path;
+  std::vector<std::string> m_entries;
+  State m_state;
+  bool m_opened;
+  int m_result;
+
+  MuxSftpPtr m_mux;
+  std::string m_muxHandle;
+  uint32_t m_request;
+};
+
+
+FB_FORWARD_PTR(SftpRealPath)
+
+class SftpRealPath
+{
+ public:
+  SftpRealPath(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path);
+  SftpRealPath(MuxSftpPtr mux, const std::string& path);
+
+  int step();
+
+  const std::string& getPath() const;
+
+  // The canonical absolute path, with . and .. resolved; "." gives the
+  // user's home directory.
+  const std::string& getRealPath() const;
+
+ private:
+  LIBSSH2_SESSION *m_session;
+  LIBSSH2_SFTP *m_sftp;
+  std::string m_path;
+  std::string m_realPath;
+
+  MuxSftpPtr m_mux;
+  uint32_t m_request;
+};
+
+FB_FORWARD_PTR(SftpStat)
+
+// Stats a path, following links. Fails with LIBSSH2_ERROR_SFTP_PROTOCOL if
+// the server leaves out the size or modification time, so a caller that
+// compares them is never comparing unknowns.
+class SftpStat
+{
+ public:
+  SftpStat(LIBSSH2_SESSION *session, LIBSSH2_SFTP *sftp, const std::string& path);
+  SftpStat(MuxSftpPtr mux, const std::string& path);
+
+  int step();
+
+  const std::string& getPath() const;
+  uint64_t getSize() const;
+
+  // Seconds since the epoch.
+  unsigned long getModified() const;
+
+ private:
+  LIBSSH2_SESSION *m_session;
+  LIBSSH2_SFTP *m_sftp;
+  std::string m_path;
+  uint64_t m_size;
+  unsigned long m_modified;
+
+  MuxSftpPtr m_mux;
+  uint32_t m_request;
+};
+
+FB_FORWARD_PTR(SftpBatch)
+
+// Runs several of the operations above as one step, with their requests in
+// flight together, so that the batch takes about as many round trips as
+// its longest operation. An operation's completion may add more to the
+// batch; as it is called from within the step, it must not submit. The
+// batch finishes once all are done.
+//
+// On a MuxSftp any number may be in flight. libssh2 keeps the state of one
+// open, one stat and one realpath per subsystem, so a serial batch, for a
+// libssh2 subsystem, runs one operation of each kind at a time; reading a
+// file or directory counts as an open.
+class SftpBatch
+{
+ public:
+  enum Kind { KIND_OPEN, KIND_STAT, KIND_REALPATH, KINDS };
+
+  explicit SftpBatch(bool serial);
+
+  void add(Kind kind, const ReactorLoop::Step& step, const ReactorLoop::Completion& done);
+
+  int step();
+
+ private:
+  struct Operation
+  {
+    Kind kind;
+    ReactorLoop::Step step;
+    ReactorLoop::Completion done;
+    bool started;
+  };
+
+  bool m_serial;
+  std::list<Operation> m_operations;
+  bool m_busy[KINDS];
+};
+
+#endif // H_SftpOperations
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,643 @@
+/******************************************************************************
+
+  Tunnel.cpp
+
+  Carries channels on a shared session to local sockets.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "Tunnel.h"
+
+
+// The originator reported in direct-tcpip requests, as OpenSSH reports it
+// for ProxyJump.
+#define ORIGINATOR_HOST "127.0.0.1"
+#define ORIGINATOR_PORT 65535
+
+// The most a tunnel buffers in each direction; beyond it, reading stops
+// until the other side has caught up.
+#define TUNNEL_BUFFER_SIZE 131072
+#define TUNNEL_READ_SIZE 16384
+
+
+/*-----------------------------------------------------------------------------*
+
+  Bastion::Bastion
+
+  *-----------------------------------------------------------------------------*/
+
+Bastion::Bastion(PooledSessionPtr session, const FailureHandler& failureHandler)
+  : m_session(session),
+    m_failureHandler(failureHandler),
+    m_pumping(false),
+    m_failed(false)
+{
+}
+
+
+Bastion::~Bastion()
+{
+  SessionPool::instance().release(m_session);
+}
+
+
+PooledSessionPtr Bastion::getSession() const
+{
+  return m_session;
+}
+
+
+void Bastion::openTunnel(const std::string& hostName,
+                         unsigned int port,
+                         ReactorLoop *loop,
+                         const Callback& done)
+{
+  TunnelPtr tunnel = boost::make_shared<Tunnel>(shared_from_this(), hostName, port, loop, done);
+  m_session->post(boost::bind(&Bastion::addTunnel, shared_from_this(), tunnel));
+}
+
+
+void Bastion::openSubsystem(const std::string& subsystem,
+                            int sock,
+                            ReactorLoop *loop,
+                            const Callback& done)
+{
+  TunnelPtr tunnel = boost::make_shared<Tunnel>(shared_from_this(), subsystem, sock, loop, done);
+  m_session->post(boost::bind(&Bastion::addTunnel, shared_from_this(), tunnel));
+}
+
+
+void Bastion::addTunnel(TunnelPtr tunnel)
+{
+  if (tunnel->m_local == -1)
+  {
+    tunnel->abandon(LIBSSH2_ERROR_SOCKET_NONE);
+    return;
+  }
+
+  if (m_failed)
+  {
+    tunnel->abandon(LIBSSH2_ERROR_SOCKET_DISCONNECT);
+    return;
+  }
+
+  m_tunnels.push_back(tunnel);
+
+  if (!m_pumping)
+  {
+    m_pumping = true;
+    m_session->submit(boost::bind(&Bastion::stepPump, shared_from_this()),
+                      boost::bind(&Bastion::pumpFinished, shared_from_this(), _1));
+  }
+}
+
+
+// The session has failed: no one else should be given it, and every tunnel
+// through it is lost.
+void Bastion::fail()
+{
+  if (m_failed)
+    return;
+
+  m_failed = true;
+  SessionPool::instance().discard(m_session);
+
+  if (m_failureHandler)
+    m_failureHandler(this);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Bastion::stepPump
+
+  One operation on the session steps every tunnel through it, rather than
+  one operation each: libssh2 reads whatever arrives on behalf of any
+  channel, and a tunnel stepped early in a pass would miss data read for it
+  by a later one, with nothing left on the socket to wake it. So passes are
+  repeated until one reads nothing from the socket. The pump finishes when
+  the last tunnel closes.
+
+  *-----------------------------------------------------------------------------*/
+
+int Bastion::stepPump()
+{
+  uint64_t received;
+
+  do
+  {
+    received = m_session->getBytesReceived();
+
+    std::vector<TunnelPtr>::iterator it = m_tunnels.begin();
+    while (it != m_tunnels.end())
+    {
+      int rc = (*it)->step();
+      if (rc == LIBSSH2_ERROR_EAGAIN)
+      {
+        it++;
+        continue;
+      }
+
+      if (PooledSession::isLinkFailure(rc))
+        fail();
+
+      it = m_tunnels.erase(it);
+    }
+  }
+  while (m_session->getBytesReceived() != received && !m_tunnels.empty());
+
+  return m_tunnels.empty() ? 0 : LIBSSH2_ERROR_EAGAIN;
+}
+
+
+// A tunnel may have been added after the pump's last pass. If the session
+// was torn down under the pump, its tunnels are lost with it.
+void Bastion::pumpFinished(int rc)
+{
+  m_pumping = false;
+
+  if (rc)
+  {
+    fail();
+
+    std::vector<TunnelPtr> tunnels;
+    tunnels.swap(m_tunnels);
+
+    for (size_t i = 0; i < tunnels.size(); i++)
+      tunnels[i]->abandon(rc);
+  }
+  else if (!m_tunnels.empty())
+  {
+    m_pumping = true;
+    m_session->submit(boost::bind(&Bastion::stepPump, shared_from_this()),
+                      boost::bind(&Bastion::pumpFinished, shared_from_this(), _1));
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::Tunnel
+
+  *-----------------------------------------------------------------------------*/
+
+Tunnel::Tunnel(BastionPtr bastion,
+               const std::string& hostName,
+               unsigned int port,
+               ReactorLoop *loop,
+               const Bastion::Callback& done)
+  : m_bastion(bastion),
+    m_hostName(hostName),
+    m_port(port),
+    m_loop(bastion->getSession()->getLoop()),
+    m_caller(loop),
+    m_done(done),
+    m_local(-1),
+    m_remote(-1),
+    m_state(OPENING),
+    m_channel(NULL),
+    m_result(0),
+    m_attached(false),
+    m_channelEof(false),
+    m_shutDown(false),
+    m_socketEof(false),
+    m_eofSent(false),
+    m_socketFailed(false),
+    m_socketDone(false)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0)
+  {
+    m_local = fds[0];
+    m_remote = fds[1];
+  }
+}
+
+
+Tunnel::Tunnel(BastionPtr bastion,
+               const std::string& subsystem,
+               int sock,
+               ReactorLoop *loop,
+               const Bastion::Callback& done)
+  : m_bastion(bastion),
+    m_port(0),
+    m_subsystem(subsystem),
+    m_loop(bastion->getSession()->getLoop()),
+    m_caller(loop),
+    m_done(done),
+    m_local(sock),
+    m_remote(-1),
+    m_state(OPENING),
+    m_channel(NULL),
+    m_result(0),
+    m_attached(false),
+    m_channelEof(false),
+    m_shutDown(false),
+    m_socketEof(false),
+    m_eofSent(false),
+    m_socketFailed(false),
+    m_socketDone(false)
+{
+  if (m_local != -1)
+    fcntl(m_local, F_SETFL, fcntl(m_local, F_GETFL) | O_NONBLOCK);
+}
+
+
+Tunnel::~Tunnel()
+{
+  if (m_remote != -1)
+    close(m_remote);
+
+  if (m_local != -1 && !m_attached)
+    close(m_local);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::step
+
+  The channel's side of the tunnel, stepped by the bastion's pump. Returns
+  LIBSSH2_ERROR_EAGAIN until the channel has been freed, then 0 or the
+  error that ended it. Everything else to be done about an open or a close
+  is posted, since steps may not attach, submit or detach.
+
+  *-----------------------------------------------------------------------------*/
+
+int Tunnel::step()
+{
+  LIBSSH2_SESSION *session = m_bastion->getSession()->getSession();
+  int rc;
+
+  switch (m_state)
+  {
+  case OPENING:
+    m_channel = m_subsystem.empty()
+                ? libssh2_channel_direct_tcpip_ex(session,
+                                                  m_hostName.c_str(),
+                                                  m_port,
+                                                  ORIGINATOR_HOST,
+                                                  ORIGINATOR_PORT)
+                : libssh2_channel_open_session(session);
+    if (!m_channel)
+    {
+      if ((rc = libssh2_session_last_errno(session)) == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+      m_result = rc ? rc : LIBSSH2_ERROR_CHANNEL_FAILURE;
+      m_state = CLOSED;
+      m_caller->post(boost::bind(m_done, m_result, -1));
+      return m_result;
+    }
+
+    m_state = m_subsystem.empty() ? OPEN : STARTING;
+    if (m_state == OPEN)
+      m_loop->post(boost::bind(&Tunnel::opened, shared_from_this()));
+
+    return step();
+
+  case STARTING:
+    if ((rc = libssh2_channel_subsystem(m_channel, m_subsystem.c_str())) == LIBSSH2_ERROR_EAGAIN)
+      return rc;
+
+    if (rc)
+    {
+      // The socket's side never started; the socket is closed with the
+      // tunnel.
+      m_result = rc;
+      m_state = CLOSING;
+      m_caller->post(boost::bind(m_done, m_result, -1));
+      return step();
+    }
+
+    m_state = OPEN;
+    m_loop->post(boost::bind(&Tunnel::opened, shared_from_this()));
+    // fall through
+
+  case OPEN:
+    if ((rc = copyChannel()) == LIBSSH2_ERROR_EAGAIN)
+      return rc;
+
+    m_result = rc;
+    m_state = CLOSING;
+    // fall through
+
+  case CLOSING:
+    // An error on the session frees the channel regardless.
+    if ((rc = libssh2_channel_free(m_channel)) == LIBSSH2_ERROR_EAGAIN)
+      return rc;
+
+    m_channel = NULL;
+    m_state = CLOSED;
+    channelClosed();
+    // fall through
+
+  default:
+    return m_result;
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::copyChannel
+
+  Copies what has arrived on the channel to the socket's buffer, and what
+  the socket's side has read to the channel. EOF is passed on each way: once
+  the inner session has shut down its end and everything it wrote has been
+  sent, the channel is sent EOF. The channel is done with once EOF has gone
+  both ways, or the inner session's end has failed; until then, returns
+  LIBSSH2_ERROR_EAGAIN.
+
+  *-----------------------------------------------------------------------------*/
+
+int Tunnel::copyChannel()
+{
+  bool progress = false;
+  char buffer[TUNNEL_READ_SIZE];
+
+  while (!m_channelEof && m_toSocket.length() < TUNNEL_BUFFER_SIZE)
+  {
+    size_t room = std::min(sizeof(buffer), (size_t) TUNNEL_BUFFER_SIZE - m_toSocket.length());
+    ssize_t n = libssh2_channel_read(m_channel, buffer, room);
+
+    if (n == LIBSSH2_ERROR_EAGAIN)
+      break;
+
+    if (n < 0)
+      return n;
+
+    if (n == 0)
+    {
+      m_channelEof = true;
+      progress = true;
+      break;
+    }
+
+    m_toSocket.append(buffer, n);
+    progress = true;
+  }
+
+  if (m_socketFailed)
+    m_toChannel.clear();
+
+  while (!m_toChannel.empty())
+  {
+    ssize_t n = libssh2_channel_write(m_channel, m_toChannel.data(), m_toChannel.length());
+
+    if (n == LIBSSH2_ERROR_EAGAIN)
+      break;
+
+    if (n < 0)
+      return n;
+
+    m_toChannel.erase(0, n);
+    progress = true;
+  }
+
+  if (progress)
+    m_loop->kick(m_local);
+
+  if (m_socketFailed || (m_channelEof && m_eofSent))
+    return 0;
+
+  if (m_socketEof && m_toChannel.empty() && !m_eofSent)
+  {
+    int rc = libssh2_channel_send_eof(m_channel);
+    if (rc)
+      return rc;
+
+    m_eofSent = true;
+    return m_channelEof ? 0 : LIBSSH2_ERROR_EAGAIN;
+  }
+
+  return LIBSSH2_ERROR_EAGAIN;
+}
+
+
+// Whatever the socket's side still has to deliver, it delivers and then
+// finishes; if it has already finished, the tunnel is done.
+void Tunnel::channelClosed()
+{
+  if (m_socketDone)
+    m_loop->post(boost::bind(&Tunnel::finish, shared_from_this()));
+
+  else
+    m_loop->kick(m_local);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::opened
+
+  Runs on the bastion session's loop. The socket's side starts even if the
+  channel has already closed again, to deliver what came through it. The
+  inner session's end of the pair goes to the caller, who closes it if it
+  no longer wants it, which winds the tunnel down.
+
+  *-----------------------------------------------------------------------------*/
+
+void Tunnel::opened()
+{
+  m_loop->attach(m_local, boost::bind(&Tunnel::socketDirections, this));
+  m_attached = true;
+
+  m_loop->submit(m_local,
+                 boost::bind(&Tunnel::stepSocket, shared_from_this()),
+                 boost::bind(&Tunnel::socketFinished, shared_from_this(), _1));
+
+  int sock = m_remote;
+  m_remote = -1;
+  m_caller->post(boost::bind(m_done, 0, sock));
+}
+
+
+// The session went away under the tunnel, or it never reached the pump.
+void Tunnel::abandon(int rc)
+{
+  m_result = rc;
+
+  // The channel went with the session.
+  m_channel = NULL;
+
+  if (m_state == OPENING || m_state == STARTING)
+  {
+    m_state = CLOSED;
+    m_caller->post(boost::bind(m_done, rc, -1));
+  }
+  else if (m_state != CLOSED)
+  {
+    m_state = CLOSED;
+    channelClosed();
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::stepSocket
+
+  The socket's side of the tunnel. Once the far end's EOF has come through
+  the channel and everything before it has been delivered, the socket is
+  shut down for writing, so the inner session sees EOF too. Finishes when
+  the channel has closed and everything that came through it has been
+  delivered, or the inner session's end fails.
+
+  *-----------------------------------------------------------------------------*/
+
+int Tunnel::stepSocket()
+{
+  bool progress = false;
+  char buffer[TUNNEL_READ_SIZE];
+
+  while (!m_socketEof && m_state != CLOSED && m_toChannel.length() < TUNNEL_BUFFER_SIZE)
+  {
+    size_t room = std::min(sizeof(buffer), (size_t) TUNNEL_BUFFER_SIZE - m_toChannel.length());
+    ssize_t n = recv(m_local, buffer, room, 0);
+
+    if (n == 0)
+    {
+      m_socketEof = true;
+      break;
+    }
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        m_socketFailed = true;
+
+      break;
+    }
+
+    m_toChannel.append(buffer, n);
+    progress = true;
+  }
+
+  while (!m_socketFailed && !m_toSocket.empty())
+  {
+    ssize_t n = send(m_local, m_toSocket.data(), m_toSocket.length(), MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        m_socketFailed = true;
+
+      break;
+    }
+
+    m_toSocket.erase(0, n);
+    progress = true;
+  }
+
+  if (m_channelEof && m_toSocket.empty() && !m_shutDown)
+  {
+    shutdown(m_local, SHUT_WR);
+    m_shutDown = true;
+  }
+
+  if (progress || m_socketEof || m_socketFailed)
+    m_loop->kick(m_bastion->getSession()->getSocket());
+
+  if (m_socketFailed || (m_state == CLOSED && m_toSocket.empty()))
+    return 0;
+
+  return LIBSSH2_ERROR_EAGAIN;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Tunnel::socketDirections
+
+  While there is nothing to deliver and nothing more to read -- the buffer
+  for the channel is full, or the inner session has shut down its end --
+  the socket is not watched; the channel's side kicks it once it has made
+  progress.
+
+  *-----------------------------------------------------------------------------*/
+
+int Tunnel::socketDirections()
+{
+  int directions = 0;
+
+  if (!m_toSocket.empty())
+    directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+
+  if (!m_socketEof && m_state != CLOSED && m_toChannel.length() < TUNNEL_BUFFER_SIZE)
+    directions |= LIBSSH2_SESSION_BLOCK_INBOUND;
+
+  return directions ? directions : ReactorLoop::BLOCK_ELSEWHERE;
+}
+
+
+void Tunnel::socketFinished(int rc)
+{
+  m_socketDone = true;
+
+  if (rc)
+    m_socketFailed = true;
+
+  if (m_state == CLOSED)
+    finish();
+
+  else
+    m_loop->kick(m_bastion->getSession()->getSocket());
+}
+
+
+// Both sides are done.
+void Tunnel::finish()
+{
+  m_loop->detach(m_local);
+  close(m_local);
+
+  m_local = -1;
+  m_attached = false;
+  m_bastion.reset();
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,191 @@
+/******************************************************************************
+
+  Tunnel.h
+
+  A Bastion holds an authenticated session, pooled like any other, and the
+  Tunnels open through it. Each Tunnel carries one channel to a local
+  socket: a direct-tcpip channel to a host behind a jump host, carried to
+  the inner session over a socket pair so that it is a PooledSession like
+  any other, on a socket of its own (see JumpHost.h); or a subsystem,
+  carried to a socket handed over by a broker's client (see
+  broker/Broker.h). The Tunnel copies between the channel and its socket on
+  the session's loop.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Tunnel
+#define H_Tunnel
+
+#include <string>
+#include <vector>
+
+#include <libssh2.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "APITypes.h"
+
+#include "Reactor.h"
+#include "SessionPool.h"
+
+
+FB_FORWARD_PTR(Bastion)
+FB_FORWARD_PTR(Tunnel)
+
+class Bastion : public boost::enable_shared_from_this<Bastion>
+{
+ public:
+  // Called with 0 and the inner session's end of the socket pair, which
+  // the caller takes over, or with a negative libssh2 error code and -1.
+  typedef boost::function<void (int, int)> Callback;
+
+  // Told once, when the session fails, so the bastion is not handed out
+  // again.
+  typedef boost::function<void (Bastion *)> FailureHandler;
+
+  // Takes over a reference to session.
+  Bastion(PooledSessionPtr session, const FailureHandler& failureHandler = FailureHandler());
+
+  // Gives the reference back to the pool.
+  ~Bastion();
+
+  PooledSessionPtr getSession() const;
+
+  // Opens a channel to hostName and port, as the bastion resolves them, and
+  // calls done on loop.
+  void openTunnel(const std::string& hostName,
+                  unsigned int port,
+                  ReactorLoop *loop,
+                  const Callback& done);
+
+  // Starts subsystem on a session channel and copies between it and sock,
+  // which is taken over and closed when the channel closes, and calls done
+  // on loop. There is no socket pair, so done is given -1 in either case.
+  void openSubsystem(const std::string& subsystem,
+                     int sock,
+                     ReactorLoop *loop,
+                     const Callback& done);
+
+ private:
+  void addTunnel(TunnelPtr tunnel);
+  void fail();
+
+  int stepPump();
+  void pumpFinished(int rc);
+
+  PooledSessionPtr m_session;
+  FailureHandler m_failureHandler;
+
+  // Only touched from the session's loop.
+  std::vector<TunnelPtr> m_tunnels;
+  bool m_pumping;
+  bool m_failed;
+};
+
+
+class Tunnel : public boost::enable_shared_from_this<Tunnel>
+{
+ public:
+  Tunnel(BastionPtr bastion,
+         const std::string& hostName,
+         unsigned int port,
+         ReactorLoop *loop,
+         const Bastion::Callback& done);
+
+  Tunnel(BastionPtr bastion,
+         const std::string& subsystem,
+         int sock,
+         ReactorLoop *loop,
+         const Bastion::Callback& done);
+
+  // Closes whichever ends of the socket pair are still open here.
+  ~Tunnel();
+
+ private:
+  friend class Bastion;
+
+  enum State { OPENING, STARTING, OPEN, CLOSING, CLOSED };
+
+  // The channel's side, stepped by the bastion's pump on its session's
+  // socket: opens the channel, starts the subsystem if there is one,
+  // copies, and frees it.
+  int step();
+  int copyChannel();
+  void channelClosed();
+
+  void opened();
+  void abandon(int rc);
+
+  // The socket pair's side, an operation on its own end.
+  int stepSocket();
+  int socketDirections();
+  void socketFinished(int rc);
+
+  void finish();
+
+  BastionPtr m_bastion;
+  std::string m_hostName;
+  unsigned int m_port;
+  std::string m_subsystem;
+
+  // The bastion session's loop, on which the tunnel runs, and the loop the
+  // caller is told on.
+  ReactorLoop *m_loop;
+  ReactorLoop *m_caller;
+  Bastion::Callback m_done;
+
+  // The ends of the socket pair: this one, attached to the bastion
+  // session's loop, and the inner session's, until it is handed over. A
+  // subsystem's socket is this end alone.
+  int m_local;
+  int m_remote;
+
+  State m_state;
+  LIBSSH2_CHANNEL *m_channel;
+  int m_result;
+  bool m_attached;
+
+  // EOF each way: from the far end, passed on by shutting down the socket,
+  // and from the inner session, passed on to the channel.
+  bool m_channelEof;
+  bool m_shutDown;
+  bool m_socketEof;
+  bool m_eofSent;
+  bool m_socketFailed;
+  bool m_socketDone;
+
+  std::string m_toSocket;
+  std::string m_toChannel;
+};
+
+#endif // H_Tunnel
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
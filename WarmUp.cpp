@@ -0,0 +1,346 @@
+/******************************************************************************
+
+  WarmUp.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#include <cerrno>
+#include <sstream>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "Admission.h"
+#include "AlgorithmProfile.h"
+#include "JumpHost.h"
+#include "WarmUp.h"
+
+// Milliseconds allowed for connecting, as SecureConnection's defaults.
+#define WARM_ATTEMPT_TIMEOUT 10000
+#define WARM_CONNECT_TIMEOUT 30000
+
+// Seconds a warm session is kept for a connection to take. OpenSSH drops
+// a connection that has not authenticated within LoginGraceTime, two
+// minutes by default, so a session older than this would soon be useless.
+#define WARM_TTL 90
+
+// Warm sessions are negotiated with the settings a connection has unless
+// the script says otherwise.
+#define WARM_PROFILE "auto"
+
+
+/*-----------------------------------------------------------------------------*
+
+  WarmUp::instance
+
+  *-----------------------------------------------------------------------------*/
+
+WarmUp& WarmUp::instance()
+{
+  static WarmUp warmUp;
+  return warmUp;
+}
+
+
+WarmUp::WarmUp()
+{
+}
+
+
+std::string WarmUp::makeKey(const std::string& hostName, unsigned int port)
+{
+  std::stringstream key;
+  key << hostName << ":" << port;
+  return key.str();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  WarmUp::start
+
+  *-----------------------------------------------------------------------------*/
+
+unsigned int WarmUp::start(const std::string& hosts)
+{
+  static const char *separators = ", \t\r\n";
+
+  unsigned int invalid = 0;
+  size_t begin = hosts.find_first_not_of(separators);
+
+  while (begin != std::string::npos)
+  {
+    size_t end = hosts.find_first_of(separators, begin);
+    std::string entry = hosts.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+    begin = hosts.find_first_not_of(separators, end);
+
+    // The account does not matter until authentication.
+    size_t at = entry.rfind('@');
+    if (at != std::string::npos)
+      entry.erase(0, at + 1);
+
+    std::string hostName;
+    unsigned int port;
+    if (!JumpHost::parseHost(entry, hostName, port))
+    {
+      invalid++;
+      continue;
+    }
+
+    std::string key = makeKey(hostName, port);
+    {
+      boost::mutex::scoped_lock lock(m_mutex);
+      if (m_warming.count(key) || m_sessions.count(key))
+        continue;
+
+      m_warming.insert(key);
+    }
+
+    warm(key, hostName, port);
+  }
+
+  return invalid;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  WarmUp::take
+
+  A warm session is only good for a connection that would have negotiated
+  the same algorithms and compression. One whose socket has been closed by
+  the host meanwhile is dropped, and its turn to handshake given back.
+
+  *-----------------------------------------------------------------------------*/
+
+PooledSessionPtr WarmUp::take(const std::string& hostName,
+                              unsigned int port,
+                              CompressionPolicy::Mode compression,
+                              const std::string& algorithmProfile)
+{
+  if (algorithmProfile != WARM_PROFILE)
+    return PooledSessionPtr();
+
+  PooledSessionPtr taken;
+  unsigned int dropped = 0;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::pair<SessionMap::iterator, SessionMap::iterator> range = m_sessions.equal_range(makeKey(hostName, port));
+    SessionMap::iterator it = range.first;
+
+    while (it != range.second)
+    {
+      PooledSessionPtr session = it->second;
+
+      if (!isAlive(session->getSocket()))
+      {
+        m_sessions.erase(it++);
+        dropped++;
+      }
+
+      else if (compression == CompressionPolicy::COMPRESSION_ON && !session->isCompressed())
+        it++;
+
+      else if (compression == CompressionPolicy::COMPRESSION_OFF && session->isCompressed())
+        it++;
+
+      else
+      {
+        m_sessions.erase(it);
+        taken = session;
+        break;
+      }
+    }
+  }
+
+  while (dropped--)
+    Admission::instance().finishHandshake(hostName, port);
+
+  return taken;
+}
+
+
+bool WarmUp::isAlive(int sock)
+{
+  // Anything the host has sent unasked, a disconnect message say, is left
+  // for libssh2 to read.
+  char c;
+  ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  WarmUp::warm
+
+  Each host is warmed on a loop of its own choosing, which the connection
+  that takes the session then runs on. A host is warmed in a turn to
+  handshake with it, as a connection is; the turn is kept with the session
+  until a connection takes it or it expires.
+
+  *-----------------------------------------------------------------------------*/
+
+void WarmUp::warm(const std::string& key, const std::string& hostName, unsigned int port)
+{
+  ReactorLoop *loop = Reactor::instance().assign();
+
+  Admission::instance().admitHandshake(hostName, port, loop,
+                                       boost::bind(&WarmUp::handshakeAdmitted, this, key, hostName, port, loop));
+}
+
+
+void WarmUp::handshakeAdmitted(const std::string& key, const std::string& hostName, unsigned int port,
+                               ReactorLoop *loop)
+{
+  Resolver::instance().resolve(hostName, port, loop,
+                               boost::bind(&WarmUp::hostResolved, this, key, hostName, port, loop, _1, _2));
+}
+
+
+void WarmUp::hostResolved(const std::string& key, const std::string& hostName, unsigned int port,
+                          ReactorLoop *loop, int rc, Resolver::AddressList addresses)
+{
+  if (rc)
+  {
+    abandon(key, hostName, port);
+    return;
+  }
+
+  ConnectorPtr connector = boost::make_shared<Connector>(loop, addresses.get(),
+                                                         WARM_ATTEMPT_TIMEOUT, WARM_CONNECT_TIMEOUT);
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_connectors[key] = connector;
+  }
+
+  connector->start(boost::bind(&WarmUp::socketConnected, this, key, hostName, port, loop, _1));
+}
+
+
+void WarmUp::socketConnected(const std::string& key, const std::string& hostName, unsigned int port,
+                             ReactorLoop *loop, int rc)
+{
+  ConnectorPtr connector;
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    connector = m_connectors[key];
+    m_connectors.erase(key);
+  }
+
+  if (rc)
+  {
+    abandon(key, hostName, port);
+    return;
+  }
+
+  PooledSessionPtr session = boost::make_shared<PooledSession>("", connector->getSocket(), loop);
+  session->setRemoteAddress(connector->getAddress());
+
+  if (!session->getSession())
+  {
+    abandon(key, hostName, port);
+    return;
+  }
+
+  if (CompressionPolicy::instance().choose(CompressionPolicy::COMPRESSION_AUTO,
+                                           session->getRemoteAddress(), session->getSocket()))
+    libssh2_session_flag(session->getSession(), LIBSSH2_FLAG_COMPRESS, 1);
+
+  AlgorithmProfile::instance().apply(WARM_PROFILE, session->getSession());
+
+  session->submit(boost::bind(libssh2_session_startup, session->getSession(), session->getSocket()),
+                  boost::bind(&WarmUp::sessionStarted, this, key, hostName, port, session, _1));
+}
+
+
+void WarmUp::sessionStarted(const std::string& key, const std::string& hostName, unsigned int port,
+                            PooledSessionPtr session, int rc)
+{
+  if (rc)
+  {
+    abandon(key, hostName, port);
+    return;
+  }
+
+  session->recordAlgorithms();
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_warming.erase(key);
+  m_sessions.insert(std::make_pair(key, session));
+
+  session->getLoop()->schedule(WARM_TTL * 1000,
+                               boost::bind(&WarmUp::expire, this, key, hostName, port,
+                                           PooledSessionWeakPtr(session)));
+}
+
+
+void WarmUp::abandon(const std::string& key, const std::string& hostName, unsigned int port)
+{
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_warming.erase(key);
+  }
+
+  Admission::instance().finishHandshake(hostName, port);
+}
+
+
+void WarmUp::expire(const std::string& key, const std::string& hostName, unsigned int port,
+                    PooledSessionWeakPtr weak)
+{
+  PooledSessionPtr session = weak.lock();
+  if (!session)
+    return;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::pair<SessionMap::iterator, SessionMap::iterator> range = m_sessions.equal_range(key);
+    SessionMap::iterator it = range.first;
+
+    while (it != range.second && it->second != session)
+      it++;
+
+    // Taken by a connection, along with its turn.
+    if (it == range.second)
+      return;
+
+    m_sessions.erase(it);
+  }
+
+  Admission::instance().finishHandshake(hostName, port);
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,114 @@
+/******************************************************************************
+
+  WarmUp.h
+
+  A page that knows which hosts it will connect to can name them ahead of
+  time, in the plugin's "warmup" param or through HostServices.warmUp, and
+  their sessions are resolved, connected and key-exchanged in the
+  background as soon as the plugin loads. The first SecureConnection opened
+  to one of them takes a session whose handshake is already done, and goes
+  straight to checking the host key and authenticating.
+
+  Nothing before authentication depends on the account, so warm sessions
+  are kept by host and port and handed to whichever account asks first. A
+  warm session is given up if no one takes it within a while, well inside
+  the time a server allows for authentication.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_WarmUp
+#define H_WarmUp
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+
+#include "CompressionPolicy.h"
+#include "Connector.h"
+#include "Reactor.h"
+#include "Resolver.h"
+#include "SessionPool.h"
+
+
+class WarmUp
+{
+ public:
+  static WarmUp& instance();
+
+  // Starts warming each host in a list of host[:port] entries separated by
+  // commas or white space; an IPv6 address with a port is written in
+  // brackets. A user@ prefix is allowed and ignored. Hosts already warm or
+  // warming are skipped. Returns the number of entries that could not be
+  // parsed.
+  unsigned int start(const std::string& hosts);
+
+  // Takes a warm session to hostName and port, if there is one that was
+  // negotiated as a connection with these settings would negotiate it, or
+  // returns an empty pointer. The session has been handshaken and nothing
+  // more; its key is the caller's to set, and the turn it was handshaken in
+  // is the caller's to finish; see Admission.h.
+  PooledSessionPtr take(const std::string& hostName,
+                        unsigned int port,
+                        CompressionPolicy::Mode compression,
+                        const std::string& algorithmProfile);
+
+ private:
+  WarmUp();
+
+  static std::string makeKey(const std::string& hostName, unsigned int port);
+  static bool isAlive(int sock);
+
+  // The steps of warming a host, as in SecureConnection up to the
+  // handshake.
+  void warm(const std::string& key, const std::string& hostName, unsigned int port);
+  void handshakeAdmitted(const std::string& key, const std::string& hostName, unsigned int port,
+                         ReactorLoop *loop);
+  void hostResolved(const std::string& key, const std::string& hostName, unsigned int port,
+                    ReactorLoop *loop, int rc, Resolver::AddressList addresses);
+  void socketConnected(const std::string& key, const std::string& hostName, unsigned int port,
+                       ReactorLoop *loop, int rc);
+  void sessionStarted(const std::string& key, const std::string& hostName, unsigned int port,
+                      PooledSessionPtr session, int rc);
+  void abandon(const std::string& key, const std::string& hostName, unsigned int port);
+  void expire(const std::string& key, const std::string& hostName, unsigned int port,
+              PooledSessionWeakPtr weak);
+
+  typedef std::multimap<std::string, PooledSessionPtr> SessionMap;
+
+  boost::mutex m_mutex;
+  SessionMap m_sessions;
+  std::set<std::string> m_warming;
+  std::map<std::string, ConnectorPtr> m_connectors;
+};
+
+#endif // H_WarmUp
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
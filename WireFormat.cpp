@@ -0,0 +1,103 @@
+/******************************************************************************
+
+  WireFormat.cpp
+
+  Encoding of the integers and strings of the SSH wire format.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include "WireFormat.h"
+
+
+void putUint32(std::string& data, uint32_t value)
+{
+  data.push_back((char) (value >> 24));
+  data.push_back((char) (value >> 16));
+  data.push_back((char) (value >> 8));
+  data.push_back((char) value);
+}
+
+
+void putUint64(std::string& data, uint64_t value)
+{
+  putUint32(data, (uint32_t) (value >> 32));
+  putUint32(data, (uint32_t) value);
+}
+
+
+void putString(std::string& data, const std::string& value)
+{
+  putUint32(data, value.length());
+  data.append(value);
+}
+
+
+bool getUint32(const std::string& data, size_t& offset, uint32_t& value)
+{
+  if (data.length() < 4 || offset > data.length() - 4)
+    return false;
+
+  const unsigned char *p = (const unsigned char *) data.data() + offset;
+  value = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+
+  offset += 4;
+  return true;
+}
+
+
+bool getUint64(const std::string& data, size_t& offset, uint64_t& value)
+{
+  size_t at = offset;
+  uint32_t high;
+  uint32_t low;
+
+  if (!getUint32(data, at, high) || !getUint32(data, at, low))
+    return false;
+
+  value = ((uint64_t) high << 32) | low;
+  offset = at;
+  return true;
+}
+
+
+bool getString(const std::string& data, size_t& offset, std::string& value)
+{
+  size_t at = offset;
+  uint32_t length;
+
+  if (!getUint32(data, at, length) || length > data.length() - at)
+    return false;
+
+  value.assign(data, at, length);
+  offset = at + length;
+  return true;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,58 @@
+/******************************************************************************
+
+  WireFormat.h
+
+  Encoding of the integers and strings of the SSH wire format (RFC 4251,
+  section 5), which the SFTP and OpenSSH multiplexing protocols also use:
+  integers are big-endian, and strings are preceded by their length.
+
+  The get functions read at offset and advance it past what they read; they
+  return false, leaving the output alone, if data ends first.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_WireFormat
+#define H_WireFormat
+
+#include <string>
+
+#include <stdint.h>
+
+
+void putUint32(std::string& data, uint32_t value);
+void putUint64(std::string& data, uint64_t value);
+void putString(std::string& data, const std::string& value);
+
+bool getUint32(const std::string& data, size_t& offset, uint32_t& value);
+bool getUint64(const std::string& data, size_t& offset, uint64_t& value);
+bool getString(const std::string& data, size_t& offset, std::string& value);
+
+#endif // H_WireFormat
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
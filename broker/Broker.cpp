@@ -0,0 +1,927 @@
+/******************************************************************************
+
+  Broker.cpp
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <algorithm>
+#include <cerrno>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libssh2.h>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "Broker.h"
+#include "CompressionPolicy.h"
+#include "ControlMaster.h"
+#include "KnownHosts.h"
+#include "WireFormat.h"
+
+// From PROTOCOL.mux.
+#define SSHMUX_VER 4
+#define MUX_MSG_HELLO 0x00000001
+#define MUX_C_NEW_SESSION 0x10000002
+#define MUX_S_FAILURE 0x80000003
+#define MUX_S_SESSION_OPENED 0x80000006
+
+// Longest control message accepted from a client.
+#define MAX_MESSAGE_SIZE 262144
+
+// The only subsystem the plugin asks for.
+#define BROKER_SUBSYSTEM "sftp"
+
+// Milliseconds allowed for connecting, as SecureConnection's defaults.
+#define BROKER_ATTEMPT_TIMEOUT 10000
+#define BROKER_CONNECT_TIMEOUT 30000
+
+#define LISTEN_BACKLOG 16
+
+// Milliseconds the broker stops accepting for when it runs out of
+// descriptors, doubled each time in a row that it does, up to the most.
+#define ACCEPT_BACKOFF 100
+#define ACCEPT_BACKOFF_MAX 5000
+
+
+/*-----------------------------------------------------------------------------*
+
+  Broker::Broker
+
+  *-----------------------------------------------------------------------------*/
+
+Broker::Broker(const std::string& path)
+  : m_path(path),
+    m_listener(-1),
+    m_loop(NULL),
+    m_acceptError(0),
+    m_backoff(0),
+    m_isStopped(false)
+{
+}
+
+
+Broker::~Broker()
+{
+  if (m_listener != -1)
+  {
+    if (m_loop)
+      m_loop->detach(m_listener);
+
+    close(m_listener);
+    unlink(m_path.c_str());
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Broker::listen
+
+  The socket is made in a directory only the user can enter, and is itself
+  only the user's, since a client can borrow any session the broker has.
+
+  *-----------------------------------------------------------------------------*/
+
+bool Broker::listen()
+{
+  struct sockaddr_un address;
+
+  if (m_path.empty() || m_path.length() >= sizeof(address.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, m_path.c_str());
+
+  std::string directory = m_path.substr(0, m_path.rfind('/'));
+  if (!directory.empty() && mkdir(directory.c_str(), 0700) && errno != EEXIST)
+    return false;
+
+  if ((m_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return false;
+
+  // A socket no one answers on was left by a broker that has exited.
+  if (connect(m_listener, (struct sockaddr *) &address, sizeof(address)) == 0)
+  {
+    close(m_listener);
+    m_listener = -1;
+    errno = EADDRINUSE;
+    return false;
+  }
+
+  close(m_listener);
+  unlink(m_path.c_str());
+
+  if ((m_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return false;
+
+  mode_t mask = umask(0077);
+  int rc = bind(m_listener, (struct sockaddr *) &address, sizeof(address));
+  umask(mask);
+
+  if (rc || ::listen(m_listener, LISTEN_BACKLOG))
+  {
+    int error = errno;
+    close(m_listener);
+    m_listener = -1;
+    errno = error;
+    return false;
+  }
+
+  return true;
+}
+
+
+static int acceptDirections()
+{
+  return LIBSSH2_SESSION_BLOCK_INBOUND;
+}
+
+
+void Broker::start()
+{
+  m_loop = Reactor::instance().assign();
+
+  m_loop->attach(m_listener, acceptDirections);
+  rearm();
+}
+
+
+void Broker::wait()
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  while (!m_isStopped)
+    m_stopped.wait(lock);
+}
+
+
+void Broker::rearm()
+{
+  m_acceptError = 0;
+  m_loop->submit(m_listener,
+                 boost::bind(&Broker::stepAccept, this),
+                 boost::bind(&Broker::acceptFinished, this, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Broker::stepAccept
+
+  Accepting never finishes while the listener is good; an error other than
+  a client giving up ends it, for acceptFinished to decide what to do. Each
+  client is started from a task, since a step may not attach or submit.
+
+  *-----------------------------------------------------------------------------*/
+
+int Broker::stepAccept()
+{
+  for (;;)
+  {
+    int control = accept4(m_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (control == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return LIBSSH2_ERROR_EAGAIN;
+
+      m_acceptError = errno;
+      return LIBSSH2_ERROR_SOCKET_NONE;
+    }
+
+    m_backoff = 0;
+    m_loop->post(boost::bind(&Broker::accepted, this, control));
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  Broker::acceptFinished
+
+  Running out of descriptors or memory passes as clients finish, so the
+  broker stops accepting for a while and tries again; the pending client
+  stays in the backlog meanwhile, and its sessions with the rest. Any other
+  error means the listener is no good, and the broker stops.
+
+  *-----------------------------------------------------------------------------*/
+
+void Broker::acceptFinished(int rc)
+{
+  int error = m_acceptError;
+
+  if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM)
+  {
+    m_backoff = m_backoff ? std::min(m_backoff * 2, (unsigned int) ACCEPT_BACKOFF_MAX) : ACCEPT_BACKOFF;
+    syslog(LOG_WARNING, "accept: %s; retrying in %u ms", strerror(error), m_backoff);
+
+    m_loop->schedule(m_backoff, boost::bind(&Broker::rearm, this));
+    return;
+  }
+
+  if (error)
+    syslog(LOG_ERR, "accept: %s; stopping", strerror(error));
+  else
+    syslog(LOG_ERR, "listener lost (%d); stopping", rc);
+
+  stop();
+}
+
+
+void Broker::stop()
+{
+  m_loop->detach(m_listener);
+
+  boost::mutex::scoped_lock lock(m_mutex);
+  m_isStopped = true;
+  m_stopped.notify_all();
+}
+
+
+void Broker::accepted(int control)
+{
+  BrokerClientPtr client = boost::make_shared<BrokerClient>(control, Reactor::instance().assign());
+  client->start();
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerClient::BrokerClient
+
+  *-----------------------------------------------------------------------------*/
+
+BrokerClient::BrokerClient(int control, ReactorLoop *loop)
+  : m_control(control),
+    m_loop(loop),
+    m_state(SEND_HELLO),
+    m_attached(false),
+    m_requestId(0)
+{
+}
+
+
+BrokerClient::~BrokerClient()
+{
+  if (m_control != -1)
+    close(m_control);
+
+  for (size_t i = 0; i < m_descriptors.size(); i++)
+    if (m_descriptors[i] != -1)
+      close(m_descriptors[i]);
+}
+
+
+void BrokerClient::start()
+{
+  putUint32(m_out, 8);
+  putUint32(m_out, MUX_MSG_HELLO);
+  putUint32(m_out, SSHMUX_VER);
+
+  BrokerClientPtr self = shared_from_this();
+
+  m_loop->attach(m_control, boost::bind(&BrokerClient::directions, self));
+  m_attached = true;
+
+  m_loop->submit(m_control,
+                 boost::bind(&BrokerClient::step, self),
+                 boost::bind(&BrokerClient::requestReceived, self, _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerClient::step
+
+  Exchanges hellos and reads the request and the descriptors that follow
+  it, which finishes the first operation; once the session has been opened
+  or refused, a second one sends the reply.
+
+  *-----------------------------------------------------------------------------*/
+
+int BrokerClient::step()
+{
+  int rc;
+  std::string message;
+
+  for (;;)
+    switch (m_state)
+    {
+    case SEND_HELLO:
+      if ((rc = flush()))
+        return rc;
+
+      m_state = READ_HELLO;
+      break;
+
+    case READ_HELLO:
+      if ((rc = readMessage(message)))
+        return rc;
+
+      {
+        size_t offset = 0;
+        uint32_t type;
+
+        if (!getUint32(message, offset, type) || type != MUX_MSG_HELLO)
+          return LIBSSH2_ERROR_PROTO;
+      }
+
+      m_state = READ_REQUEST;
+      break;
+
+    case READ_REQUEST:
+      if ((rc = readMessage(message)))
+        return rc;
+
+      if (!parseRequest(message))
+        return LIBSSH2_ERROR_PROTO;
+
+      m_state = RECEIVE_DESCRIPTORS;
+      break;
+
+    case RECEIVE_DESCRIPTORS:
+      while (m_descriptors.size() < 3)
+      {
+        int fd;
+        if ((rc = receiveDescriptor(fd)))
+          return rc;
+
+        m_descriptors.push_back(fd);
+      }
+
+      m_state = OPENING;
+      return 0;
+
+    case SEND_REPLY:
+      if ((rc = flush()))
+        return rc;
+
+      m_state = DONE;
+      return 0;
+
+    default:
+      return 0;
+    }
+}
+
+
+int BrokerClient::directions()
+{
+  if (m_state == OPENING)
+    return ReactorLoop::BLOCK_ELSEWHERE;
+
+  return !m_out.empty() ? LIBSSH2_SESSION_BLOCK_OUTBOUND : LIBSSH2_SESSION_BLOCK_INBOUND;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerClient::requestReceived
+
+  The error output is not needed, nor the second copy of the session's
+  socket. What is left is handed to the tunnel once the session is ready.
+
+  *-----------------------------------------------------------------------------*/
+
+void BrokerClient::requestReceived(int rc)
+{
+  if (rc)
+  {
+    finish();
+    return;
+  }
+
+  close(m_descriptors[2]);
+  m_descriptors[2] = -1;
+
+  close(m_descriptors[1]);
+  m_descriptors[1] = -1;
+
+  if (m_subsystem != BROKER_SUBSYSTEM)
+  {
+    reply("Unsupported subsystem.");
+    return;
+  }
+
+  BrokerSessions::instance().acquire(m_key, m_loop,
+                                     boost::bind(&BrokerClient::bastionAcquired, shared_from_this(), _1, _2));
+}
+
+
+void BrokerClient::bastionAcquired(BastionPtr bastion, const std::string& error)
+{
+  if (!bastion)
+  {
+    reply(error);
+    return;
+  }
+
+  int sock = m_descriptors[0];
+  m_descriptors[0] = -1;
+
+  bastion->openSubsystem(m_subsystem, sock, m_loop,
+                         boost::bind(&BrokerClient::subsystemOpened, shared_from_this(), _1, _2));
+}
+
+
+void BrokerClient::subsystemOpened(int rc, int sock)
+{
+  reply(rc ? "Subsystem request failed." : "");
+}
+
+
+void BrokerClient::reply(const std::string& error)
+{
+  std::string message;
+
+  if (error.empty())
+  {
+    putUint32(message, MUX_S_SESSION_OPENED);
+    putUint32(message, m_requestId);
+    putUint32(message, 0);
+  }
+  else
+  {
+    putUint32(message, MUX_S_FAILURE);
+    putUint32(message, m_requestId);
+    putString(message, error);
+  }
+
+  putUint32(m_out, message.length());
+  m_out.append(message);
+
+  m_state = SEND_REPLY;
+  m_loop->submit(m_control,
+                 boost::bind(&BrokerClient::step, shared_from_this()),
+                 boost::bind(&BrokerClient::finish, shared_from_this()));
+}
+
+
+// The session goes on without the control connection; the client closes
+// its end of the socket pair to end it.
+void BrokerClient::finish()
+{
+  if (m_attached)
+  {
+    m_loop->detach(m_control);
+    m_attached = false;
+  }
+
+  close(m_control);
+  m_control = -1;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerClient::parseRequest
+
+  A new session request, with neither a tty nor forwarding, for a
+  subsystem, and with the account among its environment strings.
+
+  *-----------------------------------------------------------------------------*/
+
+bool BrokerClient::parseRequest(const std::string& message)
+{
+  size_t offset = 0;
+  uint32_t type;
+  std::string reserved;
+  uint32_t tty, x11, agent, subsystem, escape;
+  std::string terminal;
+
+  if (!getUint32(message, offset, type) || type != MUX_C_NEW_SESSION
+      || !getUint32(message, offset, m_requestId)
+      || !getString(message, offset, reserved)
+      || !getUint32(message, offset, tty)
+      || !getUint32(message, offset, x11)
+      || !getUint32(message, offset, agent)
+      || !getUint32(message, offset, subsystem)
+      || !getUint32(message, offset, escape)
+      || !getString(message, offset, terminal)
+      || !getString(message, offset, m_subsystem))
+    return false;
+
+  if (tty || x11 || agent || !subsystem)
+    return false;
+
+  std::string variable;
+  while (offset < message.length())
+  {
+    if (!getString(message, offset, variable))
+      return false;
+
+    ControlMaster::parseBrokerAccount(variable, m_key);
+  }
+
+  return !m_key.empty();
+}
+
+
+int BrokerClient::flush()
+{
+  while (!m_out.empty())
+  {
+    ssize_t n = send(m_control, m_out.data(), m_out.length(), MSG_NOSIGNAL);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_SEND;
+    }
+
+    m_out.erase(0, n);
+  }
+
+  return 0;
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerClient::readMessage
+
+  Reads exactly one length-prefixed message and no further: the descriptors
+  follow the request, and a read that ran on into them would lose them.
+
+  *-----------------------------------------------------------------------------*/
+
+int BrokerClient::readMessage(std::string& message)
+{
+  char buffer[4096];
+  size_t offset = 0;
+  uint32_t length = 0;
+
+  for (;;)
+  {
+    size_t wanted;
+
+    offset = 0;
+    if (!getUint32(m_in, offset, length))
+      wanted = 4 - m_in.length();
+
+    else if (length > MAX_MESSAGE_SIZE)
+      return LIBSSH2_ERROR_PROTO;
+
+    else if (m_in.length() - 4 < length)
+      wanted = 4 + length - m_in.length();
+
+    else
+      break;
+
+    ssize_t n = recv(m_control, buffer, std::min(wanted, sizeof(buffer)), 0);
+
+    if (n == 0)
+      return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_RECV;
+    }
+
+    m_in.append(buffer, n);
+  }
+
+  message = m_in.substr(4, length);
+  m_in.clear();
+  return 0;
+}
+
+
+int BrokerClient::receiveDescriptor(int& fd)
+{
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  for (;;)
+  {
+    ssize_t n = recvmsg(m_control, &msg, MSG_CMSG_CLOEXEC);
+
+    if (n == 0)
+      return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno == EAGAIN || errno == EWOULDBLOCK ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_SOCKET_RECV;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+      return LIBSSH2_ERROR_PROTO;
+
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+  }
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerSessions::instance
+
+  *-----------------------------------------------------------------------------*/
+
+BrokerSessions& BrokerSessions::instance()
+{
+  static BrokerSessions sessions;
+  return sessions;
+}
+
+
+BrokerSessions::BrokerSessions()
+{
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerSessions::acquire
+
+  A session in use is shared, and so is one being opened. A session no
+  one is using stays in the pool until it has been idle for the pool's
+  timeout, so a page that is reloaded finds it there.
+
+  *-----------------------------------------------------------------------------*/
+
+void BrokerSessions::acquire(const std::string& key, ReactorLoop *loop, const Callback& done)
+{
+  Waiter waiter;
+  waiter.loop = loop;
+  waiter.done = done;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    std::map<std::string, BastionWeakPtr>::iterator it = m_bastions.find(key);
+    if (it != m_bastions.end())
+    {
+      BastionPtr bastion = it->second.lock();
+      if (bastion)
+      {
+        loop->post(boost::bind(done, bastion, std::string()));
+        return;
+      }
+
+      m_bastions.erase(it);
+    }
+
+    bool opening = m_pending.count(key) != 0;
+    m_pending[key].push_back(waiter);
+
+    if (opening)
+      return;
+  }
+
+  PooledSessionPtr session = SessionPool::instance().acquire(key);
+  if (session)
+  {
+    finish(key, session, "");
+    return;
+  }
+
+  // Keyed user@hostName:port; an IPv6 address has colons of its own.
+  size_t at = key.find('@');
+  size_t colon = key.rfind(':');
+
+  if (at == std::string::npos || colon == std::string::npos || colon < at)
+  {
+    finish(key, PooledSessionPtr(), "Invalid account.");
+    return;
+  }
+
+  BrokerOpenPtr open = boost::make_shared<BrokerOpen>(key,
+                                                      key.substr(0, at),
+                                                      key.substr(at + 1, colon - at - 1),
+                                                      atoi(key.substr(colon + 1).c_str()));
+  open->start();
+}
+
+
+void BrokerSessions::finish(const std::string& key, PooledSessionPtr session, const std::string& error)
+{
+  BastionPtr bastion;
+  if (session)
+    bastion = boost::make_shared<Bastion>(session, boost::bind(&BrokerSessions::forget, this, key, _1));
+
+  std::vector<Waiter> waiters;
+
+  {
+    boost::mutex::scoped_lock lock(m_mutex);
+
+    waiters.swap(m_pending[key]);
+    m_pending.erase(key);
+
+    if (bastion)
+      m_bastions[key] = bastion;
+  }
+
+  for (size_t i = 0; i < waiters.size(); i++)
+    waiters[i].loop->post(boost::bind(waiters[i].done, bastion, error));
+}
+
+
+void BrokerSessions::forget(const std::string& key, Bastion *bastion)
+{
+  boost::mutex::scoped_lock lock(m_mutex);
+
+  std::map<std::string, BastionWeakPtr>::iterator it = m_bastions.find(key);
+  if (it == m_bastions.end())
+    return;
+
+  BastionPtr current = it->second.lock();
+  if (!current || current.get() == bastion)
+    m_bastions.erase(it);
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerOpen::BrokerOpen
+
+  *-----------------------------------------------------------------------------*/
+
+BrokerOpen::BrokerOpen(const std::string& key,
+                       const std::string& user,
+                       const std::string& hostName,
+                       unsigned int port)
+  : m_key(key),
+    m_user(user),
+    m_hostName(hostName),
+    m_port(port),
+    m_loop(Reactor::instance().assign())
+{
+}
+
+
+void BrokerOpen::start()
+{
+  Resolver::instance().resolve(m_hostName, m_port, m_loop,
+                               boost::bind(&BrokerOpen::hostResolved, shared_from_this(), _1, _2));
+}
+
+
+void BrokerOpen::hostResolved(int rc, Resolver::AddressList addresses)
+{
+  if (rc)
+  {
+    fail("Cannot resolve remote host.");
+    return;
+  }
+
+  m_connector = boost::make_shared<Connector>(m_loop, addresses.get(),
+                                              BROKER_ATTEMPT_TIMEOUT, BROKER_CONNECT_TIMEOUT);
+  m_connector->start(boost::bind(&BrokerOpen::socketConnected, shared_from_this(), _1));
+}
+
+
+void BrokerOpen::socketConnected(int rc)
+{
+  ConnectorPtr connector = m_connector;
+  m_connector.reset();
+
+  if (rc)
+  {
+    fail("Unable to connect to remote host.");
+    return;
+  }
+
+  m_session = boost::make_shared<PooledSession>(m_key, connector->getSocket(), m_loop);
+  m_session->setRemoteAddress(connector->getAddress());
+
+  if (!m_session->getSession())
+  {
+    fail("Cannot initialize secure session.");
+    return;
+  }
+
+  if (CompressionPolicy::instance().choose(CompressionPolicy::COMPRESSION_AUTO,
+                                           m_session->getRemoteAddress(), m_session->getSocket()))
+    libssh2_session_flag(m_session->getSession(), LIBSSH2_FLAG_COMPRESS, 1);
+
+  m_session->submit(boost::bind(libssh2_session_startup, m_session->getSession(), m_session->getSocket()),
+                    boost::bind(&BrokerOpen::sessionStarted, shared_from_this(), _1));
+}
+
+
+/*-----------------------------------------------------------------------------*
+
+  BrokerOpen::sessionStarted
+
+  An unknown host would have to be asked about, so it is refused, as are
+  changed and revoked keys.
+
+  *-----------------------------------------------------------------------------*/
+
+void BrokerOpen::sessionStarted(int rc)
+{
+  if (rc)
+  {
+    fail("Cannot start session with host.");
+    return;
+  }
+
+  m_session->recordAlgorithms();
+
+  size_t length;
+  int type;
+  const char *key = libssh2_session_hostkey(m_session->getSession(), &length, &type);
+
+  if (!key || KnownHosts::instance().check(m_hostName, m_port, key, length) != KnownHosts::HOST_KEY_MATCH)
+  {
+    fail("Host key is not known.");
+    return;
+  }
+
+  KeyAuthenticationPtr keys = boost::make_shared<KeyAuthentication>(m_session->getSession(), m_user);
+  m_session->submit(boost::bind(&KeyAuthentication::step, keys),
+                    boost::bind(&BrokerOpen::keysAuthenticated, shared_from_this(), keys, _1));
+}
+
+
+void BrokerOpen::keysAuthenticated(KeyAuthenticationPtr keys, int rc)
+{
+  if (rc)
+  {
+    fail("No key was accepted.");
+    return;
+  }
+
+  KeyAuthentication::rememberMethod(m_key, KeyAuthentication::METHOD_PUBLICKEY);
+
+  SessionPool::instance().add(m_session);
+  BrokerSessions::instance().finish(m_key, m_session, "");
+  m_session.reset();
+}
+
+
+void BrokerOpen::fail(const std::string& error)
+{
+  m_session.reset();
+  BrokerSessions::instance().finish(m_key, PooledSessionPtr(), error);
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,233 @@
+/******************************************************************************
+
+  Broker.h
+
+  Each page that uses JS/HS loads its own copy of the plugin, and a
+  connection lasts no longer than its page, so without help every tab and
+  every reload opens its sessions again. jshs-broker is an optional process
+  of the user's that owns sessions on the plugin's behalf: it outlives
+  pages, so a session opened for one page is there for the next, and the
+  key exchange and encryption for its sessions run on its own cores rather
+  than in the browser.
+
+  The broker listens on ~/.jshs/broker.sock and speaks the part of
+  OpenSSH's multiplexing protocol (PROTOCOL.mux) that MuxRequest speaks to
+  a ControlMaster: a request for the "sftp" subsystem, with the account in
+  the session's environment (see ControlMaster.h) and the client's end of a
+  socket pair passed along with it. The broker runs the subsystem over the
+  socket it is handed, through a Tunnel (see Tunnel.h) on the account's
+  session, so the data never passes through the control socket; in the
+  plugin it is spoken by MuxSftp, as for a ControlMaster.
+
+  The broker has no one to ask for a password or about an unknown host
+  key, so it only opens sessions to hosts in known_hosts, and only
+  authenticates with keys: those held by ssh-agent and those in ~/.ssh.
+  For any other account it refuses, and the plugin opens the session
+  itself.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+#ifndef H_Broker
+#define H_Broker
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "APITypes.h"
+
+#include "Connector.h"
+#include "KeyAuthentication.h"
+#include "Reactor.h"
+#include "Resolver.h"
+#include "SessionPool.h"
+#include "Tunnel.h"
+
+
+class Broker
+{
+ public:
+  explicit Broker(const std::string& path);
+  ~Broker();
+
+  // Binds and listens on the control socket, taking over one left behind
+  // by a broker that is no longer running. Returns false, with errno set,
+  // if it cannot; EADDRINUSE if a broker is running. Nothing is started
+  // yet, so the caller may still fork.
+  bool listen();
+
+  // Starts accepting requests.
+  void start();
+
+  // Blocks until the broker stops accepting for good, which it does only
+  // if the listener fails.
+  void wait();
+
+ private:
+  void rearm();
+  int stepAccept();
+  void acceptFinished(int rc);
+  void accepted(int control);
+  void stop();
+
+  std::string m_path;
+  int m_listener;
+  ReactorLoop *m_loop;
+
+  // Only used on the loop.
+  int m_acceptError;
+  unsigned int m_backoff;
+
+  boost::mutex m_mutex;
+  boost::condition_variable m_stopped;
+  bool m_isStopped;
+};
+
+
+FB_FORWARD_PTR(BrokerClient)
+
+class BrokerClient : public boost::enable_shared_from_this<BrokerClient>
+{
+ public:
+  // Takes over the control connection.
+  BrokerClient(int control, ReactorLoop *loop);
+  ~BrokerClient();
+
+  void start();
+
+ private:
+  enum State { SEND_HELLO, READ_HELLO, READ_REQUEST, RECEIVE_DESCRIPTORS, OPENING, SEND_REPLY, DONE };
+
+  int step();
+  int directions();
+  void requestReceived(int rc);
+  void bastionAcquired(BastionPtr bastion, const std::string& error);
+  void subsystemOpened(int rc, int sock);
+  void reply(const std::string& error);
+  void finish();
+
+  bool parseRequest(const std::string& message);
+  int flush();
+  int readMessage(std::string& message);
+  int receiveDescriptor(int& fd);
+
+  int m_control;
+  ReactorLoop *m_loop;
+  State m_state;
+  bool m_attached;
+
+  std::string m_out;
+  std::string m_in;
+
+  uint32_t m_requestId;
+  std::string m_key;
+  std::string m_subsystem;
+
+  // The session's input, output and error output, as the client passed
+  // them; input and output are the same socket.
+  std::vector<int> m_descriptors;
+};
+
+
+// Opens the broker's sessions and shares them among its clients, as
+// JumpHost shares bastions among connections.
+class BrokerSessions
+{
+ public:
+  typedef boost::function<void (BastionPtr, const std::string&)> Callback;
+
+  static BrokerSessions& instance();
+
+  // Calls done on loop with the session for the account, keyed as in
+  // SessionPool, or with an empty pointer and the reason it could not be
+  // opened.
+  void acquire(const std::string& key, ReactorLoop *loop, const Callback& done);
+
+ private:
+  friend class BrokerOpen;
+
+  BrokerSessions();
+
+  void finish(const std::string& key, PooledSessionPtr session, const std::string& error);
+  void forget(const std::string& key, Bastion *bastion);
+
+  struct Waiter
+  {
+    ReactorLoop *loop;
+    Callback done;
+  };
+
+  boost::mutex m_mutex;
+  std::map<std::string, BastionWeakPtr> m_bastions;
+  std::map<std::string, std::vector<Waiter> > m_pending;
+};
+
+
+FB_FORWARD_PTR(BrokerOpen)
+
+// The steps of opening a session, as in SecureConnection, without the
+// questions a SecureConnection can put to the user.
+class BrokerOpen : public boost::enable_shared_from_this<BrokerOpen>
+{
+ public:
+  BrokerOpen(const std::string& key,
+             const std::string& user,
+             const std::string& hostName,
+             unsigned int port);
+
+  void start();
+
+ private:
+  void hostResolved(int rc, Resolver::AddressList addresses);
+  void socketConnected(int rc);
+  void sessionStarted(int rc);
+  void keysAuthenticated(KeyAuthenticationPtr keys, int rc);
+  void fail(const std::string& error);
+
+  std::string m_key;
+  std::string m_user;
+  std::string m_hostName;
+  unsigned int m_port;
+  ReactorLoop *m_loop;
+
+  ConnectorPtr m_connector;
+  PooledSessionPtr m_session;
+};
+
+#endif // H_Broker
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End:
@@ -0,0 +1,101 @@
+/******************************************************************************
+
+  main.cpp
+
+  jshs-broker [-f] [socket]
+
+  Runs the session broker; see Broker.h. It detaches from the terminal
+  unless -f is given. The socket defaults to ~/.jshs/broker.sock, where
+  the plugin looks for it.
+
+  ---------------------------------------------------------------------------
+
+  This file is part of JS/HS.
+
+  JS/HS is free software: you can redistribute it and/or modify it under the
+  terms of the GNU General Public License as published by the Free Software
+  Foundation, either version 3 of the License, or (at your option) any later
+  version.
+
+  JS/HS is distributed in the hope that it will be useful, but WITHOUT ANY
+  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+  details.
+
+  You should have received a copy of the GNU General Public License along with
+  JS/HS.  If not, see <http://www.gnu.org/licenses/>.
+
+  ---------------------------------------------------------------------------
+
+  Copyright 2011 Pat M. Lasswell.
+
+ ******************************************************************************/
+
+
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <syslog.h>
+#include <unistd.h>
+
+#include <libssh2.h>
+
+#include "Broker.h"
+#include "ControlMaster.h"
+
+
+int main(int argc, char **argv)
+{
+  bool foreground = false;
+  std::string path = ControlMaster::getBrokerPath();
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-f") == 0)
+      foreground = true;
+
+    else if (argv[i][0] != '-')
+      path = argv[i];
+
+    else
+    {
+      fprintf(stderr, "usage: %s [-f] [socket]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  openlog("jshs-broker", LOG_PID | (foreground ? LOG_PERROR : 0), LOG_DAEMON);
+
+  Broker broker(path);
+  if (!broker.listen())
+  {
+    perror(path.c_str());
+    return 1;
+  }
+
+  // The reactor's threads are started by the broker, so after the fork.
+  if (!foreground && daemon(0, 0))
+  {
+    perror("daemon");
+    return 1;
+  }
+
+  if (libssh2_init(0))
+    return 1;
+
+  broker.start();
+  broker.wait();
+
+  // The listener failed; the broker's sessions go with it.
+  return 1;
+}
+
+
+// Local Variables:
+// mode: c++
+// c-basic-offset: 2
+// indent-tabs-mode: nil
+// End: